@@ -67,7 +67,7 @@ size 	= 1
 addr 	= int((0x37 << 1) | 0x80)
 print "Reading from addr %02x"%(addr)
 rdBytes	= spi.readBytes(addr, size)
-print "readBytes return: ", rdBytes, " first element: ", rdBytes[0]
+print "readBytes return: ", list(bytearray(rdBytes)), " first element: ", bytearray(rdBytes)[0]
 
 
 # perform a read 
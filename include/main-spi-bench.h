@@ -0,0 +1,57 @@
+#ifndef _MAIN_SPI_BENCH_H_
+#define _MAIN_SPI_BENCH_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <getopt.h>
+
+#include <onion-debug.h>
+
+#include <onion-spi.h>
+#include <onion-spi-sim.h>
+#include <onion-spi-mmio.h>
+
+
+#define SPI_BENCH_API_TRANSFER			"transfer"
+#define SPI_BENCH_API_WRITE				"write"
+#define SPI_BENCH_API_READ				"read"
+#define SPI_BENCH_API_SEGMENTS			"segments"
+
+#define SPI_BENCH_DEFAULT_APIS			"transfer,write,read,segments"
+#define SPI_BENCH_DEFAULT_SIZES			"1,4,16,64,256,1024,4096"
+#define SPI_BENCH_DEFAULT_SEGMENTS		"2,8"
+#define SPI_BENCH_DEFAULT_SPEEDS		"1000000"
+#define SPI_BENCH_DEFAULT_ITERATIONS	1000
+
+#define SPI_BENCH_MAX_VALUES			32		// entries in each comma separated list
+
+
+// type definitions
+typedef enum e_SpiBenchFormat {
+	SPI_BENCH_FORMAT_CSV 		= 0,
+	SPI_BENCH_FORMAT_JSON,
+} eSpiBenchFormat;
+
+// one measured configuration
+struct spiBenchResult {
+	const char 	*api;
+	int 		bytes;
+	int 		segments;
+	int 		speedInHz;
+	int 		iterations;
+	int 		failures;
+
+	double 		seconds;
+	double 		transfersPerSec;
+	double 		bytesPerSec;
+
+	// latency of a single call, microseconds
+	double 		p50;
+	double 		p90;
+	double 		p99;
+	double 		max;
+};
+
+
+#endif // _MAIN_SPI_BENCH_H_
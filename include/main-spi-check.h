@@ -0,0 +1,58 @@
+#ifndef _MAIN_SPI_CHECK_H_
+#define _MAIN_SPI_CHECK_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <onion-debug.h>
+
+#include <onion-spi.h>
+#include <onion-spi-mmio.h>
+#include <onion-spi-gpio.h>
+#include <onion-spi-sim.h>
+#include <onion-spi-async.h>
+#include <onion-spi-stream.h>
+
+
+#define SPI_CHECK_LOADER_BUS			30		// first bus used by the loader check, must not exist
+#define SPI_CHECK_LOADER_BUSES			2
+
+#define SPI_CHECK_BYTES					4		// bytes sent by each transfer check
+#define SPI_CHECK_TIMEOUT_MS			1000	// longest wait for a transfer to complete
+
+#define SPI_CHECK_ASYNC_REQUESTS		3
+#define SPI_CHECK_ASYNC_SPEED			1000000
+#define SPI_CHECK_ASYNC_BUSY_US			20000	// delay of the first request, while the others are queued
+#define SPI_CHECK_ASYNC_DELAY_US		100
+
+#define SPI_CHECK_ARBITER_WAIT_MS		50		// time given to a transfer that must stay blocked
+
+// lines of the GPIO chip given with --gpiochip
+#define SPI_CHECK_GPIO_SCK				0
+#define SPI_CHECK_GPIO_MOSI				1
+#define SPI_CHECK_GPIO_MISO				2
+#define SPI_CHECK_GPIO_CS				3
+
+
+// type definitions
+// what the stub module loader was asked to do
+struct spiCheckLoader {
+	int 		calls;
+	char 		moduleName[64];
+	char 		moduleParams[SPI_MODULE_PARAMS_SIZE];
+};
+
+// a stream or a transfer run on its own thread
+struct spiCheckThread {
+	struct spiParams 	*params;
+	int 		inFd;			// input of the stream
+	int 		status;
+	int 		bDone;
+};
+
+
+#endif // _MAIN_SPI_CHECK_H_
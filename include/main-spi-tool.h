@@ -4,16 +4,39 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
 #include <getopt.h>
 
 #include <onion-debug.h>
 
 #include <onion-spi.h>
+#include <onion-spi-trace.h>
+#include <onion-spi-stats.h>
+#include <onion-spi-gpio.h>
+#include <onion-spi-stream.h>
+#include <onion-spi-sampler.h>
 
 
 #define SPI_TOOL_COMMAND_READ				"read"
 #define SPI_TOOL_COMMAND_WRITE				"write"
 #define SPI_TOOL_COMMAND_SETUP_DEVICE		"setup"
+#define SPI_TOOL_COMMAND_BATCH				"batch"
+#define SPI_TOOL_COMMAND_STREAM				"stream"
+#define SPI_TOOL_COMMAND_SAMPLE				"sample"
+
+// batch commands, besides read and write
+#define SPI_TOOL_COMMAND_TRANSFER			"transfer"
+#define SPI_TOOL_COMMAND_DELAY				"delay"
+#define SPI_TOOL_COMMAND_STATS				"stats"
+
+#define SPI_TOOL_MAX_BYTES					4096	// bytes in one read or write command
+#define SPI_TOOL_BATCH_BYTES				65536	// data held back for one flush
+#define SPI_TOOL_BATCH_LINE					4096
+#define SPI_TOOL_MAX_DELAY_US				65535	// delay_usecs of a transfer is 16 bits
+
+#define SPI_TOOL_SAMPLE_COUNT				10
+#define SPI_TOOL_SAMPLE_POLL_US				100000	// longest wait between reads of the sampler ring
 
 
 // type definitions
@@ -21,10 +44,59 @@ typedef enum e_SpiToolMode {
 	SPI_TOOL_MODE_NONE 			= 0x00,
 	SPI_TOOL_MODE_READ			= 0x01,
 	SPI_TOOL_MODE_WRITE			= 0x02,
+	SPI_TOOL_MODE_TRANSFER		= 0x04,
 	SPI_TOOL_MODE_SETUP_DEVICE	= 0x10,
-	SPI_TOOL_NUM_MODES			= 4
+	SPI_TOOL_MODE_BATCH			= 0x20,
+	SPI_TOOL_MODE_STREAM		= 0x40,
+	SPI_TOOL_MODE_SAMPLE		= 0x80,
+	SPI_TOOL_NUM_MODES			= 8
 } eSpiToolMode;
 
+// how results are written to stdout
+typedef enum e_SpiToolFormat {
+	SPI_TOOL_FORMAT_HEX 		= 0,	// 0x.. values on one line, reads prefixed with the address
+	SPI_TOOL_FORMAT_RAW,				// the bytes, as binary
+	SPI_TOOL_FORMAT_JSON,				// one object per line
+} eSpiToolFormat;
+
+// options that are not SPI parameters
+struct spiToolOptions {
+	int 	format;				// eSpiToolFormat
+	char 	*tracePath;			// dump the transfer trace here when done
+	int 	bStats;				// print statistics when done
+	char 	*gpioChip;			// bit-bang on this GPIO chip
+	char 	*batchPath;			// batch commands from this file instead of stdin
+
+	char 	*streamIn;			// stream: send this file
+	char 	*streamOut;			// stream: write the received data to this file
+	int64_t streamBytes;		// stream: length, -1 for all of the input
+
+	int 	samplePeriodUs;		// sample: time between transfers
+	int 	sampleCount;		// sample: number of samples to print
+	int 	samplePriority;		// sample: SCHED_FIFO priority, 0 for normal scheduling
+};
+
+// one command of a batch, waiting for its results
+struct spiToolBatchCommand {
+	int 		mode;			// SPI_TOOL_MODE_READ, _WRITE or _TRANSFER
+	int 		addr;
+	uint8_t 	*rxBuffer;
+	int 		bytes;
+};
+
+// commands coalesced into one spiTransferSegments call
+struct spiToolBatch {
+	struct spiSegment 			segments[SPI_MAX_SEGMENTS];
+	struct spiToolBatchCommand 	commands[SPI_MAX_SEGMENTS];
+	int 						numSegments;
+	int 						numCommands;
+
+	uint8_t 					data[SPI_TOOL_BATCH_BYTES];
+	int 						dataBytes;
+
+	int 						format;
+};
+
 /*
 #ifdef __cplusplus
 extern "C"{
@@ -0,0 +1,54 @@
+#ifndef _ONION_SPI_ARBITER_H_
+#define _ONION_SPI_ARBITER_H_
+
+#include <onion-spi.h>
+#include <onion-spi-stats.h>
+
+#include <pthread.h>
+
+
+#define SPI_ARBITER_BUSES			8		// buses arbitrated, over all backends, transfers on further buses are not
+
+// type definitions
+struct spiArbiterClassStats {
+	uint64_t 	grants;				// times the class was given the bus
+	uint64_t 	yields;				// transactions of the class split to let a higher class in
+
+	struct spiStatsHistogram 	waitLatency;	// from asking for the bus to getting it
+	struct spiStatsHistogram 	holdTime;		// from getting the bus to giving it back
+};
+
+struct spiArbiterStats {
+	int 		busNum;
+
+	struct spiArbiterClassStats 	classes[SPI_PRIORITY_CLASSES];	// indexed by eSpiPriority
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// called by the transfer functions around the messages of a transaction, a bus is a busNum on a backend
+//	the bus goes to the waiting class with the highest priority, first come first served within a class
+//	a release with bSelected set keeps the bus for the thread while the device stays selected,
+//	until a later transaction of that thread ends with it deselected
+//	acquires nest within a thread, the bus is given up by the release matching the outer one
+void 	spiArbiterAcquire		(struct spiParams *params);
+void 	spiArbiterRelease		(struct spiParams *params, int bSelected);
+
+// true if a class with a higher priority than params->priority is waiting for the bus
+int 	spiArbiterShouldYield	(struct spiParams *params);
+// give the bus to the waiting classes and wait for it again, only while the device is deselected
+void 	spiArbiterYield			(struct spiParams *params);
+
+// copy the statistics of the bus of a device, fails if it has not been used
+int 	spiArbiterGetStats		(struct spiParams *params, struct spiArbiterStats *stats);
+// clear the statistics of the bus of a device, or of all buses if params is NULL
+void 	spiArbiterResetStats	(struct spiParams *params);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_ARBITER_H_
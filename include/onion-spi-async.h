@@ -0,0 +1,82 @@
+#ifndef _ONION_SPI_ASYNC_H_
+#define _ONION_SPI_ASYNC_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+
+
+#define SPI_ASYNC_DEFAULT_DEPTH		64
+
+// type definitions
+// a transfer submitted to the asynchronous engine
+//	the params, segments and their buffers must stay valid until the request is reaped
+struct spiAsyncRequest {
+	struct spiParams 	*params;
+	struct spiSegment 	*segments;
+	int 				numSegments;
+
+	void 				*userData;		// not used by the engine
+	int 				status;			// EXIT_SUCCESS or EXIT_FAILURE once completed
+};
+
+// lock-free ring of request pointers
+struct spiAsyncSlot {
+	uint32_t 				seq;
+	struct spiAsyncRequest 	*request;
+};
+
+struct spiAsyncRing {
+	struct spiAsyncSlot 	*slots;
+	uint32_t 				mask;
+
+	uint32_t 				head;
+	uint32_t 				tail;
+};
+
+// per-bus engine: one worker thread drains the submission ring
+struct spiAsyncEngine {
+	int 					busNum;
+	int 					depth;
+
+	struct spiAsyncRing 	submitRing;
+	struct spiAsyncRing 	completeRing;
+	int 					inFlight;
+
+	int 					submitFd;		// eventfd: wakes the worker
+	int 					completeFd;		// eventfd: readable when requests have completed
+
+	pthread_t 				worker;
+	int 					bStop;
+
+	// batch being built by the worker
+	struct spiSegment 		*batchSegments;
+	struct spiAsyncRequest 	**batchRequests;
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// start an engine and its worker thread for a bus, with room for 'depth' requests in flight
+int 	spiAsyncInit			(struct spiAsyncEngine *engine, int busNum, int depth);
+// stop the worker thread once all submitted requests are done, and free the engine
+int 	spiAsyncRelease			(struct spiAsyncEngine *engine);
+
+// queue a request, does not block
+//	fails with errno EAGAIN if 'depth' requests are already in flight
+int 	spiAsyncSubmit			(struct spiAsyncEngine *engine, struct spiAsyncRequest *request);
+
+// file descriptor that polls readable when completed requests can be reaped
+int 	spiAsyncGetEventFd		(struct spiAsyncEngine *engine);
+// collect up to maxRequests completed requests, does not block, returns the number collected
+int 	spiAsyncReap			(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int maxRequests);
+// wait up to timeoutMs (-1 for no limit) for completed requests, returns the number collected
+int 	spiAsyncWait			(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int maxRequests, int timeoutMs);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_ASYNC_H_
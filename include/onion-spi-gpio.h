@@ -0,0 +1,66 @@
+#ifndef _ONION_SPI_GPIO_H_
+#define _ONION_SPI_GPIO_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <linux/gpio.h>
+
+
+#define SPI_GPIO_BACKEND_NAME		"gpio"
+#define SPI_GPIO_DEFAULT_CHIP		"/dev/gpiochip0"
+#define SPI_GPIO_CONSUMER			"onion-spi"
+
+#define SPI_GPIO_MAX_HANDLES		8		// devices open at the same time on one chip
+
+// type definitions
+// clock and data lines, requested once and shared by the devices that use them
+struct spiGpioBus {
+	int 		fd;				// line request, -1 if the slot is free
+	int 		refs;			// devices open on these lines
+	int 		sckGpio;
+	int 		mosiGpio;
+	int 		misoGpio;
+	int 		misoBit;		// index of the MISO line in the request, -1 without MISO
+};
+
+// one device: its bus and its own chip select line
+struct spiGpioLines {
+	int 		bus;			// index in the buses of the chip, -1 if the slot is free
+	int 		csFd;			// request of the CS line, -1 without CS
+	int 		bSelected;		// CS left asserted by the last message
+};
+
+// GPIO character device used to bit-bang SPI, reached through the backend set up by spiGpioInit
+//	sckGpio, mosiGpio, misoGpio and csGpio in spiParams are line offsets on this chip,
+//	misoGpio or csGpio set to -1 leave that line out
+//	devices with different CS lines can share SCK, MOSI and MISO, their transfers take turns
+struct spiGpioChip {
+	char 				path[64];
+
+	struct spiGpioBus 	buses[SPI_GPIO_MAX_HANDLES];
+	struct spiGpioLines lines[SPI_GPIO_MAX_HANDLES];
+	pthread_mutex_t 	lock;
+
+	// counters
+	uint64_t 			setCalls;		// GPIO_V2_LINE_SET_VALUES_IOCTL calls
+	uint64_t 			getCalls;		// GPIO_V2_LINE_GET_VALUES_IOCTL calls
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// set up a backend that bit-bangs SPI on a GPIO chip, NULL for SPI_GPIO_DEFAULT_CHIP
+//	the clock polarity and phase come from params->modeBits, like the chip select polarity
+int 	spiGpioInit				(struct spiBackend *backend, struct spiGpioChip *chip, const char *path);
+// release all lines still requested
+void 	spiGpioRelease			(struct spiGpioChip *chip);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_GPIO_H_
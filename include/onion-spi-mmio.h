@@ -0,0 +1,80 @@
+#ifndef _ONION_SPI_MMIO_H_
+#define _ONION_SPI_MMIO_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+
+#define SPI_MMIO_BACKEND_NAME		"mmio"
+
+// MT7688 GPIO registers, one 32 bit register per bank of 32 GPIOs
+#define SPI_MMIO_MEM_PATH			"/dev/mem"
+#define SPI_MMIO_GPIO_BASE			0x10000600
+#define SPI_MMIO_REG_CTRL			0x00		// direction, 1 for output
+#define SPI_MMIO_REG_DATA			0x20		// line levels
+#define SPI_MMIO_REG_DSET			0x30		// write 1 to drive a line high
+#define SPI_MMIO_REG_DCLR			0x40		// write 1 to drive a line low
+#define SPI_MMIO_BANK_STRIDE		0x04
+#define SPI_MMIO_NUM_BANKS			3
+#define SPI_MMIO_REGS_SIZE			0x50		// bytes an injected register block must provide
+
+#define SPI_MMIO_MAX_HANDLES		8
+#define SPI_MMIO_EDGES_PER_BYTE		16			// two clock edges for each bit
+#define SPI_MMIO_MIN_WAIT_NS		100			// half clock periods shorter than this run without waiting
+
+// type definitions
+// register writes for one clock edge, DCLR first, then DSET, zero masks are skipped
+struct spiMmioEdge {
+	uint32_t 	clr;
+	uint32_t 	set;
+};
+
+// one device, with the waveforms for its mode
+struct spiMmioLines {
+	int 		bInUse;
+	int 		bank;				// bank of SCK, MOSI and CS
+	int 		misoBank;
+
+	uint32_t 	sckMask;
+	uint32_t 	mosiMask;
+	uint32_t 	csMask;				// 0 without CS
+	uint32_t 	misoMask;			// 0 without MISO
+
+	uint32_t 	modeBits;			// mode the waveforms were built for
+	int 		bSelected;			// CS left asserted by the last message
+
+	// edges that clock out each byte value, CS is left untouched
+	struct spiMmioEdge 	waveforms[256][SPI_MMIO_EDGES_PER_BYTE];
+};
+
+// GPIO register block used to bit-bang SPI, reached through the backend set up by spiMmioInit
+//	sckGpio, mosiGpio and csGpio must be in one bank, misoGpio or csGpio set to -1 leave that line out
+//	the pins must already be muxed as GPIOs
+struct spiMmioChip {
+	volatile uint32_t 	*regs;			// register block, mapped from /dev/mem or injected
+	void 				*mapping;		// page mapped by spiMmioInit, NULL if injected
+	size_t 				mapSize;
+
+	struct spiMmioLines *lines[SPI_MMIO_MAX_HANDLES];
+	pthread_mutex_t 	lock;
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// set up a backend that bit-bangs SPI through the GPIO registers
+//	regs NULL maps the MT7688 registers from /dev/mem, otherwise regs points at
+//	SPI_MMIO_REGS_SIZE bytes laid out like them, eg an anonymous page for tests and benchmarks
+int 	spiMmioInit				(struct spiBackend *backend, struct spiMmioChip *chip, volatile void *regs);
+void 	spiMmioRelease			(struct spiMmioChip *chip);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_MMIO_H_
@@ -0,0 +1,115 @@
+#ifndef _ONION_SPI_REGMAP_H_
+#define _ONION_SPI_REGMAP_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+
+
+// register policies, can be combined
+#define SPI_REGMAP_CACHEABLE		0x00	// reads are answered from the cache once the value is known
+#define SPI_REGMAP_VOLATILE			0x01	// value can change on its own, always accessed on the bus
+#define SPI_REGMAP_READ_ONLY		0x02	// writes are rejected
+#define SPI_REGMAP_WRITE_ONLY		0x04	// reads are answered from the cache only
+
+// cache modes
+#define SPI_REGMAP_WRITE_THROUGH	0		// writes go to the bus right away
+#define SPI_REGMAP_WRITE_BACK		1		// writes are held in the cache until spiRegmapSync
+
+// register address byte: (register << addrShift) | readFlag or writeFlag
+#define SPI_REGMAP_DEFAULT_READ_FLAG	0x80
+#define SPI_REGMAP_DEFAULT_WRITE_FLAG	0x00
+#define SPI_REGMAP_DEFAULT_ADDR_SHIFT	0
+
+// type definitions
+// pending register writes, sent together by spiWriteBatchFlush
+struct spiWriteBatchEntry {
+	int 		reg;
+	uint8_t 	value;
+};
+
+struct spiWriteBatch {
+	struct spiParams 			*params;
+
+	int 						capacity;
+	int 						count;
+
+	int 						addrShift;
+	int 						writeFlag;
+	int 						bAutoIncrement;		// device advances the register on each data byte
+	int 						maxBurst;			// most registers in one burst, 0 for no limit
+
+	struct spiWriteBatchEntry 	*entries;
+
+	// scratch space for the flush
+	uint8_t 					*data;
+	uint8_t 					*addrBytes;
+	struct spiSegment 			*segments;
+};
+
+// shadow copy of the registers of one device
+struct spiRegmap {
+	struct spiParams 	*params;
+
+	int 				numRegs;
+	int 				cacheMode;
+
+	int 				addrShift;
+	int 				readFlag;
+	int 				writeFlag;
+
+	uint8_t 			*values;
+	uint8_t 			*policy;
+	uint8_t 			*state;
+
+	pthread_mutex_t 	lock;
+
+	struct spiWriteBatch 	batch;		// used by spiRegmapSync
+
+	// counters
+	unsigned long 		cacheHits;
+	unsigned long 		busReads;
+	unsigned long 		busWrites;
+	unsigned long 		droppedWrites;
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// allocate room for 'capacity' pending register writes
+int 	spiWriteBatchInit		(struct spiWriteBatch *batch, struct spiParams *params, int capacity);
+void 	spiWriteBatchRelease	(struct spiWriteBatch *batch);
+
+// queue a register write, a later write to the same register replaces it
+//	the batch is flushed first if it is full
+int 	spiWriteBatchAdd		(struct spiWriteBatch *batch, int reg, uint8_t value);
+// send all queued writes in one transaction:
+//	contiguous registers go out as one burst, each burst in its own chip select frame
+int 	spiWriteBatchFlush		(struct spiWriteBatch *batch);
+
+// allocate the shadow registers for a device, all registers start cacheable with unknown values
+int 	spiRegmapInit			(struct spiRegmap *map, struct spiParams *params, int numRegs, int cacheMode);
+// free the shadow registers, pending writes are discarded
+void 	spiRegmapRelease		(struct spiRegmap *map);
+
+// set the policy of numRegs registers, starting at firstReg
+int 	spiRegmapSetPolicy		(struct spiRegmap *map, int firstReg, int numRegs, int policy);
+
+// read and write single registers through the cache
+int 	spiRegmapRead			(struct spiRegmap *map, int reg, uint8_t *value);
+int 	spiRegmapWrite			(struct spiRegmap *map, int reg, uint8_t value);
+// read-modify-write the bits selected by mask
+int 	spiRegmapUpdateBits		(struct spiRegmap *map, int reg, uint8_t mask, uint8_t value);
+
+// write all registers changed in write-back mode to the device, in bursts
+int 	spiRegmapSync			(struct spiRegmap *map);
+// forget all cached values, eg after a device reset
+void 	spiRegmapInvalidate		(struct spiRegmap *map);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_REGMAP_H_
@@ -0,0 +1,83 @@
+#ifndef _ONION_SPI_SAMPLER_H_
+#define _ONION_SPI_SAMPLER_H_
+
+#include <onion-spi.h>
+#include <onion-spi-stats.h>
+
+#include <pthread.h>
+
+
+#define SPI_SAMPLER_MAX_SEGMENTS		8
+#define SPI_SAMPLER_DEFAULT_SAMPLES		1024
+
+// type definitions
+// header of a sample, its data follows in the ring
+struct spiSample {
+	uint64_t 	timestampNs;	// CLOCK_MONOTONIC, when the transfer started
+	uint64_t 	period;			// number of the period since the start, gaps are missed deadlines
+	int 		status;			// EXIT_SUCCESS or EXIT_FAILURE
+};
+
+struct spiSamplerStats {
+	uint64_t 	samples;
+	uint64_t 	missed;			// periods without a sample, the previous one ran too late
+	uint64_t 	errors;			// failed transfers
+	uint64_t 	overruns;		// samples overwritten before they were read
+
+	struct spiStatsHistogram 	jitter;		// start of the transfer after its deadline
+	struct spiStatsHistogram 	duration;	// time in the transfer
+};
+
+// runs a prepared transfer at a fixed rate from its own thread, driven by a timerfd
+//	the received data of every segment with an rxBuffer is kept, in order, in a ring of samples
+struct spiSampler {
+	struct spiParams 	params;			// copy, the device is kept open while sampling
+	struct spiSegment 	segments[SPI_SAMPLER_MAX_SEGMENTS];
+	int 				numSegments;
+	int 				captureOffsets[SPI_SAMPLER_MAX_SEGMENTS];	// of the received data in a sample, -1 to discard it
+	int 				sampleBytes;
+
+	int 				priority;		// SCHED_FIFO priority of the thread, with its ring locked in memory, 0 for normal scheduling
+
+	// ring of samples, written by the thread, read by one consumer
+	uint8_t 			*ring;
+	int 				numSamples;
+	int 				slotBytes;
+	uint64_t 			head;
+	uint64_t 			tail;
+
+	uint64_t 			periodNs;
+	uint64_t 			startNs;
+	int 				timerFd;
+	int 				stopFd;			// eventfd: stops the thread
+	pthread_t 			worker;
+
+	struct spiSamplerStats 	stats;
+	pthread_mutex_t 		lock;		// protects stats
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// prepare a sampler for a transfer, keeping the last numSamples samples (0 for the default)
+//	the segments are copied, their transmit buffers must stay valid until spiSamplerRelease
+int 	spiSamplerInit			(struct spiSampler *sampler, struct spiParams *params, struct spiSegment *segments, int numSegments, int numSamples);
+void 	spiSamplerRelease		(struct spiSampler *sampler);
+
+// start sampling every periodUs, the first sample is taken one period from now
+int 	spiSamplerStart			(struct spiSampler *sampler, int periodUs);
+int 	spiSamplerStop			(struct spiSampler *sampler);
+
+// collect up to maxSamples samples, oldest first, does not block, returns the number collected
+//	the data of sample i is copied to data + i * sampler->sampleBytes
+int 	spiSamplerRead			(struct spiSampler *sampler, struct spiSample *samples, uint8_t *data, int maxSamples);
+// copy the counters and histograms
+void 	spiSamplerGetStats		(struct spiSampler *sampler, struct spiSamplerStats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_SAMPLER_H_
@@ -0,0 +1,63 @@
+#ifndef _ONION_SPI_SIM_H_
+#define _ONION_SPI_SIM_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+#include <time.h>
+
+
+#define SPI_SIM_BACKEND_NAME		"sim"
+
+// register address byte: (register << addrShift) | readFlag
+#define SPI_SIM_DEFAULT_READ_FLAG	0x80
+#define SPI_SIM_DEFAULT_ADDR_SHIFT	0
+
+#define SPI_SIM_SPIN_NS				100000	// modeled waits shorter than this are busy-waited
+
+// type definitions
+// simulated device, reached through the backend set up by spiSimInit
+//	with registers, each chip select frame starts with an address byte, followed by
+//	data bytes read from or written to the register file
+//	without registers, every byte sent is received back
+struct spiSimDevice {
+	uint8_t 			*registers;
+	int 				numRegs;
+
+	int 				addrShift;
+	int 				readFlag;
+	int 				bAutoIncrement;		// advance the register on each data byte
+
+	int 				bModelClock;		// make transfers take as long as they would on the bus
+
+	// the current chip select frame, kept across messages while the device stays selected
+	int 				framePosition;		// bytes into the frame, 0 before the address byte
+	int 				frameReg;
+	int 				bFrameRead;
+
+	// counters
+	uint64_t 			messages;
+	uint64_t 			bytes;
+	uint64_t 			busTimeNs;			// modeled time on the bus, counted even without bModelClock
+
+	pthread_mutex_t 	lock;
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// set up a simulated device with numRegs registers, 0 for a loopback device,
+//	and a backend that reaches it
+int 	spiSimInit				(struct spiBackend *backend, struct spiSimDevice *device, int numRegs);
+void 	spiSimRelease			(struct spiSimDevice *device);
+
+// time a message would take on the bus: bits at the transfer speed and data lines, plus the delays
+uint64_t 	spiSimMessageNs		(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_SIM_H_
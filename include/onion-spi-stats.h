@@ -0,0 +1,71 @@
+#ifndef _ONION_SPI_STATS_H_
+#define _ONION_SPI_STATS_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+
+
+#define SPI_STATS_DEVICES			8		// (bus, device) pairs tracked
+
+// log-linear latency histogram: 2^SUB_BITS buckets per power of two, about 12% resolution
+#define SPI_STATS_HIST_SUB_BITS		3
+#define SPI_STATS_HIST_BUCKETS		((32 - SPI_STATS_HIST_SUB_BITS + 1) << SPI_STATS_HIST_SUB_BITS)
+
+#define SPI_STATS_ERRNO_MAX			134		// errno values counted individually, larger ones share the last entry
+
+// type definitions
+// latencies in nanoseconds
+struct spiStatsHistogram {
+	uint64_t 	count;
+	uint64_t 	sumNs;
+	uint32_t 	minNs;
+	uint32_t 	maxNs;
+	uint64_t 	buckets[SPI_STATS_HIST_BUCKETS];
+};
+
+struct spiStats {
+	int 		busNum;
+	int 		deviceId;
+
+	uint64_t 	transfers;			// calls to the transfer functions
+	uint64_t 	messages;			// ioctl messages sent
+	uint64_t 	txBytes;
+	uint64_t 	rxBytes;
+
+	uint64_t 	errors;				// failed transfers
+	uint64_t 	errnoCounts[SPI_STATS_ERRNO_MAX + 1];
+
+	struct spiStatsHistogram 	ioctlLatency;	// time in each ioctl
+	struct spiStatsHistogram 	callLatency;	// time in each transfer call, end to end
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// turn statistics on or off, they are on by default
+void 		spiStatsEnable			(int bEnable);
+
+// called by the transfer functions
+void 		spiStatsMessage			(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers, uint64_t durationNs, int error);
+void 		spiStatsTransfer		(struct spiParams *params, uint64_t durationNs, int status);
+
+// copy the statistics of a device, fails if the device has not been used
+int 		spiStatsGet				(int busNum, int devId, struct spiStats *stats);
+// copy the statistics of up to maxDevices devices, returns the number copied
+int 		spiStatsGetAll			(struct spiStats *stats, int maxDevices);
+// clear the statistics of a device, or of all devices if busNum is -1
+void 		spiStatsReset			(int busNum, int devId);
+
+// latency below which 'percentile' (0 to 100) of the samples fall, in nanoseconds
+uint32_t 	spiStatsPercentile		(const struct spiStatsHistogram *histogram, double percentile);
+// add a sample to a histogram
+void 		spiStatsRecord			(struct spiStatsHistogram *histogram, uint64_t durationNs);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_STATS_H_
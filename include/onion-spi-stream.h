@@ -0,0 +1,40 @@
+#ifndef _ONION_SPI_STREAM_H_
+#define _ONION_SPI_STREAM_H_
+
+#include <onion-spi.h>
+
+#include <pthread.h>
+
+
+#define SPI_STREAM_BUFFERS			3		// chunks in flight: one being read, one on the bus, one being written
+
+// type definitions
+// counters of one stream
+struct spiStreamStats {
+	uint64_t 	bytes;
+	uint64_t 	chunks;
+
+	uint64_t 	elapsedNs;
+	uint64_t 	busNs;			// time spent in transfers
+	uint64_t 	stallNs;		// time the bus waited for the input file
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// stream data between files and a device, in chunks of spiGetMaxTransferSize bytes
+//	bytes read from inFd are sent, and received bytes are written to outFd
+//	inFd -1 sends zeroes, outFd -1 discards the received bytes
+//	bytes -1 streams until the end of inFd
+//	file I/O runs in its own threads, so the bus does not wait for storage,
+//	and the device is kept selected from the first chunk to the last
+//	stats may be NULL
+int 	spiStream				(struct spiParams *params, int inFd, int outFd, int64_t bytes, struct spiStreamStats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_STREAM_H_
@@ -0,0 +1,67 @@
+#ifndef _ONION_SPI_TRACE_H_
+#define _ONION_SPI_TRACE_H_
+
+#include <onion-spi.h>
+
+#include <signal.h>
+
+
+#define SPI_TRACE_RECORDS			256		// records kept in the ring, must be a power of two
+#define SPI_TRACE_CAPTURE_BYTES		32		// tx and rx bytes copied into each record
+
+#define SPI_TRACE_MAGIC				"SPITRACE"
+#define SPI_TRACE_VERSION			1
+
+// type definitions
+// one ioctl message, as stored in the ring and in the dump file
+//	laid out without padding, all fields in the byte order of the host
+struct spiTraceRecord {
+	uint64_t 	timestampNs;		// CLOCK_MONOTONIC at the start of the ioctl
+	uint32_t 	seq;				// odd while the record is being written
+	uint32_t 	index;				// number of the message since the program started
+	uint32_t 	durationNs;			// time spent in the ioctl
+	int32_t 	status;				// ioctl return value, or -errno on failure
+	uint32_t 	speedInHz;			// speed of the first transfer
+	uint32_t 	bytes;				// bytes in all transfers of the message
+
+	uint16_t 	busNum;
+	uint16_t 	deviceId;
+	uint16_t 	numXfers;
+	uint16_t 	capturedBytes;		// valid bytes in tx and rx
+
+	uint8_t 	tx[SPI_TRACE_CAPTURE_BYTES];
+	uint8_t 	rx[SPI_TRACE_CAPTURE_BYTES];
+};
+
+// dump file: this header followed by numRecords records, oldest first
+struct spiTraceFileHeader {
+	char 		magic[8];
+	uint32_t 	version;
+	uint32_t 	recordSize;
+	uint32_t 	captureBytes;
+	uint32_t 	numRecords;
+};
+
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+// turn tracing on or off, it is on by default
+void 	spiTraceEnable			(int bEnable);
+
+// record an ioctl message, called by the transfer functions
+void 	spiTraceMessage			(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers, uint64_t startNs, uint64_t endNs, int status);
+// CLOCK_MONOTONIC in nanoseconds
+uint64_t 	spiTraceGetTimeNs	();
+
+// write the records in the ring to a file, async-signal-safe
+int 	spiTraceDump			(const char *path);
+// dump the ring to 'path' whenever the process receives signal 'signum'
+int 	spiTraceDumpOnSignal	(int signum, const char *path);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // _ONION_SPI_TRACE_H_
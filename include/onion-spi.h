@@ -16,18 +16,57 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
 
 
 #include <onion-debug.h>
 
 
+// library log messages above this severity are removed at compile time, eg -DSPI_LOG_MAX_SEVERITY=0
+#ifndef SPI_LOG_MAX_SEVERITY
+	#define SPI_LOG_MAX_SEVERITY	ONION_SEVERITY_DEBUG_EXTRA
+#endif
+
+// true if a message of this severity would be printed
+#define SPI_LOG_ENABLED(severity)	( (severity) <= SPI_LOG_MAX_SEVERITY && (severity) <= onionGetVerbosity() )
+
+// print through onionPrint, the arguments are only evaluated if the message is printed
+#define SPI_LOG(severity, ...) 						\
+	do {											\
+		if (SPI_LOG_ENABLED(severity)) {			\
+			onionPrint((severity), __VA_ARGS__);	\
+		}											\
+	} while (0)
+
 #define SPI_DEV_PATH				"/dev/spidev%d.%d"
 #define SPI_PRINT_BANNER			"onion-spi::"
 
-#define SPI_DEV_INSMOD_TEMPLATE 	"insmod spi-gpio-custom bus%d=%d,%d,%d,%d,%d,%d,%d"
+#define SPI_MODULE_NAME				"spi-gpio-custom"
+#define SPI_MODULE_PATH_TEMPLATE	"/lib/modules/%s/%s.ko"		// kernel release, module name
+#define SPI_MODULE_PARAM_TEMPLATE	"bus%d=%d,%d,%d,%d,%d,%d,%d"
+#define SPI_MODULE_PARAMS_SIZE		512
+
+#define SPI_DEV_DIR					"/dev"
+#define SPI_REGISTER_TIMEOUT_MS		2000	// wait for the device file to appear after loading the module
+#define SPI_REGISTER_RETRIES		1		// module loads attempted again if the device file did not appear
+#define SPI_REGISTER_POLL_MS		10		// polling interval when inotify is not available
 
 #define SPI_BUFFER_SIZE				32
 
+#define SPI_FD_CACHE_SIZE			8		// number of (bus, device) file handles kept open
+
+#define SPI_MESSAGE_MAX_XFERS		128		// transfers sent in one SPI_IOC_MESSAGE(n)
+#define SPI_MAX_SEGMENTS			511 	// limit of SPI_IOC_MESSAGE(n)
+#define SPI_SEGMENT_NO_DELAY		-1		// segment delayInUs: no delay, instead of the one from spiParams
+
+#define SPI_BUFSIZ_PATH				"/sys/module/spidev/parameters/bufsiz"
+#define SPI_DEFAULT_BUFSIZ			4096	// spidev default, most bytes in one SPI_IOC_MESSAGE
+
 #define SPI_DEFAULT_SPEED			100000
 #define SPI_DEFAULT_BITS_PER_WORD	0 				// corresponds to 8 bits per word
 #define SPI_DEFAULT_MODE 			SPI_MODE_0
@@ -39,6 +78,30 @@
 #define SPI_DEFAULT_GPIO_CS			7
 
 // type definitions
+struct spiParams;
+
+// arbitration class of a device's transfers, when several threads share a bus
+typedef enum e_SpiPriority {
+	SPI_PRIORITY_NORMAL 		= 0,
+	SPI_PRIORITY_REALTIME,				// goes ahead of the other classes
+	SPI_PRIORITY_BULK,					// only gets the bus when no other class is waiting
+	SPI_PRIORITY_CLASSES
+} eSpiPriority;
+
+// transport used to reach a device
+//	transfer performs one SPI_IOC_MESSAGE worth of transfers and returns like the ioctl:
+//	the number of bytes transferred, or -1 with errno set
+struct spiBackend {
+	const char 	*name;
+
+	int 	(*open)			(const struct spiBackend *backend, struct spiParams *params, int *handle);
+	int 	(*configure)	(const struct spiBackend *backend, struct spiParams *params, int handle);
+	int 	(*transfer)		(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers);
+	int 	(*close)		(const struct spiBackend *backend, struct spiParams *params, int handle);
+
+	void 	*context;		// backend state
+};
+
 struct spiParams {
 	int 	busNum;
 	int 	deviceId;
@@ -54,8 +117,37 @@ struct spiParams {
 	int 	mosiGpio;
 	int 	misoGpio;
 	int 	csGpio;
+
+	int 	txNbits;		// data lines used to transmit: 1, 2 (dual) or 4 (quad), 0 for single
+	int 	rxNbits;		// data lines used to receive: 1, 2 (dual) or 4 (quad), 0 for single
+
+	int 	fd;				// device handle from spiOpenDevice, -1 if not opened
+
+	int 	priority;		// eSpiPriority
+
+	const struct spiBackend 	*backend;	// NULL for the default backend
 };
 
+// one segment of a multi-segment transfer
+//	speedInHz, delayInUs, bitsPerWord, txNbits and rxNbits set to 0 use the values from spiParams,
+//	delayInUs set to SPI_SEGMENT_NO_DELAY does not delay
+struct spiSegment {
+	uint8_t	*txBuffer;		// data to send, NULL to send zeroes
+	uint8_t	*rxBuffer;		// buffer for received data, NULL to discard it
+	int 	bytes;
+
+	int		speedInHz;
+	int 	delayInUs;		// delay after the segment, before deselecting or starting the next segment
+	int 	bitsPerWord;
+	int 	csChange;		// deselect the device after this segment
+
+	int 	txNbits;		// 1, 2 or 4 data lines, dual and quad segments are transmit or receive only
+	int 	rxNbits;
+};
+
+// loads a kernel module with a parameter string, returns EXIT_SUCCESS or EXIT_FAILURE
+typedef int (*spiModuleLoader)(const char *moduleName, const char *moduleParams);
+
 // for debugging
 #ifndef __APPLE__
 	#define SPI_ENABLED		1
@@ -66,8 +158,8 @@ struct spiParams {
 extern "C"{
 #endif 
 
-
-
+// the Linux spidev driver, the default backend
+extern const struct spiBackend 	spiSpidevBackend;
 
 
 //// spi functions
@@ -77,13 +169,47 @@ void 	spiParamInit			(struct spiParams *params);
 // check if an SPI device is mapped sysfs
 int 	spiCheckDevice 			(int busNum, int devId, int printSeverity);
 
-// register an SPI device with sysfs
+// register several SPI devices with one load of the spi-gpio-custom module
+//	devices that already exist are skipped, each bus may appear only once
+int 	spiRegisterDevices		(struct spiParams *params, int numDevices);
+
+// replace the function used to load the kernel module, NULL restores spiLoadModule
+void 	spiSetModuleLoader		(spiModuleLoader loader);
+// load a kernel module from /lib/modules/<kernel release>/ with finit_module
+int 	spiLoadModule			(const char *moduleName, const char *moduleParams);
+
+// select the backend used by params without one, NULL restores spiSpidevBackend
+void 	spiSetDefaultBackend	(const struct spiBackend *backend);
+// backend used for a device: params->backend, or the default backend
+const struct spiBackend* 	spiGetBackend	(struct spiParams *params);
+
+// wait up to timeoutMs (-1 for no limit) for the device file to appear and be usable
+int 	spiWaitForDevice		(int busNum, int devId, int timeoutMs);
+
+// register an SPI device with sysfs, waiting up to SPI_REGISTER_TIMEOUT_MS for the device file
 int 	spiRegisterDevice 		(struct spiParams *params);
+// register an SPI device with sysfs, waiting up to timeoutMs for the device file
+//	and loading the module up to 'retries' more times if it does not appear
+int 	spiRegisterDeviceWait	(struct spiParams *params, int timeoutMs, int retries);
 // setup paramaters of the sysfs SPI interface
+//	only values changed since the last setup of the device are sent to the driver,
+//	speed, bits per word and delay are also applied to every transfer, so they need no setup
 int 	spiSetupDevice 			(struct spiParams *params);
+// forget the configuration recorded by spiSetupDevice, eg if another process changed it
+void 	spiInvalidateConfig		(struct spiParams *params);
+
+// open the device file handle once, to be reused by all transfers until spiCloseDevice
+int 	spiOpenDevice			(struct spiParams *params);
+int 	spiCloseDevice			(struct spiParams *params);
+// close all device file handles held open by the transfer functions
+void 	spiReleaseFdCache		();
 
 // transfer data through the SPI interface
 int 	spiTransfer				(struct spiParams *params, uint8_t *txBuffer, uint8_t *rxBuffer, int bytes);
+// transfer several segments through the SPI interface in a single transaction
+int 	spiTransferSegments		(struct spiParams *params, struct spiSegment *segments, int numSegments);
+// largest number of bytes sent in one ioctl call, longer transfers are split
+int 	spiGetMaxTransferSize	();
 
 
 int 	spiWrite				(struct spiParams *params, int addr, uint8_t *wrBuffer, int bytes);
@@ -0,0 +1,409 @@
+#include <main-spi-bench.h>
+
+int 	verbose;
+
+void usage(const char* progName)
+{
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+	onionPrint(ONION_SEVERITY_FATAL, "spi-bench: measure the SPI transfer path\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-bench -b <bus number> -d <device ID> [options]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Run every combination of API, speed, size and segment count,\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  against a simulated device if the SPI device does not exist\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+	onionPrint(ONION_SEVERITY_FATAL, "Options:\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --apis <list>            APIs to measure: transfer, write, read, segments (default: %s)\n", SPI_BENCH_DEFAULT_APIS);
+	onionPrint(ONION_SEVERITY_FATAL, "  --sizes <list>           Bytes per call (default: %s)\n", SPI_BENCH_DEFAULT_SIZES);
+	onionPrint(ONION_SEVERITY_FATAL, "  --segments <list>        Segments per call for the segments API (default: %s)\n", SPI_BENCH_DEFAULT_SEGMENTS);
+	onionPrint(ONION_SEVERITY_FATAL, "  --speeds <list>          SPI clock speeds in Hz (default: %s)\n", SPI_BENCH_DEFAULT_SPEEDS);
+	onionPrint(ONION_SEVERITY_FATAL, "  --iterations <number>    Calls per combination (default: %d)\n", SPI_BENCH_DEFAULT_ITERATIONS);
+	onionPrint(ONION_SEVERITY_FATAL, "  --sim                    Use the simulated device even if the SPI device exists\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --sim-regs <number>      Registers in the simulated device, 0 for loopback (default: 0)\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --sim-clock              Make simulated transfers take as long as on the bus\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --mmio <real|anon>       Bit-bang through the GPIO registers, or through an anonymous memory page\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --format <csv|json>      Output format (default: csv)\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --output <file>          Write the results to <file> instead of stdout\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+}
+
+// parse a comma separated list of positive integers, returns the number of values
+int parseList(const char *list, int *values)
+{
+	int 	count;
+	char 	*end;
+
+	count 	= 0;
+	while (*list != '\0' && count < SPI_BENCH_MAX_VALUES) {
+		values[count] 	= (int)strtol(list, &end, 0);
+		if (end == list || values[count] < 1) {
+			return 0;
+		}
+		count++;
+
+		list 	= end;
+		if (*list == ',') {
+			list++;
+		}
+	}
+
+	return count;
+}
+
+int compareDouble(const void *a, const void *b)
+{
+	double 	x 	= *(const double*)a;
+	double 	y 	= *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+double getTimeUs()
+{
+	struct timespec 	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000.0 + now.tv_nsec / 1000.0;
+}
+
+// make one call through the selected API
+int runOnce(struct spiParams *params, const char *api, uint8_t *txBuffer, uint8_t *rxBuffer, int bytes, struct spiSegment *segments, int numSegments)
+{
+	if (strcmp(api, SPI_BENCH_API_TRANSFER) == 0) {
+		return spiTransfer(params, txBuffer, rxBuffer, bytes);
+	}
+	else if (strcmp(api, SPI_BENCH_API_WRITE) == 0) {
+		return spiWrite(params, 0x00, txBuffer, bytes);
+	}
+	else if (strcmp(api, SPI_BENCH_API_READ) == 0) {
+		return spiRead(params, 0x80, rxBuffer, bytes);
+	}
+
+	return spiTransferSegments(params, segments, numSegments);
+}
+
+// measure one combination
+int runBench(struct spiParams *params, const char *api, int bytes, int numSegments, int iterations, struct spiBenchResult *result)
+{
+	int 		i, status, chunk;
+	double 		start, callStart, *latencies;
+	uint8_t 	*txBuffer, *rxBuffer;
+	struct spiSegment 	*segments;
+
+	latencies 	= (double*)malloc(sizeof(double) * iterations);
+	txBuffer 	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
+	rxBuffer 	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
+	segments 	= (struct spiSegment*)malloc(sizeof(struct spiSegment) * numSegments);
+
+	if (latencies == NULL || txBuffer == NULL || rxBuffer == NULL || segments == NULL) {
+		free(latencies);
+		free(txBuffer);
+		free(rxBuffer);
+		free(segments);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < bytes; i++) {
+		txBuffer[i] 	= (uint8_t)i;
+	}
+
+	// split the buffers into segments, the last one takes the remainder
+	memset(segments, 0, sizeof(struct spiSegment) * numSegments);
+	chunk 	= bytes / numSegments;
+	for (i = 0; i < numSegments; i++) {
+		segments[i].txBuffer 	= &txBuffer[i * chunk];
+		segments[i].rxBuffer 	= &rxBuffer[i * chunk];
+		segments[i].bytes 		= (i == numSegments - 1 ? bytes - i * chunk : chunk);
+	}
+
+	memset(result, 0, sizeof(struct spiBenchResult));
+	result->api 		= api;
+	result->bytes 		= bytes;
+	result->segments 	= numSegments;
+	result->speedInHz 	= params->speedInHz;
+	result->iterations 	= iterations;
+
+	// warm up the file handle and caches
+	runOnce(params, api, txBuffer, rxBuffer, bytes, segments, numSegments);
+
+	start 	= getTimeUs();
+	for (i = 0; i < iterations; i++) {
+		callStart 	= getTimeUs();
+		status 		= runOnce(params, api, txBuffer, rxBuffer, bytes, segments, numSegments);
+		latencies[i] 	= getTimeUs() - callStart;
+
+		if (status != EXIT_SUCCESS) {
+			result->failures++;
+		}
+	}
+	result->seconds 	= (getTimeUs() - start) / 1000000.0;
+
+	if (result->seconds > 0) {
+		result->transfersPerSec 	= iterations / result->seconds;
+		result->bytesPerSec 		= (double)iterations * bytes / result->seconds;
+	}
+
+	qsort(latencies, iterations, sizeof(double), compareDouble);
+	result->p50 	= latencies[(iterations - 1) * 50 / 100];
+	result->p90 	= latencies[(iterations - 1) * 90 / 100];
+	result->p99 	= latencies[(iterations - 1) * 99 / 100];
+	result->max 	= latencies[iterations - 1];
+
+	// clean-up
+	free(latencies);
+	free(txBuffer);
+	free(rxBuffer);
+	free(segments);
+
+	return EXIT_SUCCESS;
+}
+
+void printResult(FILE *out, int format, const char *backend, struct spiBenchResult *result, int bFirst)
+{
+	if (format == SPI_BENCH_FORMAT_JSON) {
+		fprintf(out, "%s\n    {\"api\": \"%s\", \"backend\": \"%s\", \"bytes\": %d, \"segments\": %d, \"speed_hz\": %d, "
+					"\"iterations\": %d, \"failures\": %d, \"seconds\": %.6f, \"transfers_per_sec\": %.1f, \"bytes_per_sec\": %.1f, "
+					"\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+					(bFirst ? "" : ","),
+					result->api, backend, result->bytes, result->segments, result->speedInHz,
+					result->iterations, result->failures, result->seconds, result->transfersPerSec, result->bytesPerSec,
+					result->p50, result->p90, result->p99, result->max
+			);
+	}
+	else {
+		fprintf(out, "%s,%s,%d,%d,%d,%d,%d,%.6f,%.1f,%.1f,%.3f,%.3f,%.3f,%.3f\n",
+					result->api, backend, result->bytes, result->segments, result->speedInHz,
+					result->iterations, result->failures, result->seconds, result->transfersPerSec, result->bytesPerSec,
+					result->p50, result->p90, result->p99, result->max
+			);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const char 	*progname;
+	const char 	*backend;
+	char 		*apiList, *api, *outPath;
+	int 		ch, option_index;
+	int 		format, bSim, simRegs, bSimClock, iterations, bFirst;
+	char 		*mmio;
+	void 		*mmioPage;
+	int 		numSizes, numSegmentCounts, numSpeeds;
+	int 		sizes[SPI_BENCH_MAX_VALUES];
+	int 		segmentCounts[SPI_BENCH_MAX_VALUES];
+	int 		speeds[SPI_BENCH_MAX_VALUES];
+	int 		iSpeed, iSize, iSegments, numRuns, numSegments, bSegments;
+	FILE 		*out;
+
+	struct spiParams		params;
+	struct spiBenchResult 	result;
+	struct spiBackend 		simBackend;
+	struct spiSimDevice 	simDevice;
+	struct spiBackend 		mmioBackend;
+	struct spiMmioChip 		mmioChip;
+
+	static const struct option lopts[] = {
+		{ "verbose",	no_argument, 		0, 'v' },
+		{ "bus",		required_argument, 	0, 'b' },
+		{ "device",		required_argument, 	0, 'd' },
+		{ "apis",		required_argument, 	0, 'a' },
+		{ "sizes",		required_argument, 	0, 'z' },
+		{ "segments",	required_argument, 	0, 'g' },
+		{ "speeds",		required_argument, 	0, 's' },
+		{ "iterations",	required_argument, 	0, 'n' },
+		{ "sim",		no_argument, 		0, 'S' },
+		{ "sim-regs",	required_argument, 	0, 'R' },
+		{ "sim-clock",	no_argument, 		0, 'C' },
+		{ "mmio",		required_argument, 	0, 'M' },
+		{ "format",		required_argument, 	0, 'f' },
+		{ "output",		required_argument, 	0, 'o' },
+
+		{ NULL, 0, 0, 0 },	// sentinel
+	};
+
+	// set defaults
+	verbose 		= ONION_VERBOSITY_NORMAL;
+	format 			= SPI_BENCH_FORMAT_CSV;
+	bSim 			= 0;
+	simRegs 		= 0;
+	bSimClock 		= 0;
+	mmio 			= NULL;
+	mmioPage 		= NULL;
+	iterations 		= SPI_BENCH_DEFAULT_ITERATIONS;
+	apiList 		= strdup(SPI_BENCH_DEFAULT_APIS);
+	outPath 		= NULL;
+	option_index 	= 0;
+
+	numSizes 			= parseList(SPI_BENCH_DEFAULT_SIZES, sizes);
+	numSegmentCounts 	= parseList(SPI_BENCH_DEFAULT_SEGMENTS, segmentCounts);
+	numSpeeds 			= parseList(SPI_BENCH_DEFAULT_SPEEDS, speeds);
+
+	spiParamInit(&params);
+
+	// save the program name
+	progname 		= argv[0];
+
+	// parse the option arguments
+	while( (ch = getopt_long (argc, argv, "vhb:d:a:z:g:s:n:SR:CM:f:o:", lopts, &option_index)) != -1) {
+		switch (ch) {
+			case 'v':
+				verbose++;
+				break;
+			case 'b':
+				params.busNum 		= atoi(optarg);
+				break;
+			case 'd':
+				params.deviceId		= atoi(optarg);
+				break;
+			case 'a':
+				free(apiList);
+				apiList 	= strdup(optarg);
+				break;
+			case 'z':
+				numSizes 	= parseList(optarg, sizes);
+				break;
+			case 'g':
+				numSegmentCounts 	= parseList(optarg, segmentCounts);
+				break;
+			case 's':
+				numSpeeds 	= parseList(optarg, speeds);
+				break;
+			case 'n':
+				iterations 	= atoi(optarg);
+				break;
+			case 'S':
+				bSim 		= 1;
+				break;
+			case 'R':
+				simRegs 	= atoi(optarg);
+				break;
+			case 'C':
+				bSimClock 	= 1;
+				break;
+			case 'M':
+				mmio 		= optarg;
+				break;
+			case 'f':
+				format 		= (strcmp(optarg, "json") == 0 ? SPI_BENCH_FORMAT_JSON : SPI_BENCH_FORMAT_CSV);
+				break;
+			case 'o':
+				outPath 	= optarg;
+				break;
+			default:
+				usage(progname);
+				return 0;
+		}
+	}
+
+	if (numSizes == 0 || numSegmentCounts == 0 || numSpeeds == 0 || iterations < 1) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: invalid list or iteration count!\n");
+		usage(progname);
+		return 0;
+	}
+
+	onionSetVerbosity(verbose);
+
+	// bit-bang through the GPIO registers, or a page standing in for them
+	if (mmio != NULL) {
+		if (strcmp(mmio, "anon") == 0) {
+			mmioPage 	= mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mmioPage == MAP_FAILED) {
+				onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not map an anonymous page\n");
+				return 0;
+			}
+		}
+		if (spiMmioInit(&mmioBackend, &mmioChip, mmioPage) != EXIT_SUCCESS) {
+			return 0;
+		}
+		params.backend 	= &mmioBackend;
+		bSim 			= 0;
+	}
+
+	// fall back to the simulated device
+	if (mmio == NULL && !bSim && spiCheckDevice(params.busNum, params.deviceId, ONION_SEVERITY_DEBUG) != EXIT_SUCCESS) {
+		onionPrint(ONION_SEVERITY_INFO, "> SPI device not found, using the simulated device\n");
+		bSim 	= 1;
+	}
+	if (bSim) {
+		if (spiSimInit(&simBackend, &simDevice, simRegs) != EXIT_SUCCESS) {
+			return 0;
+		}
+		simDevice.bModelClock 	= bSimClock;
+		params.backend 			= &simBackend;
+	}
+	backend 	= spiGetBackend(&params)->name;
+
+	out 	= stdout;
+	if (outPath != NULL) {
+		out 	= fopen(outPath, "w");
+		if (out == NULL) {
+			onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not open '%s'\n", outPath);
+			return 0;
+		}
+	}
+
+	if (format == SPI_BENCH_FORMAT_JSON) {
+		fprintf(out, "{\n  \"results\": [");
+	}
+	else {
+		fprintf(out, "api,backend,bytes,segments,speed_hz,iterations,failures,seconds,transfers_per_sec,bytes_per_sec,p50_us,p90_us,p99_us,max_us\n");
+	}
+
+	//* program *//
+	bFirst 	= 1;
+	for (api = strtok(apiList, ","); api != NULL; api = strtok(NULL, ",")) {
+		if (	strcmp(api, SPI_BENCH_API_TRANSFER) != 0 && strcmp(api, SPI_BENCH_API_WRITE) != 0 &&
+				strcmp(api, SPI_BENCH_API_READ) != 0 && strcmp(api, SPI_BENCH_API_SEGMENTS) != 0
+			)
+		{
+			onionPrint(ONION_SEVERITY_FATAL, "> ERROR: unknown API '%s'\n", api);
+			continue;
+		}
+		bSegments 	= (strcmp(api, SPI_BENCH_API_SEGMENTS) == 0);
+
+		for (iSpeed = 0; iSpeed < numSpeeds; iSpeed++) {
+			params.speedInHz 	= speeds[iSpeed];
+
+			for (iSize = 0; iSize < numSizes; iSize++) {
+				// only the segments API splits a call
+				numRuns 	= (bSegments ? numSegmentCounts : 1);
+
+				for (iSegments = 0; iSegments < numRuns; iSegments++) {
+					numSegments 	= (bSegments ? segmentCounts[iSegments] : 1);
+					if (numSegments > sizes[iSize] || numSegments > SPI_MAX_SEGMENTS) {
+						continue;
+					}
+
+					if (runBench(&params, api, sizes[iSize], numSegments, iterations, &result) == EXIT_SUCCESS) {
+						printResult(out, format, backend, &result, bFirst);
+						bFirst 	= 0;
+					}
+				}
+			}
+		}
+	}
+
+	if (format == SPI_BENCH_FORMAT_JSON) {
+		fprintf(out, "\n  ]\n}\n");
+	}
+
+	//* clean-up *//
+	if (out != stdout) {
+		fclose(out);
+	}
+	free(apiList);
+
+	spiReleaseFdCache();
+	if (bSim) {
+		spiSimRelease(&simDevice);
+	}
+	if (mmio != NULL) {
+		spiMmioRelease(&mmioChip);
+	}
+	if (mmioPage != NULL) {
+		munmap(mmioPage, sysconf(_SC_PAGESIZE));
+	}
+
+	return 0;
+}
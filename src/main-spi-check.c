@@ -0,0 +1,399 @@
+#include <main-spi-check.h>
+
+int 	verbose;
+
+static struct spiCheckLoader 	loaderCalls;
+
+void usage(const char* progName)
+{
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+	onionPrint(ONION_SEVERITY_FATAL, "spi-check: check the library without SPI hardware or root\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-check [options]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Exits with a failure status if a check fails\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+	onionPrint(ONION_SEVERITY_FATAL, "Options:\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  -v                       Increase the output verbosity\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --gpiochip <path>        Also bit-bang on this GPIO chip, eg a gpio-sim chip,\n");
+	onionPrint(ONION_SEVERITY_FATAL, "                           with SCK, MOSI, MISO and CS on lines %d to %d and MISO pulled up\n", SPI_CHECK_GPIO_SCK, SPI_CHECK_GPIO_CS);
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+}
+
+// report the result of one check
+int checkResult(const char *name, int bPassed)
+{
+	onionPrint(ONION_SEVERITY_FATAL, "> %-8s %s\n", name, (bPassed ? "ok" : "FAILED"));
+
+	return (bPassed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// module loader that records the request instead of loading anything
+int stubLoader(const char *moduleName, const char *moduleParams)
+{
+	loaderCalls.calls++;
+	snprintf(loaderCalls.moduleName, sizeof(loaderCalls.moduleName), "%s", moduleName);
+	snprintf(loaderCalls.moduleParams, sizeof(loaderCalls.moduleParams), "%s", moduleParams);
+
+	// nothing was loaded, so no device file is waited for
+	return EXIT_FAILURE;
+}
+
+// spiRegisterDevices loads the module once for all buses, and not at all for a bus listed twice
+int checkLoader()
+{
+	int 	i, bPassed;
+	char 	busParam[16];
+	struct spiParams 	params[SPI_CHECK_LOADER_BUSES];
+
+	for (i = 0; i < SPI_CHECK_LOADER_BUSES; i++) {
+		spiParamInit(&params[i]);
+		params[i].busNum 	= SPI_CHECK_LOADER_BUS + i;
+
+		if (spiCheckDevice(params[i].busNum, params[i].deviceId, ONION_SEVERITY_DEBUG_EXTRA) == EXIT_SUCCESS) {
+			onionPrint(ONION_SEVERITY_FATAL, "> loader   skipped, bus%d exists\n", params[i].busNum);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	spiSetModuleLoader(stubLoader);
+
+	memset(&loaderCalls, 0, sizeof(loaderCalls));
+	bPassed 	= (spiRegisterDevices(params, SPI_CHECK_LOADER_BUSES) == EXIT_FAILURE &&
+					loaderCalls.calls == 1 &&
+					strcmp(loaderCalls.moduleName, SPI_MODULE_NAME) == 0 );
+	for (i = 0; bPassed && i < SPI_CHECK_LOADER_BUSES; i++) {
+		snprintf(busParam, sizeof(busParam), "bus%d=", params[i].busNum);
+		bPassed 	= (strstr(loaderCalls.moduleParams, busParam) != NULL);
+	}
+
+	// rejected before loading
+	params[1].busNum 	= params[0].busNum;
+	memset(&loaderCalls, 0, sizeof(loaderCalls));
+	if (spiRegisterDevices(params, SPI_CHECK_LOADER_BUSES) != EXIT_FAILURE || loaderCalls.calls != 0) {
+		bPassed 	= 0;
+	}
+
+	spiSetModuleLoader(NULL);
+
+	return checkResult("loader", bPassed);
+}
+
+// register index of a bank in an injected register block
+int mmioIndex(int reg, int gpio)
+{
+	return (reg + (gpio / 32) * SPI_MMIO_BANK_STRIDE) / sizeof(uint32_t);
+}
+
+// the mmio engine run against ordinary memory: the lines are set up as outputs and input,
+//	and the received bytes follow the MISO bit of the data register
+int checkMmio()
+{
+	int 		i, bPassed;
+	uint8_t 	tx[SPI_CHECK_BYTES], rx[SPI_CHECK_BYTES];
+	uint32_t 	regs[SPI_MMIO_REGS_SIZE / sizeof(uint32_t)];
+	struct spiParams 	params;
+	struct spiBackend 	backend;
+	struct spiMmioChip 	chip;
+
+	memset(regs, 0, sizeof(regs));
+	if (spiMmioInit(&backend, &chip, regs) != EXIT_SUCCESS) {
+		return checkResult("mmio", 0);
+	}
+
+	spiParamInit(&params);
+	params.backend 	= &backend;
+	for (i = 0; i < SPI_CHECK_BYTES; i++) {
+		tx[i] 	= (uint8_t)(0xa5 + i);
+	}
+
+	// MISO high
+	regs[mmioIndex(SPI_MMIO_REG_DATA, params.misoGpio)] 	= 1U << (params.misoGpio % 32);
+	memset(rx, 0, sizeof(rx));
+	bPassed 	= (spiTransfer(&params, tx, rx, SPI_CHECK_BYTES) == EXIT_SUCCESS);
+	for (i = 0; i < SPI_CHECK_BYTES; i++) {
+		bPassed 	= bPassed && rx[i] == 0xff;
+	}
+
+	// MISO low
+	regs[mmioIndex(SPI_MMIO_REG_DATA, params.misoGpio)] 	= 0;
+	memset(rx, 0xff, sizeof(rx));
+	bPassed 	= bPassed && (spiTransfer(&params, tx, rx, SPI_CHECK_BYTES) == EXIT_SUCCESS);
+	for (i = 0; i < SPI_CHECK_BYTES; i++) {
+		bPassed 	= bPassed && rx[i] == 0x00;
+	}
+
+	bPassed 	= bPassed &&
+					(regs[mmioIndex(SPI_MMIO_REG_CTRL, params.sckGpio)] & (1U << (params.sckGpio % 32))) &&
+					(regs[mmioIndex(SPI_MMIO_REG_CTRL, params.mosiGpio)] & (1U << (params.mosiGpio % 32))) &&
+					(regs[mmioIndex(SPI_MMIO_REG_CTRL, params.csGpio)] & (1U << (params.csGpio % 32))) &&
+					!(regs[mmioIndex(SPI_MMIO_REG_CTRL, params.misoGpio)] & (1U << (params.misoGpio % 32)));
+
+	spiReleaseFdCache();
+	spiMmioRelease(&chip);
+
+	return checkResult("mmio", bPassed);
+}
+
+// requests batched by the async engine keep their own params: a request without a delay
+//	must not wait for the delay of the request it was batched with
+int checkAsync()
+{
+	int 		i, count, numDone, bPassed;
+	uint8_t 	tx[SPI_CHECK_ASYNC_REQUESTS];
+	uint64_t 	expectedNs;
+	struct spiParams 		params[SPI_CHECK_ASYNC_REQUESTS];
+	struct spiSegment 		segments[SPI_CHECK_ASYNC_REQUESTS];
+	struct spiAsyncRequest 	requests[SPI_CHECK_ASYNC_REQUESTS], *done[SPI_CHECK_ASYNC_REQUESTS];
+	struct spiAsyncEngine 	engine;
+	struct spiBackend 		backend;
+	struct spiSimDevice 	device;
+
+	if (spiSimInit(&backend, &device, 0) != EXIT_SUCCESS || spiAsyncInit(&engine, 0, SPI_CHECK_ASYNC_REQUESTS) != EXIT_SUCCESS) {
+		return checkResult("async", 0);
+	}
+	device.bModelClock 	= 1;
+
+	// the first request keeps the worker busy on another device, so the next two are batched
+	memset(segments, 0, sizeof(segments));
+	expectedNs 	= 0;
+	for (i = 0; i < SPI_CHECK_ASYNC_REQUESTS; i++) {
+		spiParamInit(&params[i]);
+		params[i].backend 		= &backend;
+		params[i].busNum 		= 0;
+		params[i].deviceId 		= (i == 0 ? 1 : 0);
+		params[i].speedInHz 	= SPI_CHECK_ASYNC_SPEED;
+		params[i].delayInUs 	= (i == 0 ? SPI_CHECK_ASYNC_BUSY_US : (i == 1 ? SPI_CHECK_ASYNC_DELAY_US : 0));
+
+		tx[i] 					= (uint8_t)i;
+		segments[i].txBuffer 	= &tx[i];
+		segments[i].bytes 		= 1;
+
+		requests[i].params 		= &params[i];
+		requests[i].segments 	= &segments[i];
+		requests[i].numSegments = 1;
+
+		expectedNs 	+= 8 * 1000000000ULL / SPI_CHECK_ASYNC_SPEED + params[i].delayInUs * 1000ULL;
+	}
+
+	bPassed 	= 1;
+	for (i = 0; i < SPI_CHECK_ASYNC_REQUESTS; i++) {
+		bPassed 	= bPassed && spiAsyncSubmit(&engine, &requests[i]) == EXIT_SUCCESS;
+	}
+
+	count 	= 0;
+	while (bPassed && count < SPI_CHECK_ASYNC_REQUESTS) {
+		numDone 	= spiAsyncWait(&engine, done, SPI_CHECK_ASYNC_REQUESTS, SPI_CHECK_TIMEOUT_MS);
+		bPassed 	= (numDone > 0);
+		for (i = 0; i < numDone; i++) {
+			bPassed 	= bPassed && done[i]->status == EXIT_SUCCESS;
+		}
+		count 	+= numDone;
+	}
+	onionPrint(ONION_SEVERITY_DEBUG, ">> async: %llu messages, %llu ns on the bus, %llu expected\n",
+				(unsigned long long)device.messages, (unsigned long long)device.busTimeNs, (unsigned long long)expectedNs);
+
+	bPassed 	= bPassed && device.messages == 2 && device.busTimeNs == expectedNs;
+
+	spiAsyncRelease(&engine);
+	spiReleaseFdCache();
+	spiSimRelease(&device);
+
+	return checkResult("async", bPassed);
+}
+
+void* checkStreamThread(void *arg)
+{
+	struct spiCheckThread 	*thread 	= (struct spiCheckThread*)arg;
+
+	thread->status 	= spiStream(thread->params, thread->inFd, -1, -1, NULL);
+	__atomic_store_n(&(thread->bDone), 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+void* checkTransferThread(void *arg)
+{
+	uint8_t 	tx 	= 0x5a;
+	struct spiSegment 		segment;
+	struct spiCheckThread 	*thread 	= (struct spiCheckThread*)arg;
+
+	memset(&segment, 0, sizeof(segment));
+	segment.txBuffer 	= &tx;
+	segment.bytes 		= 1;
+
+	thread->status 	= spiTransferSegments(thread->params, &segment, 1);
+	__atomic_store_n(&(thread->bDone), 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+// messages the simulated device has received
+uint64_t checkSimMessages(struct spiSimDevice *device)
+{
+	uint64_t 	messages;
+
+	pthread_mutex_lock(&(device->lock));
+	messages 	= device->messages;
+	pthread_mutex_unlock(&(device->lock));
+
+	return messages;
+}
+
+// a stream keeps the device selected between its chunks, so a transfer from another thread
+//	to another device on the bus must wait for the end of the stream
+int checkArbiter()
+{
+	int 		i, chunkBytes, fds[2], bPassed, bStream, bOther;
+	uint8_t 	*data;
+	pthread_t 	streamer, other;
+	struct spiParams 		params[2];
+	struct spiCheckThread 	stream, transfer;
+	struct spiBackend 		backend;
+	struct spiSimDevice 	device;
+
+	if (spiSimInit(&backend, &device, 0) != EXIT_SUCCESS) {
+		return checkResult("arbiter", 0);
+	}
+
+	for (i = 0; i < 2; i++) {
+		spiParamInit(&params[i]);
+		params[i].backend 	= &backend;
+		params[i].busNum 	= 0;
+		params[i].deviceId 	= i;
+	}
+
+	// two chunks: the first is sent with the device left selected, the second waits for the end of the input
+	chunkBytes 	= spiGetMaxTransferSize();
+	data 		= (uint8_t*)calloc(2, chunkBytes);
+	if (data == NULL || pipe(fds) < 0) {
+		free(data);
+		spiSimRelease(&device);
+		return checkResult("arbiter", 0);
+	}
+
+	memset(&stream, 0, sizeof(stream));
+	stream.params 	= &params[0];
+	stream.inFd 	= fds[0];
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.params = &params[1];
+
+	bPassed 	= (write(fds[1], data, 2 * chunkBytes) == 2 * chunkBytes);
+	bStream 	= bPassed && pthread_create(&streamer, NULL, checkStreamThread, &stream) == 0;
+
+	for (i = 0; bStream && i < SPI_CHECK_TIMEOUT_MS && checkSimMessages(&device) == 0; i++) {
+		usleep(1000);
+	}
+
+	bOther 	= bStream && pthread_create(&other, NULL, checkTransferThread, &transfer) == 0;
+	if (bOther) {
+		usleep(SPI_CHECK_ARBITER_WAIT_MS * 1000);
+		bPassed 	= (checkSimMessages(&device) == 1 && !__atomic_load_n(&(transfer.bDone), __ATOMIC_ACQUIRE));
+		onionPrint(ONION_SEVERITY_DEBUG, ">> arbiter: transfer %s while the stream held the device selected\n", (bPassed ? "waited" : "went ahead"));
+	}
+
+	// the end of the input ends the stream, and lets the transfer through
+	close(fds[1]);
+	if (bOther) 	pthread_join(other, NULL);
+	if (bStream) 	pthread_join(streamer, NULL);
+
+	bPassed 	= bPassed && bOther &&
+					stream.status == EXIT_SUCCESS && transfer.status == EXIT_SUCCESS &&
+					checkSimMessages(&device) == 3;
+
+	close(fds[0]);
+	free(data);
+	spiReleaseFdCache();
+	spiSimRelease(&device);
+
+	return checkResult("arbiter", bPassed);
+}
+
+// the GPIO character device backend on a chip with MISO pulled up, as set up by tools/gpio-sim-check.sh
+int checkGpio(const char *path)
+{
+	int 		i, bPassed;
+	uint8_t 	tx[SPI_CHECK_BYTES], rx[SPI_CHECK_BYTES];
+	struct spiParams 	params;
+	struct spiBackend 	backend;
+	struct spiGpioChip 	chip;
+
+	if (spiGpioInit(&backend, &chip, path) != EXIT_SUCCESS) {
+		return checkResult("gpio", 0);
+	}
+
+	spiParamInit(&params);
+	params.backend 	= &backend;
+	params.sckGpio 	= SPI_CHECK_GPIO_SCK;
+	params.mosiGpio = SPI_CHECK_GPIO_MOSI;
+	params.misoGpio = SPI_CHECK_GPIO_MISO;
+	params.csGpio 	= SPI_CHECK_GPIO_CS;
+
+	for (i = 0; i < SPI_CHECK_BYTES; i++) {
+		tx[i] 	= (uint8_t)(0xa5 + i);
+	}
+	memset(rx, 0, sizeof(rx));
+
+	bPassed 	= (spiTransfer(&params, tx, rx, SPI_CHECK_BYTES) == EXIT_SUCCESS);
+	for (i = 0; i < SPI_CHECK_BYTES; i++) {
+		bPassed 	= bPassed && rx[i] == 0xff;
+	}
+	bPassed 	= bPassed && chip.setCalls > 0 && chip.getCalls > 0;
+
+	spiReleaseFdCache();
+	spiGpioRelease(&chip);
+
+	return checkResult("gpio", bPassed);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char 	*progname;
+	const char 	*gpioChip;
+	int 		ch, option_index, status;
+
+	static const struct option lopts[] = {
+		{ "verbose",	no_argument, 		0, 'v' },
+		{ "gpiochip",	required_argument, 	0, 'G' },
+
+		{ NULL, 0, 0, 0 },	// sentinel
+	};
+
+	// set defaults
+	verbose 		= ONION_VERBOSITY_NONE;
+	gpioChip 		= NULL;
+	option_index 	= 0;
+
+	// save the program name
+	progname 		= argv[0];
+
+	// parse the option arguments
+	while( (ch = getopt_long (argc, argv, "vhG:", lopts, &option_index)) != -1) {
+		switch (ch) {
+			case 'v':
+				verbose++;
+				break;
+			case 'G':
+				gpioChip 	= optarg;
+				break;
+			default:
+				usage(progname);
+				return EXIT_FAILURE;
+		}
+	}
+
+	onionSetVerbosity(verbose);
+
+	// run every check, even after a failure
+	status 	= EXIT_SUCCESS;
+	if (checkLoader() != EXIT_SUCCESS) 	status 	= EXIT_FAILURE;
+	if (checkMmio() != EXIT_SUCCESS) 	status 	= EXIT_FAILURE;
+	if (checkAsync() != EXIT_SUCCESS) 	status 	= EXIT_FAILURE;
+	if (checkArbiter() != EXIT_SUCCESS) status 	= EXIT_FAILURE;
+	if (gpioChip != NULL && checkGpio(gpioChip) != EXIT_SUCCESS) {
+		status 	= EXIT_FAILURE;
+	}
+
+	return status;
+}
@@ -8,12 +8,32 @@ void usage(const char* progName)
 	onionPrint(ONION_SEVERITY_FATAL, "spi-tool: interface devices using the SPI protocol\n");
 	onionPrint(ONION_SEVERITY_FATAL, "\n");
 
-	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> read <address>\n");
-	onionPrint(ONION_SEVERITY_FATAL, "  Perform a read through the SPI protocol\n");
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> read <address> [count]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Read count bytes (default 1) from an address in one burst\n");
 	onionPrint(ONION_SEVERITY_FATAL, "\n");
 	
-	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> write <address> <value>\n");
-	onionPrint(ONION_SEVERITY_FATAL, "  Perform a write through the SPI protocol\n");
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> write <address> <value> [value ...]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Write values to an address in one burst, a value like 0xdeadbeef is a string of bytes\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> [options] batch [-f <file>]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Run commands from <file> or stdin, one per line, with the device kept open:\n");
+	onionPrint(ONION_SEVERITY_FATAL, "    read <address> [count]       Read count bytes\n");
+	onionPrint(ONION_SEVERITY_FATAL, "    write <address> <value> ...  Write the values\n");
+	onionPrint(ONION_SEVERITY_FATAL, "    transfer <value> ...         Send the values, print the bytes received\n");
+	onionPrint(ONION_SEVERITY_FATAL, "    delay <us>                   Wait before the next command\n");
+	onionPrint(ONION_SEVERITY_FATAL, "    stats                        Print the transfer statistics\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Consecutive commands are sent together, each in its own chip select frame\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> [options] stream [--in <file>] [--out <file>] [--length <bytes>]\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Send a file and/or save the data received, in chunks of the spidev buffer size,\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  with the device selected throughout. Without --in, --length zero bytes are sent\n");
+	onionPrint(ONION_SEVERITY_FATAL, "\n");
+
+	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> [options] sample --period <us> [--count <n>] [--priority <1-99>] <value> ...\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  Send the values every period from a timer-driven thread, print the bytes received\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  with their timestamps, then the missed deadlines and the jitter\n");
 	onionPrint(ONION_SEVERITY_FATAL, "\n");
 
 	onionPrint(ONION_SEVERITY_FATAL, "Usage: spi-tool -b <bus number> -d <device ID> [options] setup\n");
@@ -28,16 +48,519 @@ void usage(const char* progName)
 	onionPrint(ONION_SEVERITY_FATAL, "  --mosi <gpio>            Set GPIO for SPI MOSI signal\n");
 	onionPrint(ONION_SEVERITY_FATAL, "  --miso <gpio>            Set GPIO for SPI MISO signal\n");
 	onionPrint(ONION_SEVERITY_FATAL, "  --cs <gpio>              Set GPIO for SPI CS signal\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --gpiochip <path>        Bit-bang the SCK, MOSI, MISO and CS lines of this GPIO chip instead of using spidev\n");
 
 	onionPrint(ONION_SEVERITY_FATAL, "  --3wire                  SI/SO signals shared\n");
 	onionPrint(ONION_SEVERITY_FATAL, "  --no-cs                  No chip select signal\n");
 	onionPrint(ONION_SEVERITY_FATAL, "  --cs-high                Set chip select to active high\n");
 	onionPrint(ONION_SEVERITY_FATAL, "  --lsb                    Transmit Least Significant Bit first\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --tx-nbits <1|2|4>       Transmit data on 1, 2 (dual) or 4 (quad) lines, the address is always sent on 1\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --rx-nbits <1|2|4>       Receive data on 1, 2 (dual) or 4 (quad) lines\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --trace <file>           Write a binary trace of the transfers to <file>\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --stats                  Print transfer statistics when done\n");
+	onionPrint(ONION_SEVERITY_FATAL, "  --format <hex|raw|json>  Output format of read and transfer results (default: hex)\n");
 
 	onionPrint(ONION_SEVERITY_FATAL, "\n");
 }
 
-int parseOptions(int argc, char** argv, struct spiParams *params)
+// print a latency histogram in microseconds
+void printLatency(const char *name, struct spiStatsHistogram *histogram)
+{
+	onionPrint(ONION_SEVERITY_FATAL, "  %-5s us:    min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", name,
+				histogram->minNs / 1000.0,
+				spiStatsPercentile(histogram, 50) / 1000.0,
+				spiStatsPercentile(histogram, 90) / 1000.0,
+				spiStatsPercentile(histogram, 99) / 1000.0,
+				histogram->maxNs / 1000.0
+		);
+}
+
+// print the statistics of every device used
+void printStats()
+{
+	int 	i, err, count;
+	struct spiStats 	*stats;
+
+	stats 	= (struct spiStats*)malloc(sizeof(struct spiStats) * SPI_STATS_DEVICES);
+	if (stats == NULL) {
+		return;
+	}
+
+	count 	= spiStatsGetAll(stats, SPI_STATS_DEVICES);
+	for (i = 0; i < count; i++) {
+		onionPrint(ONION_SEVERITY_FATAL, "> SPI statistics for bus%d, device %d:\n", stats[i].busNum, stats[i].deviceId);
+		onionPrint(ONION_SEVERITY_FATAL, "  transfers:   %llu (%llu failed)\n", (unsigned long long)stats[i].transfers, (unsigned long long)stats[i].errors);
+		onionPrint(ONION_SEVERITY_FATAL, "  messages:    %llu\n", (unsigned long long)stats[i].messages);
+		onionPrint(ONION_SEVERITY_FATAL, "  bytes:       %llu sent, %llu received\n", (unsigned long long)stats[i].txBytes, (unsigned long long)stats[i].rxBytes);
+		printLatency("ioctl", &(stats[i].ioctlLatency));
+		printLatency("call", &(stats[i].callLatency));
+
+		for (err = 0; err <= SPI_STATS_ERRNO_MAX; err++) {
+			if (stats[i].errnoCounts[err] > 0) {
+				onionPrint(ONION_SEVERITY_FATAL, "  errno %-5d  %llu (%s)\n", err, (unsigned long long)stats[i].errnoCounts[err], (err < SPI_STATS_ERRNO_MAX ? strerror(err) : "other"));
+			}
+		}
+	}
+
+	free(stats);
+}
+
+// parse a number in decimal, hex (0x) or octal (0), between 0 and maxValue
+int parseNumber(const char *text, int maxValue, int *value)
+{
+	long 	number;
+	char 	*end;
+
+	number 	= strtol(text, &end, 0);
+	if (end == text || *end != '\0' || number < 0 || number > maxValue) {
+		return EXIT_FAILURE;
+	}
+
+	*value 	= (int)number;
+	return EXIT_SUCCESS;
+}
+
+// parse byte values, a 0x value of more than two digits is a string of bytes
+//	returns the number of bytes, -1 if a value is invalid
+int parseValues(char **args, int numArgs, uint8_t *values, int maxValues)
+{
+	int 	i, count, digits, value;
+	char 	pair[3];
+
+	count 	= 0;
+	for (i = 0; i < numArgs; i++) {
+		digits 	= strlen(args[i]) - 2;
+
+		if (strncmp(args[i], "0x", 2) == 0 && digits > 2) {
+			if (digits % 2 != 0 || strspn(args[i] + 2, "0123456789abcdefABCDEF") != (size_t)digits) {
+				return -1;
+			}
+
+			for (pair[2] = '\0'; digits > 0; digits -= 2) {
+				if (count == maxValues) {
+					return -1;
+				}
+				memcpy(pair, args[i] + strlen(args[i]) - digits, 2);
+				values[count++] 	= (uint8_t)strtol(pair, NULL, 16);
+			}
+		}
+		else {
+			if (count == maxValues || parseNumber(args[i], 0xff, &value) != EXIT_SUCCESS) {
+				return -1;
+			}
+			values[count++] 	= (uint8_t)value;
+		}
+	}
+
+	return count;
+}
+
+// write the result of a read or transfer command to stdout
+void printResult(int format, int mode, int addr, uint8_t *data, int bytes, int status)
+{
+	int 	i;
+
+	if (format == SPI_TOOL_FORMAT_RAW) {
+		if (status == EXIT_SUCCESS) {
+			fwrite(data, 1, bytes, stdout);
+		}
+	}
+	else if (format == SPI_TOOL_FORMAT_JSON) {
+		printf("{\"command\": \"%s\"", (mode == SPI_TOOL_MODE_READ ? SPI_TOOL_COMMAND_READ : (mode == SPI_TOOL_MODE_WRITE ? SPI_TOOL_COMMAND_WRITE : SPI_TOOL_COMMAND_TRANSFER)) );
+		if (mode != SPI_TOOL_MODE_TRANSFER) {
+			printf(", \"address\": %d", addr);
+		}
+		if (mode == SPI_TOOL_MODE_WRITE) {
+			printf(", \"bytes\": %d", bytes);
+		}
+		else if (status == EXIT_SUCCESS) {
+			printf(", \"data\": [");
+			for (i = 0; i < bytes; i++) {
+				printf("%s%d", (i > 0 ? ", " : ""), data[i]);
+			}
+			printf("]");
+		}
+		printf(", \"status\": \"%s\"}\n", (status == EXIT_SUCCESS ? "ok" : "error"));
+	}
+	else {
+		if (mode == SPI_TOOL_MODE_READ) {
+			printf("0x%02x:", addr);
+		}
+		for (i = 0; i < bytes && status == EXIT_SUCCESS; i++) {
+			printf("%s0x%02x", (i > 0 || mode == SPI_TOOL_MODE_READ ? " " : ""), data[i]);
+		}
+		printf("%s\n", (status == EXIT_SUCCESS ? "" : " ERROR"));
+	}
+}
+
+// send the batched commands and print their results in order
+int batchFlush(struct spiToolBatch *batch, struct spiParams *params)
+{
+	int 	status, i;
+	struct spiToolBatchCommand 	*command;
+
+	if (batch->numSegments == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	// the device stays selected until the end of the last command
+	batch->segments[batch->numSegments - 1].csChange 	= 0;
+	status 	= spiTransferSegments(params, batch->segments, batch->numSegments);
+
+	for (i = 0; i < batch->numCommands; i++) {
+		command 	= &(batch->commands[i]);
+		if (command->mode != SPI_TOOL_MODE_WRITE) {
+			printResult(batch->format, command->mode, command->addr, command->rxBuffer, command->bytes, status);
+		}
+	}
+	fflush(stdout);
+
+	batch->numSegments 	= 0;
+	batch->numCommands 	= 0;
+	batch->dataBytes 	= 0;
+
+	return status;
+}
+
+// add a command to the batch, flushing first if it does not fit
+//	reads and writes are an address segment and a data segment, like spiRead and spiWrite
+int batchAdd(struct spiToolBatch *batch, struct spiParams *params, int mode, int addr, uint8_t *values, int bytes)
+{
+	int 		status, numSegments;
+	uint8_t 	*data;
+	struct spiSegment 			*segment;
+	struct spiToolBatchCommand 	*command;
+
+	numSegments 	= (mode == SPI_TOOL_MODE_TRANSFER ? 1 : 2);
+	if (bytes + 1 > SPI_TOOL_BATCH_BYTES) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: at most %d bytes per command\n", SPI_TOOL_BATCH_BYTES - 1);
+		return EXIT_FAILURE;
+	}
+
+	if (	batch->numSegments + numSegments > SPI_MAX_SEGMENTS ||
+			batch->dataBytes + bytes + 1 > SPI_TOOL_BATCH_BYTES
+		)
+	{
+		status 	= batchFlush(batch, params);
+		if (status != EXIT_SUCCESS) {
+			return status;
+		}
+	}
+
+	data 		= &(batch->data[batch->dataBytes]);
+	segment 	= &(batch->segments[batch->numSegments]);
+	memset(segment, 0, sizeof(struct spiSegment) * numSegments);
+
+	command 			= &(batch->commands[batch->numCommands++]);
+	command->mode 		= mode;
+	command->addr 		= addr;
+	command->bytes 		= bytes;
+	command->rxBuffer 	= NULL;
+
+	if (mode == SPI_TOOL_MODE_TRANSFER) {
+		// the received bytes replace the sent ones
+		memcpy(data, values, bytes);
+		segment->txBuffer 	= data;
+		segment->rxBuffer 	= data;
+		segment->bytes 		= bytes;
+		command->rxBuffer 	= data;
+		batch->dataBytes 	+= bytes;
+	}
+	else {
+		// address phase, always on a single wire
+		data[0] 			= (uint8_t)addr;
+		segment->txBuffer 	= data;
+		segment->bytes 		= 1;
+		segment->txNbits 	= 1;
+		segment->rxNbits 	= 1;
+		segment->delayInUs 	= SPI_SEGMENT_NO_DELAY;
+		segment++;
+
+		segment->bytes 		= bytes;
+		if (mode == SPI_TOOL_MODE_WRITE) {
+			memcpy(data + 1, values, bytes);
+			segment->txBuffer 	= data + 1;
+		}
+		else {
+			segment->rxBuffer 	= data + 1;
+			command->rxBuffer 	= data + 1;
+		}
+		batch->dataBytes 	+= bytes + 1;
+	}
+
+	// each command in its own chip select frame
+	segment->csChange 	= 1;
+	batch->numSegments 	+= numSegments;
+
+	return EXIT_SUCCESS;
+}
+
+// run the commands read from a stream against one open device
+//	commands are held back and sent together until the batch is full, a stats command,
+//	or the end of the input, or sent one by one when the input is a terminal
+int runBatch(struct spiParams *params, FILE *input, int bInteractive, int format)
+{
+	int 		status, lineNum, count, bytes, number, delay, bInvalid;
+	char 		line[SPI_TOOL_BATCH_LINE];
+	char 		*command, *token, *save;
+	char 		*args[SPI_TOOL_BATCH_LINE / 2];
+	uint8_t 	values[SPI_TOOL_BATCH_LINE / 2];
+	struct spiSegment 		*segment;
+	struct spiToolBatch 	*batch;
+
+	batch 	= (struct spiToolBatch*)malloc(sizeof(struct spiToolBatch));
+	if (batch == NULL) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not allocate the batch\n");
+		return EXIT_FAILURE;
+	}
+	batch->numSegments 	= 0;
+	batch->numCommands 	= 0;
+	batch->dataBytes 	= 0;
+	batch->format 		= format;
+
+	status 		= spiOpenDevice(params);
+	lineNum 	= 0;
+	bInvalid 	= 0;
+
+	while (status == EXIT_SUCCESS && !bInvalid && fgets(line, sizeof(line), input) != NULL) {
+		lineNum++;
+
+		// strip comments
+		if ((token = strchr(line, '#')) != NULL) {
+			*token 	= '\0';
+		}
+		command 	= strtok_r(line, " \t\r\n", &save);
+		if (command == NULL) {
+			continue;
+		}
+
+		// split the arguments, they are parsed by each command
+		count 	= 0;
+		while ((token = strtok_r(NULL, " \t\r\n,", &save)) != NULL) {
+			args[count++] 	= token;
+		}
+
+		if (strcmp(command, SPI_TOOL_COMMAND_READ) == 0 && (count == 1 || count == 2)) {
+			// the count is not limited to a byte
+			bInvalid 	= (parseNumber(args[0], 0xff, &number) != EXIT_SUCCESS ||
+							(count == 2 && parseNumber(args[1], SPI_TOOL_BATCH_BYTES, &bytes) != EXIT_SUCCESS) );
+			if (!bInvalid) {
+				status 	= batchAdd(batch, params, SPI_TOOL_MODE_READ, number, NULL, (count == 2 ? bytes : 1));
+			}
+		}
+		else if (strcmp(command, SPI_TOOL_COMMAND_WRITE) == 0 && count >= 2) {
+			bytes 		= parseValues(&args[1], count - 1, values, sizeof(values));
+			bInvalid 	= (parseNumber(args[0], 0xff, &number) != EXIT_SUCCESS || bytes < 0);
+			if (!bInvalid) {
+				status 	= batchAdd(batch, params, SPI_TOOL_MODE_WRITE, number, values, bytes);
+			}
+		}
+		else if (strcmp(command, SPI_TOOL_COMMAND_TRANSFER) == 0 && count >= 1) {
+			bytes 		= parseValues(args, count, values, sizeof(values));
+			bInvalid 	= (bytes < 0);
+			if (!bInvalid) {
+				status 	= batchAdd(batch, params, SPI_TOOL_MODE_TRANSFER, 0, values, bytes);
+			}
+		}
+		else if (strcmp(command, SPI_TOOL_COMMAND_DELAY) == 0 && count == 1) {
+			// wait after the previous command, before its chip select is released
+			//	a segment delays at most SPI_TOOL_MAX_DELAY_US, the rest is slept after sending the batch
+			bInvalid 	= (parseNumber(args[0], INT_MAX - SPI_TOOL_MAX_DELAY_US, &number) != EXIT_SUCCESS);
+			if (!bInvalid && batch->numSegments > 0) {
+				segment 	= &(batch->segments[batch->numSegments - 1]);
+				// a segment without its own delay waits for the one from the command line
+				delay 		= (segment->delayInUs == 0 ? params->delayInUs : (segment->delayInUs > 0 ? segment->delayInUs : 0)) + number;
+				number 		= 0;
+				if (delay > SPI_TOOL_MAX_DELAY_US) {
+					number 	= delay - SPI_TOOL_MAX_DELAY_US;
+					delay 	= SPI_TOOL_MAX_DELAY_US;
+				}
+				segment->delayInUs 	= delay;
+
+				if (number > 0) {
+					status 	= batchFlush(batch, params);
+				}
+			}
+			if (!bInvalid && status == EXIT_SUCCESS && number > 0) {
+				usleep(number);
+			}
+		}
+		else if (strcmp(command, SPI_TOOL_COMMAND_STATS) == 0 && count == 0) {
+			status 	= batchFlush(batch, params);
+			printStats();
+		}
+		else {
+			bInvalid 	= 1;
+		}
+
+		if (bInvalid) {
+			onionPrint(ONION_SEVERITY_FATAL, "> ERROR: line %d: invalid arguments for '%s'\n", lineNum, command);
+			break;
+		}
+
+		// nothing is held back from someone typing
+		if (status == EXIT_SUCCESS && bInteractive) {
+			status 	= batchFlush(batch, params);
+		}
+	}
+
+	// the commands before an invalid line still run
+	if (status == EXIT_SUCCESS) {
+		status 	= batchFlush(batch, params);
+	}
+	if (bInvalid) {
+		status 	= EXIT_FAILURE;
+	}
+
+	// clean-up
+	spiCloseDevice(params);
+	free(batch);
+
+	return status;
+}
+
+// stream between files and the device
+int runStream(struct spiParams *params, struct spiToolOptions *options)
+{
+	int 	status, inFd, outFd;
+	struct spiStreamStats 	stats;
+
+	inFd 	= -1;
+	outFd 	= -1;
+	status 	= EXIT_FAILURE;
+
+	if (options->streamIn != NULL && (inFd = open(options->streamIn, O_RDONLY)) < 0) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not open '%s'\n", options->streamIn);
+	}
+	else if (options->streamOut != NULL && (outFd = open(options->streamOut, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not create '%s'\n", options->streamOut);
+	}
+	else {
+		// keep the device open for all the chunks
+		status 	= spiOpenDevice(params);
+		if (status == EXIT_SUCCESS) {
+			status 	= spiStream(params, inFd, outFd, options->streamBytes, &stats);
+			spiCloseDevice(params);
+
+			onionPrint(ONION_SEVERITY_INFO, "> Streamed %llu bytes in %llu chunks: %.1f ms, %.1f kB/s, bus busy %.1f ms, waited %.1f ms for input\n",
+						(unsigned long long)stats.bytes,
+						(unsigned long long)stats.chunks,
+						stats.elapsedNs / 1e6,
+						(stats.elapsedNs > 0 ? stats.bytes * 1e6 / stats.elapsedNs : 0.0),
+						stats.busNs / 1e6,
+						stats.stallNs / 1e6
+				);
+		}
+	}
+
+	// clean-up
+	if (inFd >= 0) 		close(inFd);
+	if (outFd >= 0) 	close(outFd);
+
+	return status;
+}
+
+// print one sample, with its time since the start of sampling
+void printSample(int format, struct spiSample *sample, uint64_t startNs, uint8_t *data, int bytes)
+{
+	int 		i;
+	uint64_t 	timeUs;
+
+	timeUs 	= (sample->timestampNs - startNs) / 1000;
+
+	if (format == SPI_TOOL_FORMAT_RAW) {
+		fwrite(data, 1, bytes, stdout);
+	}
+	else if (format == SPI_TOOL_FORMAT_JSON) {
+		printf("{\"command\": \"%s\", \"period\": %llu, \"time_us\": %llu, \"data\": [", SPI_TOOL_COMMAND_SAMPLE, (unsigned long long)sample->period, (unsigned long long)timeUs);
+		for (i = 0; i < bytes && sample->status == EXIT_SUCCESS; i++) {
+			printf("%s%d", (i > 0 ? ", " : ""), data[i]);
+		}
+		printf("], \"status\": \"%s\"}\n", (sample->status == EXIT_SUCCESS ? "ok" : "error"));
+	}
+	else {
+		printf("%llu.%06llu:", (unsigned long long)(timeUs / 1000000), (unsigned long long)(timeUs % 1000000));
+		for (i = 0; i < bytes && sample->status == EXIT_SUCCESS; i++) {
+			printf(" 0x%02x", data[i]);
+		}
+		printf("%s\n", (sample->status == EXIT_SUCCESS ? "" : " ERROR"));
+	}
+}
+
+// send the values at a fixed rate and print what is received
+int runSample(struct spiParams *params, struct spiToolOptions *options, uint8_t *values, int bytes)
+{
+	int 		status, i, count, printed, waitUs;
+	uint8_t 	*data;
+	struct spiSample 		*samples;
+	struct spiSegment 		segment;
+	struct spiSampler 		sampler;
+	struct spiSamplerStats 	stats;
+
+	// one full duplex transfer
+	memset(&segment, 0, sizeof(segment));
+	segment.txBuffer 	= values;
+	segment.rxBuffer 	= values;
+	segment.bytes 		= bytes;
+
+	if (spiSamplerInit(&sampler, params, &segment, 1, 0) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	sampler.priority 	= options->samplePriority;
+
+	samples 	= (struct spiSample*)malloc(sizeof(struct spiSample) * sampler.numSamples);
+	data 		= (uint8_t*)malloc(sampler.sampleBytes * sampler.numSamples);
+	if (samples == NULL || data == NULL) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not allocate the samples\n");
+		status 	= EXIT_FAILURE;
+	}
+	else {
+		status 	= spiSamplerStart(&sampler, options->samplePeriodUs);
+	}
+
+	printed 	= 0;
+	while (status == EXIT_SUCCESS && printed < options->sampleCount) {
+		// wait for the samples still to come, but empty the ring well before it fills up
+		waitUs 	= SPI_TOOL_SAMPLE_POLL_US;
+		if ((int64_t)options->samplePeriodUs * (options->sampleCount - printed) < waitUs) {
+			waitUs 	= options->samplePeriodUs * (options->sampleCount - printed);
+		}
+		if ((int64_t)options->samplePeriodUs * (sampler.numSamples / 4) < waitUs) {
+			waitUs 	= options->samplePeriodUs * (sampler.numSamples / 4);
+		}
+		usleep(waitUs);
+
+		count 	= spiSamplerRead(&sampler, samples, data, sampler.numSamples);
+		for (i = 0; i < count && printed < options->sampleCount; i++, printed++) {
+			printSample(options->format, &samples[i], sampler.startNs, data + i * sampler.sampleBytes, sampler.sampleBytes);
+		}
+		fflush(stdout);
+	}
+	spiSamplerStop(&sampler);
+
+	if (status == EXIT_SUCCESS) {
+		spiSamplerGetStats(&sampler, &stats);
+		onionPrint(ONION_SEVERITY_INFO, "> %llu samples every %d us: %llu missed deadlines, %llu errors, %llu overruns\n",
+					(unsigned long long)stats.samples, options->samplePeriodUs,
+					(unsigned long long)stats.missed,
+					(unsigned long long)stats.errors,
+					(unsigned long long)stats.overruns
+			);
+		if (stats.samples > 0 && onionGetVerbosity() >= ONION_SEVERITY_INFO) {
+			printLatency("jitter", &(stats.jitter));
+			printLatency("xfer", &(stats.duration));
+		}
+	}
+
+	// clean-up
+	spiSamplerRelease(&sampler);
+	free(samples);
+	free(data);
+
+	return status;
+}
+
+int parseOptions(int argc, char** argv, struct spiParams *params, struct spiToolOptions *options)
 {
 	const char 	*progname;
 	int 	ch;
@@ -60,11 +583,24 @@ int parseOptions(int argc, char** argv, struct spiParams *params)
 		{ "cs-high",	no_argument, 		0, 'H' },
 		{ "lsb",		no_argument, 		0, 'L' },
 		{ "loop",		no_argument, 		0, 'l' },
+		{ "tx-nbits",	required_argument, 	0, 't' },
+		{ "rx-nbits",	required_argument, 	0, 'r' },
+		{ "trace",		required_argument, 	0, 'T' },
+		{ "stats",		no_argument, 		0, 'X' },
 		
 		{ "sck",		required_argument, 	0, 'S' },
 		{ "mosi",		required_argument, 	0, 'O' },
 		{ "miso",		required_argument, 	0, 'I' },
 		{ "cs",			required_argument, 	0, 'C' },
+		{ "gpiochip",	required_argument, 	0, 'G' },
+		{ "file",		required_argument, 	0, 'f' },
+		{ "format",		required_argument, 	0, 'F' },
+		{ "in",			required_argument, 	0, 'i' },
+		{ "out",		required_argument, 	0, 'o' },
+		{ "length",		required_argument, 	0, 'n' },
+		{ "period",		required_argument, 	0, 'P' },
+		{ "count",		required_argument, 	0, 'c' },
+		{ "priority",	required_argument, 	0, 'p' },
 
 		{ NULL, 0, 0, 0 },	// sentinel
 	};
@@ -73,7 +609,7 @@ int parseOptions(int argc, char** argv, struct spiParams *params)
 	progname 		= argv[0];
 
 	// parse the option arguments
-	while( (ch = getopt_long (argc, argv, "vqhb:d:s:D:B:S:O:I:C", lopts, &option_index)) != -1) {
+	while( (ch = getopt_long (argc, argv, "vqhb:d:s:D:B:S:O:I:Cf:", lopts, &option_index)) != -1) {
 		switch (ch) {
 			case 'v':
 				// verbose output
@@ -105,8 +641,9 @@ int parseOptions(int argc, char** argv, struct spiParams *params)
 				params->bitsPerWord	= atoi(optarg);
 				break;
 			case 'm':
-				// set the SPI Mode
+				// set the SPI Mode, for the kernel module and the clock mode bits
 				params->mode		= atoi(optarg);
+				params->modeBits	= (params->modeBits & ~SPI_MODE_3) | (params->mode & SPI_MODE_3);
 				break;
 
 			case '3':
@@ -129,6 +666,38 @@ int parseOptions(int argc, char** argv, struct spiParams *params)
 				// set the mode to loopback
 				params->modeBits	|= SPI_LOOP;
 				break;
+			case 't':
+				// set the number of transmit data lines
+				params->txNbits		= atoi(optarg);
+				if (params->txNbits == 2)
+					params->modeBits	|= SPI_TX_DUAL;
+				else if (params->txNbits == 4)
+					params->modeBits	|= SPI_TX_QUAD;
+				else if (params->txNbits != 1) {
+					usage(progname);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'r':
+				// set the number of receive data lines
+				params->rxNbits		= atoi(optarg);
+				if (params->rxNbits == 2)
+					params->modeBits	|= SPI_RX_DUAL;
+				else if (params->rxNbits == 4)
+					params->modeBits	|= SPI_RX_QUAD;
+				else if (params->rxNbits != 1) {
+					usage(progname);
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'T':
+				// dump the transfer trace when done
+				options->tracePath 	= optarg;
+				break;
+			case 'X':
+				// print the statistics when done
+				options->bStats 	= 1;
+				break;
 
 			case 'S':
 				// set the SCK gpio
@@ -146,6 +715,51 @@ int parseOptions(int argc, char** argv, struct spiParams *params)
 				// set the CS gpio
 				params->csGpio		= atoi(optarg);
 				break;
+			case 'G':
+				// bit-bang on a GPIO chip
+				options->gpioChip 	= optarg;
+				break;
+			case 'f':
+				// batch commands from a file
+				options->batchPath 	= optarg;
+				break;
+			case 'i':
+				// stream: the file to send
+				options->streamIn 	= optarg;
+				break;
+			case 'o':
+				// stream: the file for the received data
+				options->streamOut 	= optarg;
+				break;
+			case 'n':
+				// stream: the number of bytes
+				options->streamBytes 	= strtoll(optarg, NULL, 0);
+				break;
+			case 'P':
+				// sample: the period in microseconds
+				options->samplePeriodUs 	= atoi(optarg);
+				break;
+			case 'c':
+				// sample: the number of samples
+				options->sampleCount 		= atoi(optarg);
+				break;
+			case 'p':
+				// sample: realtime priority of the sampling thread
+				options->samplePriority 	= atoi(optarg);
+				break;
+			case 'F':
+				// output format of the results
+				if (strcmp(optarg, "hex") == 0)
+					options->format 	= SPI_TOOL_FORMAT_HEX;
+				else if (strcmp(optarg, "raw") == 0)
+					options->format 	= SPI_TOOL_FORMAT_RAW;
+				else if (strcmp(optarg, "json") == 0)
+					options->format 	= SPI_TOOL_FORMAT_JSON;
+				else {
+					usage(progname);
+					return EXIT_FAILURE;
+				}
+				break;
 
 			default:
 				usage(progname);
@@ -164,12 +778,14 @@ int main(int argc, char** argv)
 	int 		debug, mode;
 
 	int 		addr;
-	int 		value;
 	int 		size;
-	uint8_t 	*txBuffer;
-	uint8_t 	*rxBuffer;
+	FILE 		*input;
+	uint8_t 	buffer[SPI_TOOL_MAX_BYTES];
 
 	struct spiParams	params;
+	struct spiToolOptions 	options;
+	struct spiBackend 	gpioBackend;
+	struct spiGpioChip 	chip;
 
 
 	// set defaults
@@ -177,7 +793,10 @@ int main(int argc, char** argv)
 	debug 			= 0;
 	mode 			= SPI_TOOL_MODE_NONE;
 	addr 			= -1;
-	value 			= -1;
+	size 			= -1;
+	memset(&options, 0, sizeof(options));
+	options.streamBytes 	= -1;
+	options.sampleCount 	= SPI_TOOL_SAMPLE_COUNT;
 
 	spiParamInit(&params);
 
@@ -186,7 +805,7 @@ int main(int argc, char** argv)
 
 
 	// parse the option arguments
-	if( parseOptions(argc, argv, &params) == EXIT_FAILURE) {
+	if( parseOptions(argc, argv, &params, &options) == EXIT_FAILURE) {
 		return 0;
 	}
 
@@ -196,7 +815,11 @@ int main(int argc, char** argv)
 	argv	+= optind;
 
 	//// parse the real arguments
-	if (argc >= 1 ) {
+	if (argc == 0 && options.batchPath != NULL) {
+		// a command file implies batch mode
+		mode 	= SPI_TOOL_MODE_BATCH;
+	}
+	else if (argc >= 1 ) {
 		// argument1 - find the mode
 		if (strcmp(argv[0], SPI_TOOL_COMMAND_READ) == 0) {
 			mode 	= SPI_TOOL_MODE_READ;
@@ -207,22 +830,48 @@ int main(int argc, char** argv)
 		else if (strcmp(argv[0], SPI_TOOL_COMMAND_SETUP_DEVICE) == 0) {
 			mode 	= SPI_TOOL_MODE_SETUP_DEVICE;
 		}
+		else if (strcmp(argv[0], SPI_TOOL_COMMAND_BATCH) == 0) {
+			mode 	= SPI_TOOL_MODE_BATCH;
+		}
+		else if (strcmp(argv[0], SPI_TOOL_COMMAND_STREAM) == 0) {
+			mode 	= SPI_TOOL_MODE_STREAM;
+		}
+		else if (strcmp(argv[0], SPI_TOOL_COMMAND_SAMPLE) == 0) {
+			mode 	= SPI_TOOL_MODE_SAMPLE;
+		}
 
 		// read the address
 		if 	(	argc >= 2 &&
 				(mode == SPI_TOOL_MODE_READ ||
-				 mode == SPI_TOOL_MODE_WRITE)
+				 mode == SPI_TOOL_MODE_WRITE) &&
+				parseNumber(argv[1], 0xff, &addr) != EXIT_SUCCESS
 			)
 		{
-			sscanf (argv[1],"0x%02x", &addr);
+			addr 	= -1;
+		}
+
+		// read mode: the number of bytes, one by default
+		if (mode == SPI_TOOL_MODE_READ) {
+			size 	= 1;
+			if (argc >= 3 && (parseNumber(argv[2], SPI_TOOL_MAX_BYTES, &size) != EXIT_SUCCESS || size == 0 || argc > 3) ) {
+				size 	= -1;
+			}
 		}
 
-		// write mode: read the value to write
+		// write mode: the values to write
 		if 	(	argc >= 3 &&
 				mode == SPI_TOOL_MODE_WRITE
 			)
 		{
-			sscanf (argv[2],"0x%02x", &value);
+			size 	= parseValues(&argv[2], argc - 2, buffer, sizeof(buffer));
+		}
+
+		// sample mode: the values sent every period
+		if 	(	argc >= 2 &&
+				mode == SPI_TOOL_MODE_SAMPLE
+			)
+		{
+			size 	= parseValues(&argv[1], argc - 1, buffer, sizeof(buffer));
 		}
 	}
 
@@ -238,11 +887,33 @@ int main(int argc, char** argv)
 		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: address argument required!\n\n");
 		mode 	= SPI_TOOL_MODE_NONE;
 	}
-	if 	(	value < 0 &&
+	if 	(	size <= 0 &&
+			mode == SPI_TOOL_MODE_READ
+		)
+	{
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: count must be 1 to %d!\n\n", SPI_TOOL_MAX_BYTES);
+		mode 	= SPI_TOOL_MODE_NONE;
+	}
+	if 	(	size <= 0 &&
 			mode == SPI_TOOL_MODE_WRITE
 		)
 	{
-		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: value argument required!\n\n");
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: value arguments required, at most %d bytes!\n\n", SPI_TOOL_MAX_BYTES);
+		mode 	= SPI_TOOL_MODE_NONE;
+	}
+	if 	(	mode == SPI_TOOL_MODE_STREAM &&
+			( (options.streamIn == NULL && options.streamOut == NULL) ||
+			  (options.streamIn == NULL && options.streamBytes < 0) )
+		)
+	{
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: stream needs --in, or --out and --length!\n\n");
+		mode 	= SPI_TOOL_MODE_NONE;
+	}
+	if 	(	mode == SPI_TOOL_MODE_SAMPLE &&
+			(size <= 0 || options.samplePeriodUs <= 0 || options.sampleCount <= 0)
+		)
+	{
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: sample needs --period and the values to send!\n\n");
 		mode 	= SPI_TOOL_MODE_NONE;
 	}
 
@@ -257,10 +928,19 @@ int main(int argc, char** argv)
 	// set verbosity
 	onionSetVerbosity(verbose);
 
+	// bit-bang in userspace instead of using the spidev driver
+	if (options.gpioChip != NULL) {
+		if (spiGpioInit(&gpioBackend, &chip, options.gpioChip) != EXIT_SUCCESS) {
+			return 1;
+		}
+		params.backend 	= &gpioBackend;
+	}
+
 
 	//* program *//
 	if (mode & SPI_TOOL_MODE_SETUP_DEVICE) {
-		status 		= spiRegisterDevice(&params);
+		// the GPIO backend needs no kernel device
+		status 		= (options.gpioChip != NULL ? EXIT_SUCCESS : spiRegisterDevice(&params));
 		if (status == EXIT_SUCCESS) {
 			status		= spiSetupDevice(&params);
 		}
@@ -269,45 +949,70 @@ int main(int argc, char** argv)
 		}
 	}
 	else if (mode & SPI_TOOL_MODE_READ) {
-		// make a transfer
-		size 		= 1;
-		txBuffer	= (uint8_t*)malloc(sizeof(uint8_t) * size);
-		rxBuffer	= (uint8_t*)malloc(sizeof(uint8_t) * size);
-
-		*txBuffer 	= (uint8_t)addr;
-
-		status 	= spiTransfer(&params, txBuffer, rxBuffer, size);
-		onionPrint(ONION_SEVERITY_INFO, 	"> SPI Read from addr 0x%02x: 0x%02x\n", *txBuffer, *rxBuffer);
-		onionPrint(ONION_SEVERITY_DEBUG, 	"    spiTransfer status is: %d\n", status);
+		// send the address, then read all the bytes in the same transfer
+		status 	= spiRead(&params, addr, buffer, size);
+		onionPrint(ONION_SEVERITY_DEBUG, 	"    spiRead status is: %d\n", status);
 
-		// clean-up
-		free(txBuffer);
-		free(rxBuffer);
+		printResult(options.format, SPI_TOOL_MODE_READ, addr, buffer, size, status);
 	}
 	else if (mode & SPI_TOOL_MODE_WRITE) {
-		// make a transfer
-		size 		= 2;
-		txBuffer	= (uint8_t*)malloc(sizeof(uint8_t) * size);
-		rxBuffer 	= (uint8_t*)malloc(sizeof(uint8_t) * size);
+		// make a transfer: the address on a single line, then the data on --tx-nbits lines
+		if (options.format == SPI_TOOL_FORMAT_HEX) {
+			onionPrint(ONION_SEVERITY_INFO, 	"> SPI Write to addr 0x%02x: %d byte(s)\n", addr, size);
+		}
+		status 	= spiWrite(&params, addr, buffer, size);
+		onionPrint(ONION_SEVERITY_DEBUG, 	"    spiWrite status is: %d\n", status);
 
-		txBuffer[0] = (uint8_t)addr;
-		txBuffer[1] = (uint8_t)value;
+		if (options.format == SPI_TOOL_FORMAT_JSON) {
+			printResult(options.format, SPI_TOOL_MODE_WRITE, addr, buffer, size, status);
+		}
+	}
+	else if (mode & SPI_TOOL_MODE_BATCH) {
+		input 	= stdin;
+		if (options.batchPath != NULL) {
+			input 	= fopen(options.batchPath, "r");
+		}
 
-		onionPrint(ONION_SEVERITY_INFO, 	"> SPI Write to addr 0x%02x: 0x%02x\n", txBuffer[0], txBuffer[1] );
-		status 	= spiTransfer(&params, txBuffer, rxBuffer, size);
-		onionPrint(ONION_SEVERITY_DEBUG, 	"    spiTransfer status is: %d\n", status);
+		if (input == NULL) {
+			onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not open '%s'\n", options.batchPath);
+			status 	= EXIT_FAILURE;
+		}
+		else {
+			status 	= runBatch(&params, input, isatty(fileno(input)), options.format);
+			onionPrint(ONION_SEVERITY_DEBUG, 	"    batch status is: %d\n", status);
 
-		// clean-up
-		free(txBuffer);
-		free(rxBuffer);
+			if (input != stdin) {
+				fclose(input);
+			}
+		}
+	}
+	else if (mode & SPI_TOOL_MODE_SAMPLE) {
+		status 	= runSample(&params, &options, buffer, size);
+		onionPrint(ONION_SEVERITY_DEBUG, 	"    sample status is: %d\n", status);
+	}
+	else if (mode & SPI_TOOL_MODE_STREAM) {
+		status 	= runStream(&params, &options);
+		onionPrint(ONION_SEVERITY_DEBUG, 	"    stream status is: %d\n", status);
 	}
 	else {
 		onionPrint(ONION_SEVERITY_FATAL, 	"ERROR: Invalid command!\n");
+		status 	= EXIT_FAILURE;
 	}
 	
 
 	//* clean-up *//
-	
-	
-	return 0;
+	if (options.bStats) {
+		printStats();
+	}
+	if (options.tracePath != NULL && spiTraceDump(options.tracePath) != EXIT_SUCCESS) {
+		onionPrint(ONION_SEVERITY_FATAL, "> ERROR: could not write trace to '%s'\n", options.tracePath);
+		status 	= EXIT_FAILURE;
+	}
+	if (options.gpioChip != NULL) {
+		spiReleaseFdCache();
+		spiGpioRelease(&chip);
+	}
+
+	// scripts driving the tool see the failures
+	return (status == EXIT_SUCCESS ? 0 : 1);
 }
\ No newline at end of file
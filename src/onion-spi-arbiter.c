@@ -0,0 +1,263 @@
+#include <onion-spi-arbiter.h>
+#include <onion-spi-trace.h>
+
+// helper function prototypes
+struct spiArbiterEntry;
+struct spiArbiterEntry* 	_spiArbiterFind	(struct spiParams *params, int bCreate);
+
+int 	_spiArbiterClass		(struct spiParams *params);
+int 	_spiArbiterHigherWaiting	(struct spiArbiterEntry *entry, int class);
+
+
+// state of one bus, updated under its own lock
+struct spiArbiterEntry {
+	const struct spiBackend 	*backend;		// with stats.busNum, the bus
+
+	pthread_mutex_t 	lock;
+	pthread_cond_t 		cond;
+
+	int 		bBusy;
+	int 		holderClass;
+	pthread_t 	holder;
+	int 		depth;			// nested acquires of the holder, 0 while it keeps the bus with the device selected
+	uint64_t 	grantNs;
+
+	// tickets keep each class in arrival order
+	int 		waiting[SPI_PRIORITY_CLASSES];
+	uint64_t 	nextTicket[SPI_PRIORITY_CLASSES];
+	uint64_t 	serving[SPI_PRIORITY_CLASSES];
+
+	struct spiArbiterStats 	stats;
+};
+
+// rank of each class, lower goes first
+static const int 	_spiArbiterRank[SPI_PRIORITY_CLASSES] 	= {
+	1,		// SPI_PRIORITY_NORMAL
+	0,		// SPI_PRIORITY_REALTIME
+	2,		// SPI_PRIORITY_BULK
+};
+
+// entries are only ever added, so lookups need no lock
+static struct spiArbiterEntry 	_spiArbiterTable[SPI_ARBITER_BUSES];
+static int 						_spiArbiterCount 		= 0;
+static pthread_mutex_t 			_spiArbiterTableLock 	= PTHREAD_MUTEX_INITIALIZER;
+
+
+//// arbiter functions
+// wait for the bus
+void spiArbiterAcquire(struct spiParams *params)
+{
+	int 		class;
+	uint64_t 	ticket, startNs;
+	struct spiArbiterEntry 	*entry;
+
+	entry 	= _spiArbiterFind(params, 1);
+	if (entry == NULL) {
+		return;
+	}
+	class 	= _spiArbiterClass(params);
+	startNs = spiTraceGetTimeNs();
+
+	pthread_mutex_lock(&(entry->lock));
+
+	// the holder takes the bus again without a ticket
+	if (entry->bBusy && pthread_equal(entry->holder, pthread_self())) {
+		entry->depth++;
+		pthread_mutex_unlock(&(entry->lock));
+		return;
+	}
+
+	ticket 	= entry->nextTicket[class]++;
+	__atomic_add_fetch(&(entry->waiting[class]), 1, __ATOMIC_RELAXED);
+
+	while (entry->bBusy || entry->serving[class] != ticket || _spiArbiterHigherWaiting(entry, class)) {
+		pthread_cond_wait(&(entry->cond), &(entry->lock));
+	}
+
+	__atomic_sub_fetch(&(entry->waiting[class]), 1, __ATOMIC_RELAXED);
+	entry->serving[class]++;
+	entry->bBusy 		= 1;
+	entry->holderClass 	= class;
+	entry->holder 		= pthread_self();
+	entry->depth 		= 1;
+	entry->grantNs 		= spiTraceGetTimeNs();
+
+	entry->stats.classes[class].grants++;
+	spiStatsRecord(&(entry->stats.classes[class].waitLatency), entry->grantNs - startNs);
+
+	pthread_mutex_unlock(&(entry->lock));
+}
+
+void spiArbiterRelease(struct spiParams *params, int bSelected)
+{
+	struct spiArbiterEntry 	*entry;
+
+	entry 	= _spiArbiterFind(params, 0);
+	if (entry == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+
+	// keep the bus for an outer acquire, or while the device is left selected
+	if (!entry->bBusy || !pthread_equal(entry->holder, pthread_self())) {
+		pthread_mutex_unlock(&(entry->lock));
+		return;
+	}
+	if (entry->depth > 0) {
+		entry->depth--;
+	}
+	if (entry->depth > 0 || bSelected) {
+		pthread_mutex_unlock(&(entry->lock));
+		return;
+	}
+
+	spiStatsRecord(&(entry->stats.classes[entry->holderClass].holdTime), spiTraceGetTimeNs() - entry->grantNs);
+	entry->bBusy 	= 0;
+
+	// the waiters check themselves which one is next
+	pthread_cond_broadcast(&(entry->cond));
+	pthread_mutex_unlock(&(entry->lock));
+}
+
+// checked between the segments of a transaction, so no lock
+int spiArbiterShouldYield(struct spiParams *params)
+{
+	struct spiArbiterEntry 	*entry;
+
+	entry 	= _spiArbiterFind(params, 0);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	return _spiArbiterHigherWaiting(entry, _spiArbiterClass(params));
+}
+
+void spiArbiterYield(struct spiParams *params)
+{
+	struct spiArbiterEntry 	*entry;
+
+	entry 	= _spiArbiterFind(params, 0);
+	if (entry == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+	entry->stats.classes[_spiArbiterClass(params)].yields++;
+	pthread_mutex_unlock(&(entry->lock));
+
+	spiArbiterRelease(params, 0);
+	spiArbiterAcquire(params);
+}
+
+int spiArbiterGetStats(struct spiParams *params, struct spiArbiterStats *stats)
+{
+	struct spiArbiterEntry 	*entry;
+
+	entry 	= _spiArbiterFind(params, 0);
+	if (entry == NULL) {
+		memset(stats, 0, sizeof(struct spiArbiterStats));
+		stats->busNum 	= params->busNum;
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+	memcpy(stats, &(entry->stats), sizeof(struct spiArbiterStats));
+	pthread_mutex_unlock(&(entry->lock));
+
+	return EXIT_SUCCESS;
+}
+
+void spiArbiterResetStats(struct spiParams *params)
+{
+	int 	i, count;
+	struct spiArbiterEntry 	*entry, *match;
+
+	match 	= (params != NULL ? _spiArbiterFind(params, 0) : NULL);
+	if (params != NULL && match == NULL) {
+		return;
+	}
+	count 	= __atomic_load_n(&_spiArbiterCount, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		entry 	= &(_spiArbiterTable[i]);
+		if (match != NULL && entry != match) {
+			continue;
+		}
+
+		// keep the key, lookups read it without the lock
+		pthread_mutex_lock(&(entry->lock));
+		memset(entry->stats.classes, 0, sizeof(entry->stats.classes));
+		pthread_mutex_unlock(&(entry->lock));
+	}
+}
+
+
+//// helper functions ////
+// find the entry of the bus of a device, adding it if bCreate is set and there is room
+//	buses with the same number on different backends are separate
+struct spiArbiterEntry* _spiArbiterFind(struct spiParams *params, int bCreate)
+{
+	int 	i, count;
+	struct spiArbiterEntry 		*entry;
+	const struct spiBackend 	*backend 	= spiGetBackend(params);
+
+	count 	= __atomic_load_n(&_spiArbiterCount, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		if (_spiArbiterTable[i].backend == backend && _spiArbiterTable[i].stats.busNum == params->busNum) {
+			return &(_spiArbiterTable[i]);
+		}
+	}
+
+	if (!bCreate) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&_spiArbiterTableLock);
+
+	// another thread may have added it meanwhile
+	entry 	= NULL;
+	for (i = 0; i < _spiArbiterCount; i++) {
+		if (_spiArbiterTable[i].backend == backend && _spiArbiterTable[i].stats.busNum == params->busNum) {
+			entry 	= &(_spiArbiterTable[i]);
+		}
+	}
+
+	if (entry == NULL && _spiArbiterCount < SPI_ARBITER_BUSES) {
+		entry 	= &(_spiArbiterTable[_spiArbiterCount]);
+		memset(entry, 0, sizeof(struct spiArbiterEntry));
+		pthread_mutex_init(&(entry->lock), NULL);
+		pthread_cond_init(&(entry->cond), NULL);
+		entry->backend 			= backend;
+		entry->stats.busNum 	= params->busNum;
+
+		// publish the entry once it is filled in
+		__atomic_store_n(&_spiArbiterCount, _spiArbiterCount + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&_spiArbiterTableLock);
+
+	return entry;
+}
+
+// class of a device, unknown values are treated as normal
+int _spiArbiterClass(struct spiParams *params)
+{
+	if (params->priority < 0 || params->priority >= SPI_PRIORITY_CLASSES) {
+		return SPI_PRIORITY_NORMAL;
+	}
+	return params->priority;
+}
+
+int _spiArbiterHigherWaiting(struct spiArbiterEntry *entry, int class)
+{
+	int 	i;
+
+	for (i = 0; i < SPI_PRIORITY_CLASSES; i++) {
+		if (_spiArbiterRank[i] < _spiArbiterRank[class] && __atomic_load_n(&(entry->waiting[i]), __ATOMIC_RELAXED) > 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
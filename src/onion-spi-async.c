@@ -0,0 +1,414 @@
+#include <onion-spi-async.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+// helper function prototypes
+int 	_spiAsyncRingInit		(struct spiAsyncRing *ring, int depth);
+void 	_spiAsyncRingRelease	(struct spiAsyncRing *ring);
+int 	_spiAsyncRingPush		(struct spiAsyncRing *ring, struct spiAsyncRequest *request);
+struct spiAsyncRequest* 	_spiAsyncRingPop	(struct spiAsyncRing *ring);
+
+void* 	_spiAsyncWorker			(void *arg);
+void 	_spiAsyncDrain			(struct spiAsyncEngine *engine);
+void 	_spiAsyncComplete		(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int numRequests, int status);
+int 	_spiAsyncSameDevice		(struct spiParams *a, struct spiParams *b);
+
+
+//// async functions
+// initialize the engine and start its worker thread
+int spiAsyncInit(struct spiAsyncEngine *engine, int busNum, int depth)
+{
+	memset(engine, 0, sizeof(struct spiAsyncEngine));
+	engine->busNum 		= busNum;
+	engine->depth 		= (depth > 0 ? depth : SPI_ASYNC_DEFAULT_DEPTH);
+	engine->submitFd 	= -1;
+	engine->completeFd 	= -1;
+
+	// allocate the rings and the batch
+	if (	_spiAsyncRingInit(&(engine->submitRing), engine->depth) != EXIT_SUCCESS ||
+			_spiAsyncRingInit(&(engine->completeRing), engine->depth) != EXIT_SUCCESS
+		)
+	{
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI async rings\n");
+		spiAsyncRelease(engine);
+		return EXIT_FAILURE;
+	}
+
+	engine->batchSegments 	= (struct spiSegment*)malloc(sizeof(struct spiSegment) * SPI_MAX_SEGMENTS);
+	engine->batchRequests 	= (struct spiAsyncRequest**)malloc(sizeof(struct spiAsyncRequest*) * SPI_MAX_SEGMENTS);
+	if (engine->batchSegments == NULL || engine->batchRequests == NULL) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI async batch\n");
+		spiAsyncRelease(engine);
+		return EXIT_FAILURE;
+	}
+
+	// create the event file descriptors
+	engine->submitFd 	= eventfd(0, EFD_CLOEXEC);
+	engine->completeFd 	= eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (engine->submitFd < 0 || engine->completeFd < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not create SPI async eventfd\n");
+		spiAsyncRelease(engine);
+		return EXIT_FAILURE;
+	}
+
+	// start the worker
+	if (pthread_create(&(engine->worker), NULL, _spiAsyncWorker, engine) != 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not start SPI async worker for bus %d\n", busNum);
+		close(engine->submitFd);
+		engine->submitFd 	= -1;
+		spiAsyncRelease(engine);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// stop the worker and free the engine
+//	requests already submitted are still performed
+int spiAsyncRelease(struct spiAsyncEngine *engine)
+{
+	uint64_t 	one = 1;
+
+	// stop the worker
+	if (engine->submitFd >= 0) {
+		__atomic_store_n(&(engine->bStop), 1, __ATOMIC_RELEASE);
+		if (write(engine->submitFd, &one, sizeof(one)) == sizeof(one)) {
+			pthread_join(engine->worker, NULL);
+		}
+		close(engine->submitFd);
+		engine->submitFd 	= -1;
+	}
+
+	if (engine->completeFd >= 0) {
+		close(engine->completeFd);
+		engine->completeFd 	= -1;
+	}
+
+	// clean-up
+	_spiAsyncRingRelease(&(engine->submitRing));
+	_spiAsyncRingRelease(&(engine->completeRing));
+
+	free(engine->batchSegments);
+	free(engine->batchRequests);
+	engine->batchSegments 	= NULL;
+	engine->batchRequests 	= NULL;
+
+	return EXIT_SUCCESS;
+}
+
+// queue a request for the worker
+int spiAsyncSubmit(struct spiAsyncEngine *engine, struct spiAsyncRequest *request)
+{
+	uint64_t 	one = 1;
+
+	if (request->params == NULL || request->params->busNum != engine->busNum) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI async request is not for bus %d\n", engine->busNum);
+		errno 	= EINVAL;
+		return EXIT_FAILURE;
+	}
+
+	// reserve a place in flight, this guarantees room in both rings
+	if (__atomic_add_fetch(&(engine->inFlight), 1, __ATOMIC_ACQ_REL) > engine->depth) {
+		__atomic_sub_fetch(&(engine->inFlight), 1, __ATOMIC_ACQ_REL);
+		errno 	= EAGAIN;
+		return EXIT_FAILURE;
+	}
+
+	request->status 	= EXIT_FAILURE;
+	_spiAsyncRingPush(&(engine->submitRing), request);
+
+	// ring the doorbell, the request is queued either way and completes with the next one
+	if (write(engine->submitFd, &one, sizeof(one)) != sizeof(one)) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "%s could not wake the async worker of bus %d\n", SPI_PRINT_BANNER, engine->busNum);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int spiAsyncGetEventFd(struct spiAsyncEngine *engine)
+{
+	return engine->completeFd;
+}
+
+// collect completed requests without blocking
+int spiAsyncReap(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int maxRequests)
+{
+	int 		count;
+	uint64_t 	value;
+	struct spiAsyncRequest 	*request;
+
+	// clear the event counter, requests left over from a partial reap are collected regardless
+	if (read(engine->completeFd, &value, sizeof(value)) < 0) {
+		value 	= 0;
+	}
+
+	count 	= 0;
+	while (count < maxRequests && (request = _spiAsyncRingPop(&(engine->completeRing))) != NULL) {
+		requests[count++] 	= request;
+		__atomic_sub_fetch(&(engine->inFlight), 1, __ATOMIC_ACQ_REL);
+	}
+
+	// keep the event file descriptor readable if completions are left over
+	if (count == maxRequests) {
+		value 	= 1;
+		if (write(engine->completeFd, &value, sizeof(value)) < 0) {
+			return count;
+		}
+	}
+
+	return count;
+}
+
+// block until completed requests are available
+int spiAsyncWait(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int maxRequests, int timeoutMs)
+{
+	int 			ret;
+	struct pollfd 	pfd;
+
+	pfd.fd 		= engine->completeFd;
+	pfd.events 	= POLLIN;
+
+	do {
+		ret 	= poll(&pfd, 1, timeoutMs);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		return 0;
+	}
+
+	return spiAsyncReap(engine, requests, maxRequests);
+}
+
+
+//// helper functions ////
+// allocate a ring with room for at least 'depth' requests
+int _spiAsyncRingInit(struct spiAsyncRing *ring, int depth)
+{
+	uint32_t 	size, i;
+
+	// the ring size is a power of two
+	size 	= 1;
+	while (size < (uint32_t)depth) {
+		size 	<<= 1;
+	}
+
+	ring->slots 	= (struct spiAsyncSlot*)malloc(sizeof(struct spiAsyncSlot) * size);
+	if (ring->slots == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < size; i++) {
+		ring->slots[i].seq 		= i;
+		ring->slots[i].request 	= NULL;
+	}
+	ring->mask 	= size - 1;
+	ring->head 	= 0;
+	ring->tail 	= 0;
+
+	return EXIT_SUCCESS;
+}
+
+void _spiAsyncRingRelease(struct spiAsyncRing *ring)
+{
+	free(ring->slots);
+	ring->slots 	= NULL;
+}
+
+// add a request to the ring, safe with multiple producers and consumers
+//	each slot carries a sequence number telling whose turn it is to use it
+int _spiAsyncRingPush(struct spiAsyncRing *ring, struct spiAsyncRequest *request)
+{
+	uint32_t 	pos, seq;
+	int32_t 	diff;
+	struct spiAsyncSlot 	*slot;
+
+	pos 	= __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+	while (1) {
+		slot 	= &(ring->slots[pos & ring->mask]);
+		seq 	= __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		diff 	= (int32_t)(seq - pos);
+
+		if (diff == 0) {
+			// slot is free, claim it
+			if (__atomic_compare_exchange_n(&(ring->tail), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			// ring is full
+			return EXIT_FAILURE;
+		}
+		else {
+			pos 	= __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->request 	= request;
+	__atomic_store_n(&(slot->seq), pos + 1, __ATOMIC_RELEASE);
+
+	return EXIT_SUCCESS;
+}
+
+// take the oldest request from the ring, NULL if empty
+struct spiAsyncRequest* _spiAsyncRingPop(struct spiAsyncRing *ring)
+{
+	uint32_t 	pos, seq;
+	int32_t 	diff;
+	struct spiAsyncSlot 	*slot;
+	struct spiAsyncRequest 	*request;
+
+	pos 	= __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+	while (1) {
+		slot 	= &(ring->slots[pos & ring->mask]);
+		seq 	= __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+		diff 	= (int32_t)(seq - (pos + 1));
+
+		if (diff == 0) {
+			// slot is filled, claim it
+			if (__atomic_compare_exchange_n(&(ring->head), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		}
+		else if (diff < 0) {
+			// ring is empty
+			return NULL;
+		}
+		else {
+			pos 	= __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+		}
+	}
+
+	request 	= slot->request;
+	__atomic_store_n(&(slot->seq), pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+	return request;
+}
+
+// worker thread: wait for the doorbell, then drain the submission ring
+void* _spiAsyncWorker(void *arg)
+{
+	struct spiAsyncEngine 	*engine = (struct spiAsyncEngine*)arg;
+	uint64_t 				value;
+
+	while (1) {
+		if (read(engine->submitFd, &value, sizeof(value)) < 0 && errno != EINTR) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI async worker for bus %d lost its eventfd\n", engine->busNum);
+			break;
+		}
+
+		_spiAsyncDrain(engine);
+
+		if (__atomic_load_n(&(engine->bStop), __ATOMIC_ACQUIRE)) {
+			// pick up anything queued just before the stop
+			_spiAsyncDrain(engine);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+// perform all queued requests
+//	consecutive requests for the same device are coalesced into one transaction,
+//	with the device deselected between requests
+void _spiAsyncDrain(struct spiAsyncEngine *engine)
+{
+	int 		numRequests, numSegments, i, status, lastCsChange;
+	struct spiAsyncRequest 	*request;
+	struct spiAsyncRequest 	*first;
+	struct spiSegment 		*segment;
+
+	numRequests 	= 0;
+	numSegments 	= 0;
+	lastCsChange 	= 0;
+	first 			= NULL;
+
+	while (1) {
+		request 	= _spiAsyncRingPop(&(engine->submitRing));
+
+		// send the batch when the next request cannot join it
+		if (	numRequests > 0 &&
+				(	request == NULL ||
+					!_spiAsyncSameDevice(first->params, request->params) ||
+					// a speed of 0, the driver default, cannot be told apart from the first request's speed
+					(request->params->speedInHz <= 0 && first->params->speedInHz > 0) ||
+					numSegments + request->numSegments > SPI_MAX_SEGMENTS
+				)
+			)
+		{
+			// the last segment of the batch keeps its own cs_change
+			engine->batchSegments[numSegments-1].csChange 	= lastCsChange;
+
+			status 	= spiTransferSegments(first->params, engine->batchSegments, numSegments);
+			_spiAsyncComplete(engine, engine->batchRequests, numRequests, status);
+
+			numRequests 	= 0;
+			numSegments 	= 0;
+		}
+
+		if (request == NULL) {
+			break;
+		}
+
+		if (request->numSegments < 1 || request->numSegments > SPI_MAX_SEGMENTS) {
+			_spiAsyncComplete(engine, &request, 1, EXIT_FAILURE);
+			continue;
+		}
+
+		// add the request to the batch
+		//	segment values inherited from the params are resolved now, since the batch is sent with the params of its first request,
+		//	to values that do not fall back to those params
+		if (numRequests == 0) {
+			first 	= request;
+		}
+
+		for (i = 0; i < request->numSegments; i++) {
+			segment 	= &(engine->batchSegments[numSegments++]);
+			*segment 	= request->segments[i];
+
+			if (segment->speedInHz <= 0) 	segment->speedInHz 		= request->params->speedInHz;
+			if (segment->delayInUs == 0) 	segment->delayInUs 		= request->params->delayInUs;
+			if (segment->bitsPerWord <= 0) 	segment->bitsPerWord 	= request->params->bitsPerWord;
+			if (segment->txNbits <= 0) 		segment->txNbits 		= request->params->txNbits;
+			if (segment->rxNbits <= 0) 		segment->rxNbits 		= request->params->rxNbits;
+
+			if (segment->delayInUs == 0) 	segment->delayInUs 		= SPI_SEGMENT_NO_DELAY;
+			if (segment->bitsPerWord <= 0) 	segment->bitsPerWord 	= 8;
+			if (segment->txNbits <= 0) 		segment->txNbits 		= 1;
+			if (segment->rxNbits <= 0) 		segment->rxNbits 		= 1;
+		}
+
+		// deselect the device before the next request in the batch
+		lastCsChange 	= request->segments[request->numSegments-1].csChange;
+		engine->batchSegments[numSegments-1].csChange 	= 1;
+
+		engine->batchRequests[numRequests++] 	= request;
+	}
+}
+
+// post requests to the completion ring and signal the event file descriptor
+//	all requests of a failed batch are marked as failed
+void _spiAsyncComplete(struct spiAsyncEngine *engine, struct spiAsyncRequest **requests, int numRequests, int status)
+{
+	int 		i;
+	uint64_t 	count;
+
+	for (i = 0; i < numRequests; i++) {
+		requests[i]->status 	= status;
+		_spiAsyncRingPush(&(engine->completeRing), requests[i]);
+	}
+
+	count 	= numRequests;
+	if (write(engine->completeFd, &count, sizeof(count)) < 0) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "%s could not signal %d completions\n", SPI_PRINT_BANNER, numRequests);
+	}
+}
+
+// check if two params address the same device
+int _spiAsyncSameDevice(struct spiParams *a, struct spiParams *b)
+{
+	return (a == b || (	spiGetBackend(a) == spiGetBackend(b) &&
+						a->busNum == b->busNum && a->deviceId == b->deviceId && a->mode == b->mode && a->modeBits == b->modeBits
+					) );
+}
@@ -0,0 +1,490 @@
+#include <onion-spi-gpio.h>
+#include <onion-spi-trace.h>
+
+// line positions in the bus request, MISO follows when present
+#define SPI_GPIO_LINE_SCK		0
+#define SPI_GPIO_LINE_MOSI		1
+
+// helper function prototypes
+int 	_spiGpioOpen			(const struct spiBackend *backend, struct spiParams *params, int *handle);
+int 	_spiGpioConfigure		(const struct spiBackend *backend, struct spiParams *params, int handle);
+int 	_spiGpioTransfer		(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers);
+int 	_spiGpioClose			(const struct spiBackend *backend, struct spiParams *params, int handle);
+
+int 	_spiGpioRequest			(struct spiGpioChip *chip, int *offsets, int numLines, uint64_t values, int inputBit);
+int 	_spiGpioOpenBus			(struct spiGpioChip *chip, struct spiParams *params);
+void 	_spiGpioCloseBus		(struct spiGpioChip *chip, int bus);
+
+int 	_spiGpioClock			(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers);
+int 	_spiGpioAbort			(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params);
+int 	_spiGpioSet				(struct spiGpioChip *chip, struct spiGpioLines *lines, uint64_t bits);
+int 	_spiGpioGet				(struct spiGpioChip *chip, struct spiGpioLines *lines, int *value);
+int 	_spiGpioSelect			(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params, int bSelected);
+uint64_t 	_spiGpioIdle		(struct spiParams *params);
+void 	_spiGpioWait			(uint64_t *edgeNs, uint64_t intervalNs);
+
+
+//// gpio functions
+int spiGpioInit(struct spiBackend *backend, struct spiGpioChip *chip, const char *path)
+{
+	int 	i;
+
+	memset(chip, 0, sizeof(struct spiGpioChip));
+
+	if (path == NULL) {
+		path 	= SPI_GPIO_DEFAULT_CHIP;
+	}
+	if (strlen(path) >= sizeof(chip->path)) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: GPIO chip path '%s' is too long\n", path);
+		return EXIT_FAILURE;
+	}
+	strcpy(chip->path, path);
+
+	for (i = 0; i < SPI_GPIO_MAX_HANDLES; i++) {
+		chip->buses[i].fd 		= -1;
+		chip->lines[i].bus 		= -1;
+		chip->lines[i].csFd 	= -1;
+	}
+	pthread_mutex_init(&(chip->lock), NULL);
+
+	memset(backend, 0, sizeof(struct spiBackend));
+	backend->name 		= SPI_GPIO_BACKEND_NAME;
+	backend->open 		= _spiGpioOpen;
+	backend->configure 	= _spiGpioConfigure;
+	backend->transfer 	= _spiGpioTransfer;
+	backend->close 		= _spiGpioClose;
+	backend->context 	= chip;
+
+	return EXIT_SUCCESS;
+}
+
+void spiGpioRelease(struct spiGpioChip *chip)
+{
+	int 	i;
+
+	for (i = 0; i < SPI_GPIO_MAX_HANDLES; i++) {
+		if (chip->lines[i].csFd >= 0) {
+			close(chip->lines[i].csFd);
+			chip->lines[i].csFd 	= -1;
+		}
+		chip->lines[i].bus 	= -1;
+
+		if (chip->buses[i].fd >= 0) {
+			close(chip->buses[i].fd);
+			chip->buses[i].fd 	= -1;
+		}
+	}
+
+	pthread_mutex_destroy(&(chip->lock));
+}
+
+
+//// backend functions ////
+// request the SPI lines of a device, outputs start idle with the device deselected
+//	SCK, MOSI and MISO are requested once and shared with the other devices on them, CS belongs to the device
+int _spiGpioOpen(const struct spiBackend *backend, struct spiParams *params, int *handle)
+{
+	int 	slot, bus;
+	struct spiGpioLines 	*lines;
+	struct spiGpioChip 		*chip 	= (struct spiGpioChip*)backend->context;
+
+	if (params->sckGpio < 0 || params->mosiGpio < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SCK and MOSI lines are required to bit-bang SPI\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(chip->lock));
+
+	// find a free slot
+	for (slot = 0; slot < SPI_GPIO_MAX_HANDLES && chip->lines[slot].bus >= 0; slot++);
+	if (slot == SPI_GPIO_MAX_HANDLES) {
+		pthread_mutex_unlock(&(chip->lock));
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: too many devices open on %s\n", chip->path);
+		return EXIT_FAILURE;
+	}
+	lines 	= &(chip->lines[slot]);
+
+	bus 	= _spiGpioOpenBus(chip, params);
+	if (bus < 0) {
+		pthread_mutex_unlock(&(chip->lock));
+		return EXIT_FAILURE;
+	}
+
+	// CS is active low unless SPI_CS_HIGH is set
+	lines->csFd 		= -1;
+	lines->bSelected 	= 0;
+	if (params->csGpio >= 0 && !(params->modeBits & SPI_NO_CS)) {
+		lines->csFd 	= _spiGpioRequest(chip, &(params->csGpio), 1, ((params->modeBits & SPI_CS_HIGH) ? 0 : 1), -1);
+		if (lines->csFd < 0) {
+			_spiGpioCloseBus(chip, bus);
+			pthread_mutex_unlock(&(chip->lock));
+			SPI_LOG(ONION_SEVERITY_DEBUG, "ERROR: could not request CS line %d on %s\n", params->csGpio, chip->path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	lines->bus 	= bus;
+	*handle 	= slot;
+
+	pthread_mutex_unlock(&(chip->lock));
+
+	return EXIT_SUCCESS;
+}
+
+// bring the clock to the idle level of the current mode
+int _spiGpioConfigure(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	struct spiGpioChip 		*chip 	= (struct spiGpioChip*)backend->context;
+	struct spiGpioLines 	*lines 	= &(chip->lines[handle]);
+	int 					status;
+
+	pthread_mutex_lock(&(chip->lock));
+	status 	= _spiGpioSet(chip, lines, _spiGpioIdle(params));
+	pthread_mutex_unlock(&(chip->lock));
+
+	if (status < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not set SPI lines on %s\n", chip->path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// clock one message out, returns like the spidev ioctl
+//	each edge updates SCK and MOSI together with one SET_VALUES call, CS is set on its own request,
+//	MISO is read with one GET_VALUES call per bit, and only when data is received
+int _spiGpioTransfer(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 		i, status;
+	struct spiGpioChip 		*chip 	= (struct spiGpioChip*)backend->context;
+	struct spiGpioLines 	*lines 	= &(chip->lines[handle]);
+
+	// only single line, 8 bit transfers can be bit-banged
+	for (i = 0; i < numXfers; i++) {
+		if (	xfer[i].tx_nbits > 1 || xfer[i].rx_nbits > 1 ||
+				(xfer[i].bits_per_word != 0 && xfer[i].bits_per_word != 8) ||
+				(params->modeBits & SPI_3WIRE)
+			)
+		{
+			errno 	= EINVAL;
+			return -1;
+		}
+	}
+
+	// devices can share the clock and data lines, one message is clocked at a time
+	pthread_mutex_lock(&(chip->lock));
+	status 	= _spiGpioClock(chip, lines, params, xfer, numXfers);
+	pthread_mutex_unlock(&(chip->lock));
+
+	return status;
+}
+
+int _spiGpioClose(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	struct spiGpioChip 	*chip 	= (struct spiGpioChip*)backend->context;
+
+	struct spiGpioLines *lines 	= &(chip->lines[handle]);
+
+	pthread_mutex_lock(&(chip->lock));
+	if (lines->csFd >= 0) {
+		close(lines->csFd);
+		lines->csFd 	= -1;
+	}
+	_spiGpioCloseBus(chip, lines->bus);
+	lines->bus 	= -1;
+	pthread_mutex_unlock(&(chip->lock));
+
+	return EXIT_SUCCESS;
+}
+
+
+//// helper functions ////
+// request lines of the chip as outputs set to values, except inputBit when it is not -1
+//	returns the request fd, the request keeps the lines after the chip is closed
+int _spiGpioRequest(struct spiGpioChip *chip, int *offsets, int numLines, uint64_t values, int inputBit)
+{
+	int 	i, chipFd, numAttrs;
+	struct gpio_v2_line_request 	request;
+
+	memset(&request, 0, sizeof(request));
+	strncpy(request.consumer, SPI_GPIO_CONSUMER, sizeof(request.consumer) - 1);
+
+	for (i = 0; i < numLines; i++) {
+		request.offsets[i] 	= offsets[i];
+	}
+	request.num_lines 	= numLines;
+
+	numAttrs 	= 0;
+	request.config.flags 	= GPIO_V2_LINE_FLAG_OUTPUT;
+
+	request.config.attrs[numAttrs].attr.id 		= GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	request.config.attrs[numAttrs].attr.values 	= values;
+	request.config.attrs[numAttrs].mask 		= ((1ULL << numLines) - 1) & ~(inputBit >= 0 ? (1ULL << inputBit) : 0);
+	numAttrs++;
+
+	if (inputBit >= 0) {
+		request.config.attrs[numAttrs].attr.id 		= GPIO_V2_LINE_ATTR_ID_FLAGS;
+		request.config.attrs[numAttrs].attr.flags 	= GPIO_V2_LINE_FLAG_INPUT;
+		request.config.attrs[numAttrs].mask 		= (1ULL << inputBit);
+		numAttrs++;
+	}
+	request.config.num_attrs 	= numAttrs;
+
+	chipFd 	= open(chip->path, O_RDWR | O_CLOEXEC);
+	if (chipFd < 0) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "ERROR: could not open %s\n", chip->path);
+		return -1;
+	}
+
+	if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+		close(chipFd);
+		return -1;
+	}
+	close(chipFd);
+
+	return request.fd;
+}
+
+// find the bus on the SCK, MOSI and MISO lines of a device, or request them, called with the chip lock held
+//	returns the bus index with a reference taken, -1 on failure
+int _spiGpioOpenBus(struct spiGpioChip *chip, struct spiParams *params)
+{
+	int 	i, free, numLines;
+	int 	offsets[3];
+	struct spiGpioBus 	*bus;
+
+	free 	= -1;
+	for (i = 0; i < SPI_GPIO_MAX_HANDLES; i++) {
+		bus 	= &(chip->buses[i]);
+		if (bus->fd < 0) {
+			if (free < 0) 	free 	= i;
+			continue;
+		}
+
+		if (bus->sckGpio == params->sckGpio && bus->mosiGpio == params->mosiGpio && bus->misoGpio == params->misoGpio) {
+			bus->refs++;
+			return i;
+		}
+		if (	bus->sckGpio == params->sckGpio || bus->mosiGpio == params->mosiGpio ||
+				(params->misoGpio >= 0 && bus->misoGpio == params->misoGpio)
+			)
+		{
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: devices sharing lines on %s must use the same SCK, MOSI and MISO lines\n", chip->path);
+			return -1;
+		}
+	}
+	// a free bus slot is always left, there are as many as device slots
+	bus 	= &(chip->buses[free]);
+
+	offsets[SPI_GPIO_LINE_SCK] 		= params->sckGpio;
+	offsets[SPI_GPIO_LINE_MOSI] 	= params->mosiGpio;
+	numLines 		= 2;
+
+	bus->misoBit 	= -1;
+	if (params->misoGpio >= 0) {
+		bus->misoBit 	= numLines;
+		offsets[numLines++] 	= params->misoGpio;
+	}
+
+	bus->fd 	= _spiGpioRequest(chip, offsets, numLines, _spiGpioIdle(params), bus->misoBit);
+	if (bus->fd < 0) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "ERROR: could not request lines %d, %d, %d on %s\n", params->sckGpio, params->mosiGpio, params->misoGpio, chip->path);
+		return -1;
+	}
+
+	bus->refs 		= 1;
+	bus->sckGpio 	= params->sckGpio;
+	bus->mosiGpio 	= params->mosiGpio;
+	bus->misoGpio 	= params->misoGpio;
+
+	return free;
+}
+
+// drop a reference to a bus, its lines are released with the last one, called with the chip lock held
+void _spiGpioCloseBus(struct spiGpioChip *chip, int bus)
+{
+	if (--chip->buses[bus].refs > 0) {
+		return;
+	}
+
+	close(chip->buses[bus].fd);
+	chip->buses[bus].fd 	= -1;
+}
+
+// clock the transfers of a message out, called with the chip lock held
+int _spiGpioClock(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 		i, j, bit, miso, speed, total;
+	int 		bCpha, bLsbFirst, bRead;
+	uint8_t 	tx, rx;
+	uint8_t 	*txBuffer, *rxBuffer;
+	uint64_t 	sck, mosi, idle, data;
+	uint64_t 	edgeNs, halfNs;
+
+	bCpha 		= (params->modeBits & SPI_CPHA) != 0;
+	bLsbFirst 	= (params->modeBits & SPI_LSB_FIRST) != 0;
+
+	sck 		= (1ULL << SPI_GPIO_LINE_SCK);
+	mosi 		= (1ULL << SPI_GPIO_LINE_MOSI);
+	idle 		= _spiGpioIdle(params);
+
+	edgeNs 	= spiTraceGetTimeNs();
+	total 	= 0;
+	for (i = 0; i < numXfers; i++) {
+		txBuffer 	= (uint8_t*)(uintptr_t)xfer[i].tx_buf;
+		rxBuffer 	= (uint8_t*)(uintptr_t)xfer[i].rx_buf;
+		bRead 		= (rxBuffer != NULL && chip->buses[lines->bus].misoBit >= 0);
+
+		speed 		= (xfer[i].speed_hz > 0 ? xfer[i].speed_hz : params->speedInHz);
+		halfNs 		= (speed > 0 ? 500000000ULL / speed : 0);
+		data 		= 0;
+
+		// the clock is brought to the idle level of this device before it is selected,
+		//	with CPHA the first edge already shifts data, so CS is asserted half a clock before it
+		if (!lines->bSelected && xfer[i].len > 0) {
+			if (_spiGpioSet(chip, lines, idle) < 0) 				return _spiGpioAbort(chip, lines, params);
+			if (_spiGpioSelect(chip, lines, params, 1) < 0) 		return _spiGpioAbort(chip, lines, params);
+			if (bCpha) {
+				_spiGpioWait(&edgeNs, halfNs);
+			}
+		}
+
+		for (j = 0; j < (int)xfer[i].len; j++) {
+			tx 	= (txBuffer != NULL ? txBuffer[j] : 0);
+			rx 	= 0;
+
+			for (bit = 0; bit < 8; bit++) {
+				data 	= ((tx >> (bLsbFirst ? bit : 7 - bit)) & 1 ? mosi : 0);
+
+				if (!bCpha) {
+					// data changes on the trailing edge, while the clock is idle
+					if (_spiGpioSet(chip, lines, idle | data) < 0) 			return _spiGpioAbort(chip, lines, params);
+					_spiGpioWait(&edgeNs, halfNs);
+					if (_spiGpioSet(chip, lines, (idle ^ sck) | data) < 0) 	return _spiGpioAbort(chip, lines, params);
+				}
+				else {
+					// data changes on the leading edge, sampled on the trailing edge
+					if (_spiGpioSet(chip, lines, (idle ^ sck) | data) < 0) 	return _spiGpioAbort(chip, lines, params);
+					_spiGpioWait(&edgeNs, halfNs);
+					if (_spiGpioSet(chip, lines, idle | data) < 0) 			return _spiGpioAbort(chip, lines, params);
+				}
+
+				if (bRead) {
+					if (_spiGpioGet(chip, lines, &miso) < 0) 	return _spiGpioAbort(chip, lines, params);
+					rx 	|= (miso << (bLsbFirst ? bit : 7 - bit));
+				}
+				_spiGpioWait(&edgeNs, halfNs);
+			}
+
+			if (rxBuffer != NULL) {
+				rxBuffer[j] 	= rx;
+			}
+		}
+
+		// return the clock to idle after the last trailing edge,
+		//	unless the next transfer follows straight away and does it with its first bit
+		if (!bCpha && xfer[i].len > 0 && (i == numXfers - 1 || xfer[i].cs_change || xfer[i].delay_usecs > 0)) {
+			if (_spiGpioSet(chip, lines, idle | data) < 0) 	return _spiGpioAbort(chip, lines, params);
+			_spiGpioWait(&edgeNs, halfNs);
+		}
+		total 	+= xfer[i].len;
+
+		_spiGpioWait(&edgeNs, (uint64_t)xfer[i].delay_usecs * 1000);
+
+		// deselect between transfers on cs_change, and after the message unless the last transfer has cs_change
+		if (!(i == numXfers - 1 ? xfer[i].cs_change : !xfer[i].cs_change) && lines->bSelected) {
+			if (_spiGpioSet(chip, lines, idle) < 0) 				return _spiGpioAbort(chip, lines, params);
+			if (_spiGpioSelect(chip, lines, params, 0) < 0) 		return _spiGpioAbort(chip, lines, params);
+			_spiGpioWait(&edgeNs, halfNs);
+		}
+	}
+
+	return total;
+}
+
+// end a message that failed part way, the device is deselected so a later message starts clean
+int _spiGpioAbort(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params)
+{
+	int 	err 	= errno;
+
+	_spiGpioSelect(chip, lines, params, 0);
+	lines->bSelected 	= 0;
+
+	errno 	= err;
+	return -1;
+}
+
+// drive the clock and data lines at once
+int _spiGpioSet(struct spiGpioChip *chip, struct spiGpioLines *lines, uint64_t bits)
+{
+	struct gpio_v2_line_values 	values;
+
+	values.bits 	= bits;
+	values.mask 	= (1ULL << SPI_GPIO_LINE_SCK) | (1ULL << SPI_GPIO_LINE_MOSI);
+
+	__atomic_add_fetch(&(chip->setCalls), 1, __ATOMIC_RELAXED);
+
+	return ioctl(chip->buses[lines->bus].fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+}
+
+// read the MISO line
+int _spiGpioGet(struct spiGpioChip *chip, struct spiGpioLines *lines, int *value)
+{
+	struct gpio_v2_line_values 	values;
+	struct spiGpioBus 			*bus 	= &(chip->buses[lines->bus]);
+
+	values.bits 	= 0;
+	values.mask 	= (1ULL << bus->misoBit);
+
+	__atomic_add_fetch(&(chip->getCalls), 1, __ATOMIC_RELAXED);
+
+	if (ioctl(bus->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0) {
+		return -1;
+	}
+	*value 	= (values.bits >> bus->misoBit) & 1;
+
+	return 0;
+}
+
+// assert or release CS, only the state is kept for a device without a CS line
+int _spiGpioSelect(struct spiGpioChip *chip, struct spiGpioLines *lines, struct spiParams *params, int bSelected)
+{
+	struct gpio_v2_line_values 	values;
+
+	if (lines->csFd >= 0) {
+		// CS is active low unless SPI_CS_HIGH is set
+		values.bits 	= (bSelected == ((params->modeBits & SPI_CS_HIGH) != 0) ? 1 : 0);
+		values.mask 	= 1;
+
+		__atomic_add_fetch(&(chip->setCalls), 1, __ATOMIC_RELAXED);
+
+		if (ioctl(lines->csFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+			return -1;
+		}
+	}
+	lines->bSelected 	= bSelected;
+
+	return 0;
+}
+
+// clock and data values with the clock idle and MOSI low
+uint64_t _spiGpioIdle(struct spiParams *params)
+{
+	return ((params->modeBits & SPI_CPOL) ? (1ULL << SPI_GPIO_LINE_SCK) : 0);
+}
+
+// wait until intervalNs after the previous edge, the schedule restarts if it has fallen behind
+void _spiGpioWait(uint64_t *edgeNs, uint64_t intervalNs)
+{
+	uint64_t 	now;
+
+	*edgeNs 	+= intervalNs;
+
+	now 	= spiTraceGetTimeNs();
+	if (now >= *edgeNs) {
+		*edgeNs 	= now;
+		return;
+	}
+
+	while (spiTraceGetTimeNs() < *edgeNs);
+}
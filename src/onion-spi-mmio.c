@@ -0,0 +1,357 @@
+#include <onion-spi-mmio.h>
+#include <onion-spi-trace.h>
+
+// register for a bank, as an index into the register block
+#define SPI_MMIO_REG(reg, bank)		(((reg) + (bank) * SPI_MMIO_BANK_STRIDE) / sizeof(uint32_t))
+
+// helper function prototypes
+int 	_spiMmioOpen			(const struct spiBackend *backend, struct spiParams *params, int *handle);
+int 	_spiMmioConfigure		(const struct spiBackend *backend, struct spiParams *params, int handle);
+int 	_spiMmioTransfer		(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers);
+int 	_spiMmioClose			(const struct spiBackend *backend, struct spiParams *params, int handle);
+
+int 	_spiMmioClock			(struct spiMmioChip *chip, struct spiMmioLines *lines, struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers);
+void 	_spiMmioBuildWaveforms	(struct spiMmioLines *lines, uint32_t modeBits);
+void 	_spiMmioSelect			(struct spiMmioChip *chip, struct spiMmioLines *lines, int bSelected);
+void 	_spiMmioWait			(uint64_t *edgeNs, uint64_t intervalNs);
+
+
+//// mmio functions
+int spiMmioInit(struct spiBackend *backend, struct spiMmioChip *chip, volatile void *regs)
+{
+	int 	fd;
+	long 	pageSize;
+	off_t 	pageBase;
+
+	memset(chip, 0, sizeof(struct spiMmioChip));
+
+	if (regs != NULL) {
+		chip->regs 	= (volatile uint32_t*)regs;
+	}
+	else {
+		// map the page holding the GPIO registers
+		pageSize 	= sysconf(_SC_PAGESIZE);
+		pageBase 	= SPI_MMIO_GPIO_BASE & ~(pageSize - 1);
+
+		fd 	= open(SPI_MMIO_MEM_PATH, O_RDWR | O_SYNC | O_CLOEXEC);
+		if (fd < 0) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not open %s\n", SPI_MMIO_MEM_PATH);
+			return EXIT_FAILURE;
+		}
+
+		chip->mapping 	= mmap(NULL, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, pageBase);
+		close(fd);
+		if (chip->mapping == MAP_FAILED) {
+			chip->mapping 	= NULL;
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not map GPIO registers at 0x%08x\n", SPI_MMIO_GPIO_BASE);
+			return EXIT_FAILURE;
+		}
+		chip->mapSize 	= pageSize;
+		chip->regs 		= (volatile uint32_t*)((uint8_t*)chip->mapping + (SPI_MMIO_GPIO_BASE - pageBase));
+	}
+
+	pthread_mutex_init(&(chip->lock), NULL);
+
+	memset(backend, 0, sizeof(struct spiBackend));
+	backend->name 		= SPI_MMIO_BACKEND_NAME;
+	backend->open 		= _spiMmioOpen;
+	backend->configure 	= _spiMmioConfigure;
+	backend->transfer 	= _spiMmioTransfer;
+	backend->close 		= _spiMmioClose;
+	backend->context 	= chip;
+
+	return EXIT_SUCCESS;
+}
+
+void spiMmioRelease(struct spiMmioChip *chip)
+{
+	int 	i;
+
+	for (i = 0; i < SPI_MMIO_MAX_HANDLES; i++) {
+		free(chip->lines[i]);
+		chip->lines[i] 	= NULL;
+	}
+
+	if (chip->mapping != NULL) {
+		munmap(chip->mapping, chip->mapSize);
+		chip->mapping 	= NULL;
+	}
+	chip->regs 	= NULL;
+
+	pthread_mutex_destroy(&(chip->lock));
+}
+
+
+//// backend functions ////
+// claim the pins of a device: outputs idle with the device deselected, MISO an input
+int _spiMmioOpen(const struct spiBackend *backend, struct spiParams *params, int *handle)
+{
+	int 		slot;
+	struct spiMmioLines 	*lines;
+	struct spiMmioChip 		*chip 	= (struct spiMmioChip*)backend->context;
+
+	if (	params->sckGpio < 0 || params->mosiGpio < 0 ||
+			params->sckGpio / 32 != params->mosiGpio / 32 ||
+			(params->csGpio >= 0 && params->csGpio / 32 != params->sckGpio / 32) ||
+			params->sckGpio / 32 >= SPI_MMIO_NUM_BANKS || params->misoGpio / 32 >= SPI_MMIO_NUM_BANKS
+		)
+	{
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SCK, MOSI and CS must be GPIOs in the same bank\n");
+		return EXIT_FAILURE;
+	}
+
+	lines 	= (struct spiMmioLines*)malloc(sizeof(struct spiMmioLines));
+	if (lines == NULL) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI waveforms\n");
+		return EXIT_FAILURE;
+	}
+	memset(lines, 0, sizeof(struct spiMmioLines));
+
+	lines->bank 	= params->sckGpio / 32;
+	lines->sckMask 	= 1U << (params->sckGpio % 32);
+	lines->mosiMask = 1U << (params->mosiGpio % 32);
+	if (params->csGpio >= 0 && !(params->modeBits & SPI_NO_CS)) {
+		lines->csMask 	= 1U << (params->csGpio % 32);
+	}
+	if (params->misoGpio >= 0) {
+		lines->misoBank = params->misoGpio / 32;
+		lines->misoMask = 1U << (params->misoGpio % 32);
+	}
+	_spiMmioBuildWaveforms(lines, params->modeBits);
+
+	pthread_mutex_lock(&(chip->lock));
+
+	for (slot = 0; slot < SPI_MMIO_MAX_HANDLES && chip->lines[slot] != NULL; slot++);
+	if (slot == SPI_MMIO_MAX_HANDLES) {
+		pthread_mutex_unlock(&(chip->lock));
+		free(lines);
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: too many devices open on the GPIO registers\n");
+		return EXIT_FAILURE;
+	}
+	chip->lines[slot] 	= lines;
+
+	// idle levels first, then the directions
+	_spiMmioSelect(chip, lines, 0);
+	chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_CTRL, lines->bank)] 	|= lines->sckMask | lines->mosiMask | lines->csMask;
+	if (lines->misoMask) {
+		chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_CTRL, lines->misoBank)] 	&= ~(lines->misoMask);
+	}
+
+	pthread_mutex_unlock(&(chip->lock));
+
+	*handle 	= slot;
+
+	return EXIT_SUCCESS;
+}
+
+// rebuild the waveforms if the mode changed, and bring the clock to its idle level
+int _spiMmioConfigure(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	struct spiMmioChip 		*chip 	= (struct spiMmioChip*)backend->context;
+	struct spiMmioLines 	*lines 	= chip->lines[handle];
+
+	pthread_mutex_lock(&(chip->lock));
+
+	if (lines->modeBits != (uint32_t)params->modeBits) {
+		_spiMmioBuildWaveforms(lines, params->modeBits);
+	}
+	_spiMmioSelect(chip, lines, lines->bSelected);
+
+	pthread_mutex_unlock(&(chip->lock));
+
+	return EXIT_SUCCESS;
+}
+
+// clock one message out, returns like the spidev ioctl
+int _spiMmioTransfer(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 	i, status;
+	struct spiMmioChip 		*chip 	= (struct spiMmioChip*)backend->context;
+	struct spiMmioLines 	*lines 	= chip->lines[handle];
+
+	// only single line, 8 bit transfers can be bit-banged
+	for (i = 0; i < numXfers; i++) {
+		if (	xfer[i].tx_nbits > 1 || xfer[i].rx_nbits > 1 ||
+				(xfer[i].bits_per_word != 0 && xfer[i].bits_per_word != 8) ||
+				(params->modeBits & SPI_3WIRE)
+			)
+		{
+			errno 	= EINVAL;
+			return -1;
+		}
+	}
+
+	// devices usually share the clock and data lines
+	pthread_mutex_lock(&(chip->lock));
+
+	if (lines->modeBits != (uint32_t)params->modeBits) {
+		_spiMmioBuildWaveforms(lines, params->modeBits);
+	}
+	status 	= _spiMmioClock(chip, lines, params, xfer, numXfers);
+
+	pthread_mutex_unlock(&(chip->lock));
+
+	return status;
+}
+
+// the pins are left as they are, other devices may share them
+int _spiMmioClose(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	struct spiMmioChip 	*chip 	= (struct spiMmioChip*)backend->context;
+
+	pthread_mutex_lock(&(chip->lock));
+	free(chip->lines[handle]);
+	chip->lines[handle] 	= NULL;
+	pthread_mutex_unlock(&(chip->lock));
+
+	return EXIT_SUCCESS;
+}
+
+
+//// helper functions ////
+// clock the transfers of a message out, called with the chip lock held
+int _spiMmioClock(struct spiMmioChip *chip, struct spiMmioLines *lines, struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 		i, j, edge, speed, total, bLsbFirst;
+	uint8_t 	tx, rx;
+	uint8_t 	*txBuffer, *rxBuffer;
+	uint64_t 	edgeNs, halfNs;
+	const struct spiMmioEdge 	*waveform;
+
+	volatile uint32_t 	*dclr 	= &(chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_DCLR, lines->bank)]);
+	volatile uint32_t 	*dset 	= &(chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_DSET, lines->bank)]);
+	volatile uint32_t 	*miso 	= &(chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_DATA, lines->misoBank)]);
+
+	bLsbFirst 	= (lines->modeBits & SPI_LSB_FIRST) != 0;
+
+	edgeNs 	= spiTraceGetTimeNs();
+	total 	= 0;
+	for (i = 0; i < numXfers; i++) {
+		txBuffer 	= (uint8_t*)(uintptr_t)xfer[i].tx_buf;
+		rxBuffer 	= (uint8_t*)(uintptr_t)xfer[i].rx_buf;
+
+		speed 		= (xfer[i].speed_hz > 0 ? xfer[i].speed_hz : params->speedInHz);
+		halfNs 		= (speed > 0 ? 500000000ULL / speed : 0);
+		if (halfNs < SPI_MMIO_MIN_WAIT_NS) {
+			halfNs 	= 0;
+		}
+
+		if (!lines->bSelected && xfer[i].len > 0) {
+			_spiMmioSelect(chip, lines, 1);
+			if (halfNs) 	_spiMmioWait(&edgeNs, halfNs);
+		}
+
+		for (j = 0; j < (int)xfer[i].len; j++) {
+			tx 			= (txBuffer != NULL ? txBuffer[j] : 0);
+			rx 			= 0;
+			waveform 	= lines->waveforms[tx];
+
+			for (edge = 0; edge < SPI_MMIO_EDGES_PER_BYTE; edge++) {
+				if (waveform[edge].clr) 	*dclr 	= waveform[edge].clr;
+				if (waveform[edge].set) 	*dset 	= waveform[edge].set;
+
+				// MISO is sampled after the second edge of each bit
+				if ((edge & 1) && rxBuffer != NULL && (*miso & lines->misoMask)) {
+					rx 	|= (bLsbFirst ? 0x01 << (edge >> 1) : 0x80 >> (edge >> 1));
+				}
+				if (halfNs) 	_spiMmioWait(&edgeNs, halfNs);
+			}
+
+			if (rxBuffer != NULL) {
+				rxBuffer[j] 	= rx;
+			}
+		}
+		total 	+= xfer[i].len;
+
+		// deselect between transfers on cs_change, and after the message unless the last transfer has cs_change
+		//	otherwise the clock is returned to idle before a delay or the end of the message
+		if (i == numXfers - 1 ? !xfer[i].cs_change : xfer[i].cs_change) {
+			if (xfer[i].delay_usecs > 0) 	_spiMmioWait(&edgeNs, (uint64_t)xfer[i].delay_usecs * 1000);
+			_spiMmioSelect(chip, lines, 0);
+			if (halfNs) 	_spiMmioWait(&edgeNs, halfNs);
+		}
+		else if (i == numXfers - 1 || xfer[i].delay_usecs > 0) {
+			_spiMmioSelect(chip, lines, 1);
+			_spiMmioWait(&edgeNs, (uint64_t)xfer[i].delay_usecs * 1000);
+		}
+	}
+
+	return total;
+}
+
+// precompute the edges for every byte value in a mode
+//	the first edge of each bit moves the clock away from its idle level with CPHA, back to it without,
+//	so without CPHA a byte ends with the clock active until the next edge or _spiMmioSelect
+//	MOSI only changes on the first edge, and only when the bit differs from the one before
+void _spiMmioBuildWaveforms(struct spiMmioLines *lines, uint32_t modeBits)
+{
+	int 		value, bit, level, previous, bCpol, bCpha;
+	uint32_t 	firstSck, secondSck;
+	struct spiMmioEdge 	*edge;
+
+	bCpol 	= (modeBits & SPI_CPOL) != 0;
+	bCpha 	= (modeBits & SPI_CPHA) != 0;
+
+	// clock level after the first and the second edge of a bit
+	firstSck 	= (bCpha != bCpol ? lines->sckMask : 0);
+	secondSck 	= (firstSck ? 0 : lines->sckMask);
+
+	for (value = 0; value < 256; value++) {
+		previous 	= -1;
+
+		for (bit = 0; bit < 8; bit++) {
+			level 	= (value >> ((modeBits & SPI_LSB_FIRST) ? bit : 7 - bit)) & 1;
+
+			// first edge: data out, on the same register writes as the clock
+			edge 		= &(lines->waveforms[value][bit * 2]);
+			edge->set 	= firstSck;
+			edge->clr 	= lines->sckMask & ~firstSck;
+			if (level != previous) {
+				if (level) 	edge->set 	|= lines->mosiMask;
+				else 		edge->clr 	|= lines->mosiMask;
+			}
+			previous 	= level;
+
+			// second edge: clock only
+			edge 		= &(lines->waveforms[value][bit * 2 + 1]);
+			edge->set 	= secondSck;
+			edge->clr 	= lines->sckMask & ~secondSck;
+		}
+	}
+
+	lines->modeBits 	= modeBits;
+}
+
+// drive CS, and the clock to its idle level
+void _spiMmioSelect(struct spiMmioChip *chip, struct spiMmioLines *lines, int bSelected)
+{
+	uint32_t 	set, clr;
+
+	set 	= ((lines->modeBits & SPI_CPOL) ? lines->sckMask : 0);
+	clr 	= lines->sckMask & ~set;
+
+	// CS is active low unless SPI_CS_HIGH is set
+	if (bSelected == ((lines->modeBits & SPI_CS_HIGH) != 0)) 	set 	|= lines->csMask;
+	else 														clr 	|= lines->csMask;
+
+	chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_DCLR, lines->bank)] 	= clr;
+	chip->regs[SPI_MMIO_REG(SPI_MMIO_REG_DSET, lines->bank)] 	= set;
+
+	lines->bSelected 	= bSelected;
+}
+
+// wait until intervalNs after the previous edge, the schedule restarts if it has fallen behind
+void _spiMmioWait(uint64_t *edgeNs, uint64_t intervalNs)
+{
+	uint64_t 	now;
+
+	*edgeNs 	+= intervalNs;
+
+	now 	= spiTraceGetTimeNs();
+	if (now >= *edgeNs) {
+		*edgeNs 	= now;
+		return;
+	}
+
+	while (spiTraceGetTimeNs() < *edgeNs);
+}
@@ -0,0 +1,409 @@
+#include <onion-spi-regmap.h>
+
+// register state flags
+#define SPI_REGMAP_STATE_VALID		0x01
+#define SPI_REGMAP_STATE_DIRTY		0x02
+
+// helper function prototypes
+int 	_spiRegmapBusRead		(struct spiRegmap *map, int reg, uint8_t *value);
+int 	_spiRegmapBusWrite		(struct spiRegmap *map, int reg, uint8_t value);
+int 	_spiRegmapRead			(struct spiRegmap *map, int reg, uint8_t *value);
+int 	_spiRegmapWrite			(struct spiRegmap *map, int reg, uint8_t value);
+
+int 	_spiWriteBatchCompare	(const void *a, const void *b);
+
+
+//// write batch functions
+// allocate the pending writes and the scratch space
+int spiWriteBatchInit(struct spiWriteBatch *batch, struct spiParams *params, int capacity)
+{
+	memset(batch, 0, sizeof(struct spiWriteBatch));
+
+	batch->params 			= params;
+	batch->capacity 		= capacity;
+
+	batch->addrShift 		= SPI_REGMAP_DEFAULT_ADDR_SHIFT;
+	batch->writeFlag 		= SPI_REGMAP_DEFAULT_WRITE_FLAG;
+	batch->bAutoIncrement 	= 1;
+	batch->maxBurst 		= 0;
+
+	batch->entries 		= (struct spiWriteBatchEntry*)malloc(sizeof(struct spiWriteBatchEntry) * capacity);
+	batch->data 		= (uint8_t*)malloc(sizeof(uint8_t) * capacity);
+	batch->addrBytes 	= (uint8_t*)malloc(sizeof(uint8_t) * capacity);
+	batch->segments 	= (struct spiSegment*)malloc(sizeof(struct spiSegment) * capacity * 2);
+
+	if (	capacity < 1 ||
+			batch->entries == NULL || batch->data == NULL ||
+			batch->addrBytes == NULL || batch->segments == NULL
+		)
+	{
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI write batch of %d registers\n", capacity);
+		spiWriteBatchRelease(batch);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void spiWriteBatchRelease(struct spiWriteBatch *batch)
+{
+	free(batch->entries);
+	free(batch->data);
+	free(batch->addrBytes);
+	free(batch->segments);
+
+	batch->entries 		= NULL;
+	batch->data 		= NULL;
+	batch->addrBytes 	= NULL;
+	batch->segments 	= NULL;
+	batch->capacity 	= 0;
+	batch->count 		= 0;
+}
+
+// queue a register write
+int spiWriteBatchAdd(struct spiWriteBatch *batch, int reg, uint8_t value)
+{
+	int 	i;
+
+	// replace a pending write to the same register
+	for (i = 0; i < batch->count; i++) {
+		if (batch->entries[i].reg == reg) {
+			batch->entries[i].value 	= value;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (batch->count == batch->capacity) {
+		if (spiWriteBatchFlush(batch) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	batch->entries[batch->count].reg 	= reg;
+	batch->entries[batch->count].value 	= value;
+	batch->count++;
+
+	return EXIT_SUCCESS;
+}
+
+// send the queued writes
+//	sorted by register, each run of contiguous registers becomes an address segment and a data segment,
+//	and all runs are sent with a single spiTransferSegments call
+int spiWriteBatchFlush(struct spiWriteBatch *batch)
+{
+	int 	status, i, runStart, numRuns, numSegments;
+
+	if (batch->count == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	qsort(batch->entries, batch->count, sizeof(struct spiWriteBatchEntry), _spiWriteBatchCompare);
+
+	numRuns 	= 0;
+	numSegments = 0;
+	runStart 	= 0;
+
+	for (i = 0; i < batch->count; i++) {
+		batch->data[i] 	= batch->entries[i].value;
+
+		// the run ends at a gap, at the burst limit, or at the last register
+		if (	i + 1 == batch->count ||
+				!batch->bAutoIncrement ||
+				batch->entries[i+1].reg != batch->entries[i].reg + 1 ||
+				(batch->maxBurst > 0 && i + 1 - runStart == batch->maxBurst)
+			)
+		{
+			batch->addrBytes[numRuns] 	= (uint8_t)((batch->entries[runStart].reg << batch->addrShift) | batch->writeFlag);
+
+			// address phase
+			memset(&(batch->segments[numSegments]), 0, sizeof(struct spiSegment) * 2);
+			batch->segments[numSegments].txBuffer 	= &(batch->addrBytes[numRuns]);
+			batch->segments[numSegments].bytes 		= 1;
+			batch->segments[numSegments].txNbits 	= 1;
+			batch->segments[numSegments].rxNbits 	= 1;
+			numSegments++;
+
+			// data phase, then deselect the device before the next run
+			batch->segments[numSegments].txBuffer 	= &(batch->data[runStart]);
+			batch->segments[numSegments].bytes 		= i + 1 - runStart;
+			batch->segments[numSegments].csChange 	= 1;
+			numSegments++;
+
+			numRuns++;
+			runStart 	= i + 1;
+		}
+	}
+
+	// the device is deselected at the end of the transaction anyway
+	batch->segments[numSegments-1].csChange 	= 0;
+
+	SPI_LOG(ONION_SEVERITY_DEBUG, "%s Writing %d register%s in %d burst%s\n", SPI_PRINT_BANNER, batch->count, (batch->count > 1 ? "s" : ""), numRuns, (numRuns > 1 ? "s" : "") );
+
+	status 			= spiTransferSegments(batch->params, batch->segments, numSegments);
+	batch->count 	= 0;
+
+	return status;
+}
+
+
+//// regmap functions
+// allocate the shadow registers
+int spiRegmapInit(struct spiRegmap *map, struct spiParams *params, int numRegs, int cacheMode)
+{
+	memset(map, 0, sizeof(struct spiRegmap));
+	pthread_mutex_init(&(map->lock), NULL);
+
+	map->params 	= params;
+	map->numRegs 	= numRegs;
+	map->cacheMode 	= cacheMode;
+
+	map->addrShift 	= SPI_REGMAP_DEFAULT_ADDR_SHIFT;
+	map->readFlag 	= SPI_REGMAP_DEFAULT_READ_FLAG;
+	map->writeFlag 	= SPI_REGMAP_DEFAULT_WRITE_FLAG;
+
+	map->values 	= (uint8_t*)calloc(numRegs, sizeof(uint8_t));
+	map->policy 	= (uint8_t*)calloc(numRegs, sizeof(uint8_t));
+	map->state 		= (uint8_t*)calloc(numRegs, sizeof(uint8_t));
+
+	if (	numRegs < 1 || map->values == NULL || map->policy == NULL || map->state == NULL ||
+			spiWriteBatchInit(&(map->batch), params, numRegs) != EXIT_SUCCESS
+		)
+	{
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI register map of %d registers\n", numRegs);
+		spiRegmapRelease(map);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// free the shadow registers
+void spiRegmapRelease(struct spiRegmap *map)
+{
+	free(map->values);
+	free(map->policy);
+	free(map->state);
+
+	map->values 	= NULL;
+	map->policy 	= NULL;
+	map->state 		= NULL;
+	map->numRegs 	= 0;
+
+	spiWriteBatchRelease(&(map->batch));
+
+	pthread_mutex_destroy(&(map->lock));
+}
+
+// set the policy of a range of registers
+int spiRegmapSetPolicy(struct spiRegmap *map, int firstReg, int numRegs, int policy)
+{
+	int 	i;
+
+	if (firstReg < 0 || numRegs < 0 || firstReg + numRegs > map->numRegs) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI registers 0x%02x-0x%02x are out of range\n", firstReg, firstReg + numRegs - 1);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(map->lock));
+	for (i = firstReg; i < firstReg + numRegs; i++) {
+		map->policy[i] 	= (uint8_t)policy;
+
+		// volatile values are never kept
+		if (policy & SPI_REGMAP_VOLATILE) {
+			map->state[i] 	= 0;
+		}
+	}
+	pthread_mutex_unlock(&(map->lock));
+
+	return EXIT_SUCCESS;
+}
+
+// read a register, from the cache when possible
+int spiRegmapRead(struct spiRegmap *map, int reg, uint8_t *value)
+{
+	int 	status;
+
+	if (reg < 0 || reg >= map->numRegs) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI register 0x%02x is out of range\n", reg);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(map->lock));
+	status 	= _spiRegmapRead(map, reg, value);
+	pthread_mutex_unlock(&(map->lock));
+
+	return status;
+}
+
+// write a register, dropping writes that would not change anything
+int spiRegmapWrite(struct spiRegmap *map, int reg, uint8_t value)
+{
+	int 	status;
+
+	if (reg < 0 || reg >= map->numRegs) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI register 0x%02x is out of range\n", reg);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(map->lock));
+	status 	= _spiRegmapWrite(map, reg, value);
+	pthread_mutex_unlock(&(map->lock));
+
+	return status;
+}
+
+// change the bits selected by mask, leaving the others
+int spiRegmapUpdateBits(struct spiRegmap *map, int reg, uint8_t mask, uint8_t value)
+{
+	int 		status;
+	uint8_t 	current;
+
+	if (reg < 0 || reg >= map->numRegs) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI register 0x%02x is out of range\n", reg);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(map->lock));
+	status 	= _spiRegmapRead(map, reg, &current);
+	if (status == EXIT_SUCCESS) {
+		status 	= _spiRegmapWrite(map, reg, (current & ~mask) | (value & mask));
+	}
+	pthread_mutex_unlock(&(map->lock));
+
+	return status;
+}
+
+// write the registers changed in write-back mode
+//	all dirty registers go out in one transaction, contiguous ones as bursts
+int spiRegmapSync(struct spiRegmap *map)
+{
+	int 	status, reg;
+
+	pthread_mutex_lock(&(map->lock));
+
+	// the batch follows the address format of the map
+	map->batch.addrShift 	= map->addrShift;
+	map->batch.writeFlag 	= map->writeFlag;
+
+	for (reg = 0; reg < map->numRegs; reg++) {
+		if (map->state[reg] & SPI_REGMAP_STATE_DIRTY) {
+			spiWriteBatchAdd(&(map->batch), reg, map->values[reg]);
+			map->busWrites++;
+		}
+	}
+
+	status 	= spiWriteBatchFlush(&(map->batch));
+
+	if (status == EXIT_SUCCESS) {
+		for (reg = 0; reg < map->numRegs; reg++) {
+			map->state[reg] 	&= ~SPI_REGMAP_STATE_DIRTY;
+		}
+	}
+
+	pthread_mutex_unlock(&(map->lock));
+
+	return status;
+}
+
+// forget all cached values
+void spiRegmapInvalidate(struct spiRegmap *map)
+{
+	pthread_mutex_lock(&(map->lock));
+	memset(map->state, 0, map->numRegs);
+	pthread_mutex_unlock(&(map->lock));
+}
+
+
+//// helper functions ////
+// order pending writes by register
+int _spiWriteBatchCompare(const void *a, const void *b)
+{
+	return ((const struct spiWriteBatchEntry*)a)->reg - ((const struct spiWriteBatchEntry*)b)->reg;
+}
+
+// read a register from the device
+int _spiRegmapBusRead(struct spiRegmap *map, int reg, uint8_t *value)
+{
+	map->busReads++;
+
+	return spiRead(map->params, (reg << map->addrShift) | map->readFlag, value, 1);
+}
+
+// write a register on the device
+int _spiRegmapBusWrite(struct spiRegmap *map, int reg, uint8_t value)
+{
+	map->busWrites++;
+
+	return spiWrite(map->params, (reg << map->addrShift) | map->writeFlag, &value, 1);
+}
+
+// read a register following its policy, called with the lock held
+int _spiRegmapRead(struct spiRegmap *map, int reg, uint8_t *value)
+{
+	int 	status;
+
+	// known value
+	if (	(map->state[reg] & SPI_REGMAP_STATE_VALID) &&
+			!(map->policy[reg] & SPI_REGMAP_VOLATILE)
+		)
+	{
+		map->cacheHits++;
+		*value 	= map->values[reg];
+		return EXIT_SUCCESS;
+	}
+
+	if (map->policy[reg] & SPI_REGMAP_WRITE_ONLY) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI register 0x%02x is write-only and has not been written\n", reg);
+		return EXIT_FAILURE;
+	}
+
+	// read from the device
+	status 	= _spiRegmapBusRead(map, reg, value);
+
+	if (status == EXIT_SUCCESS && !(map->policy[reg] & SPI_REGMAP_VOLATILE)) {
+		map->values[reg] 	= *value;
+		map->state[reg] 	= SPI_REGMAP_STATE_VALID;
+	}
+
+	return status;
+}
+
+// write a register following its policy and the cache mode, called with the lock held
+int _spiRegmapWrite(struct spiRegmap *map, int reg, uint8_t value)
+{
+	int 	status;
+
+	if (map->policy[reg] & SPI_REGMAP_READ_ONLY) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI register 0x%02x is read-only\n", reg);
+		return EXIT_FAILURE;
+	}
+
+	// volatile registers are always written, and never cached
+	if (map->policy[reg] & SPI_REGMAP_VOLATILE) {
+		return _spiRegmapBusWrite(map, reg, value);
+	}
+
+	// the device already holds (or will hold, once synced) this value
+	if ((map->state[reg] & SPI_REGMAP_STATE_VALID) && map->values[reg] == value) {
+		map->droppedWrites++;
+		return EXIT_SUCCESS;
+	}
+
+	if (map->cacheMode == SPI_REGMAP_WRITE_BACK) {
+		map->values[reg] 	= value;
+		map->state[reg] 	= SPI_REGMAP_STATE_VALID | SPI_REGMAP_STATE_DIRTY;
+		return EXIT_SUCCESS;
+	}
+
+	// write-through
+	status 	= _spiRegmapBusWrite(map, reg, value);
+	if (status == EXIT_SUCCESS) {
+		map->values[reg] 	= value;
+		map->state[reg] 	= SPI_REGMAP_STATE_VALID;
+	}
+	else {
+		map->state[reg] 	= 0;
+	}
+
+	return status;
+}
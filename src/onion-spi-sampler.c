@@ -0,0 +1,325 @@
+#include <onion-spi-sampler.h>
+#include <onion-spi-trace.h>
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+// helper function prototypes
+void* 	_spiSamplerWorker		(void *arg);
+void 	_spiSamplerTake			(struct spiSampler *sampler, uint64_t period, uint64_t deadlineNs);
+uint8_t* 	_spiSamplerSlot		(struct spiSampler *sampler, uint64_t index);
+
+
+//// sampler functions
+int spiSamplerInit(struct spiSampler *sampler, struct spiParams *params, struct spiSegment *segments, int numSegments, int numSamples)
+{
+	int 	i;
+
+	memset(sampler, 0, sizeof(struct spiSampler));
+	sampler->timerFd 	= -1;
+	sampler->stopFd 	= -1;
+	sampler->params.fd 	= -1;
+
+	if (numSegments < 1 || numSegments > SPI_SAMPLER_MAX_SEGMENTS) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: an SPI sampler takes 1 to %d segments\n", SPI_SAMPLER_MAX_SEGMENTS);
+		return EXIT_FAILURE;
+	}
+
+	// keep a copy of the transfer, the received data of each segment goes to its own place in the sample
+	memcpy(&(sampler->params), params, sizeof(struct spiParams));
+	sampler->params.fd 	= -1;
+
+	memcpy(sampler->segments, segments, sizeof(struct spiSegment) * numSegments);
+	sampler->numSegments 	= numSegments;
+	for (i = 0; i < numSegments; i++) {
+		sampler->captureOffsets[i] 	= -1;
+		if (segments[i].rxBuffer != NULL) {
+			sampler->captureOffsets[i] 	= sampler->sampleBytes;
+			sampler->sampleBytes 		+= segments[i].bytes;
+		}
+	}
+
+	// allocate the ring, slots are aligned for their header
+	sampler->numSamples 	= (numSamples > 0 ? numSamples : SPI_SAMPLER_DEFAULT_SAMPLES);
+	sampler->slotBytes 		= (sizeof(struct spiSample) + sampler->sampleBytes + 7) & ~7;
+	sampler->ring 			= (uint8_t*)calloc(sampler->numSamples, sampler->slotBytes);
+	if (sampler->ring == NULL) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI sampler ring\n");
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_init(&(sampler->lock), NULL);
+
+	return EXIT_SUCCESS;
+}
+
+void spiSamplerRelease(struct spiSampler *sampler)
+{
+	spiSamplerStop(sampler);
+
+	if (sampler->ring != NULL) {
+		pthread_mutex_destroy(&(sampler->lock));
+		free(sampler->ring);
+		sampler->ring 	= NULL;
+	}
+}
+
+// open the device and start the thread
+int spiSamplerStart(struct spiSampler *sampler, int periodUs)
+{
+	int 				status;
+	struct itimerspec 	timer;
+	struct sched_param 	sched;
+	pthread_attr_t 		attr;
+
+	if (sampler->ring == NULL || sampler->stopFd >= 0 || periodUs <= 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI sampler is not ready to start\n");
+		return EXIT_FAILURE;
+	}
+
+	if (spiOpenDevice(&(sampler->params)) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+
+	// stopFd is created last, spiSamplerStop only joins the thread once it is open
+	sampler->timerFd 	= timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (sampler->timerFd < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not create SPI sampler timer\n");
+		spiSamplerStop(sampler);
+		return EXIT_FAILURE;
+	}
+
+	// a fixed schedule from the start, so late samples do not shift the ones after them
+	sampler->periodNs 	= (uint64_t)periodUs * 1000;
+	sampler->startNs 	= spiTraceGetTimeNs();
+
+	timer.it_interval.tv_sec 	= sampler->periodNs / 1000000000ULL;
+	timer.it_interval.tv_nsec 	= sampler->periodNs % 1000000000ULL;
+	timer.it_value.tv_sec 		= (sampler->startNs + sampler->periodNs) / 1000000000ULL;
+	timer.it_value.tv_nsec 		= (sampler->startNs + sampler->periodNs) % 1000000000ULL;
+	if (timerfd_settime(sampler->timerFd, TFD_TIMER_ABSTIME, &timer, NULL) < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not set SPI sampler timer\n");
+		spiSamplerStop(sampler);
+		return EXIT_FAILURE;
+	}
+
+	sampler->stopFd 	= eventfd(0, EFD_CLOEXEC);
+	if (sampler->stopFd < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not create SPI sampler timer\n");
+		spiSamplerStop(sampler);
+		return EXIT_FAILURE;
+	}
+
+	// start the thread, realtime if possible
+	status 	= -1;
+	if (sampler->priority > 0) {
+		if (mlock(sampler->ring, (size_t)sampler->numSamples * sampler->slotBytes) < 0 || mlock(sampler, sizeof(struct spiSampler)) < 0) {
+			SPI_LOG(ONION_SEVERITY_INFO, "could not lock SPI sampler memory: %s\n", strerror(errno));
+		}
+
+		memset(&sched, 0, sizeof(sched));
+		sched.sched_priority 	= sampler->priority;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &sched);
+		status 	= pthread_create(&(sampler->worker), &attr, _spiSamplerWorker, sampler);
+		pthread_attr_destroy(&attr);
+
+		if (status != 0) {
+			SPI_LOG(ONION_SEVERITY_INFO, "could not start SPI sampler with SCHED_FIFO priority %d, using normal scheduling\n", sampler->priority);
+		}
+	}
+	if (status != 0) {
+		status 	= pthread_create(&(sampler->worker), NULL, _spiSamplerWorker, sampler);
+	}
+	if (status != 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not start SPI sampler thread\n");
+		close(sampler->stopFd);
+		sampler->stopFd 	= -1;
+		spiSamplerStop(sampler);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// stop the thread and close the device, samples not read yet stay in the ring
+int spiSamplerStop(struct spiSampler *sampler)
+{
+	uint64_t 	one = 1;
+
+	if (sampler->stopFd >= 0) {
+		if (write(sampler->stopFd, &one, sizeof(one)) == sizeof(one)) {
+			pthread_join(sampler->worker, NULL);
+		}
+		close(sampler->stopFd);
+		sampler->stopFd 	= -1;
+	}
+
+	// also when starting failed after locking it
+	if (sampler->priority > 0 && sampler->ring != NULL) {
+		munlock(sampler->ring, (size_t)sampler->numSamples * sampler->slotBytes);
+		munlock(sampler, sizeof(struct spiSampler));
+	}
+
+	if (sampler->timerFd >= 0) {
+		close(sampler->timerFd);
+		sampler->timerFd 	= -1;
+	}
+
+	if (sampler->params.fd >= 0) {
+		spiCloseDevice(&(sampler->params));
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// copy the samples from the ring
+//	a slot may be overwritten while it is copied, so the head is checked again afterwards
+int spiSamplerRead(struct spiSampler *sampler, struct spiSample *samples, uint8_t *data, int maxSamples)
+{
+	int 		count, dropped, stale;
+	uint64_t 	head, tail, first;
+	uint8_t 	*slot;
+
+	head 	= __atomic_load_n(&(sampler->head), __ATOMIC_ACQUIRE);
+	tail 	= sampler->tail;
+	dropped 	= 0;
+
+	// the oldest samples have been overwritten
+	if (head - tail > (uint64_t)sampler->numSamples) {
+		dropped 	= head - tail - sampler->numSamples;
+		tail 		= head - sampler->numSamples;
+	}
+
+	first 	= tail;
+	for (count = 0; count < maxSamples && tail < head; count++, tail++) {
+		slot 	= _spiSamplerSlot(sampler, tail);
+		memcpy(&samples[count], slot, sizeof(struct spiSample));
+		memcpy(data + count * sampler->sampleBytes, slot + sizeof(struct spiSample), sampler->sampleBytes);
+	}
+
+	// drop the copies the thread may have written over
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	head 	= __atomic_load_n(&(sampler->head), __ATOMIC_ACQUIRE);
+	if (count > 0 && head >= first + sampler->numSamples) {
+		stale 	= head - sampler->numSamples + 1 - first;
+		if (stale > count) {
+			stale 	= count;
+		}
+		memmove(samples, samples + stale, sizeof(struct spiSample) * (count - stale));
+		memmove(data, data + stale * sampler->sampleBytes, sampler->sampleBytes * (count - stale));
+
+		count 		-= stale;
+		dropped 	+= stale;
+	}
+	sampler->tail 	= tail;
+
+	if (dropped > 0) {
+		pthread_mutex_lock(&(sampler->lock));
+		sampler->stats.overruns 	+= dropped;
+		pthread_mutex_unlock(&(sampler->lock));
+	}
+
+	return count;
+}
+
+void spiSamplerGetStats(struct spiSampler *sampler, struct spiSamplerStats *stats)
+{
+	pthread_mutex_lock(&(sampler->lock));
+	memcpy(stats, &(sampler->stats), sizeof(struct spiSamplerStats));
+	pthread_mutex_unlock(&(sampler->lock));
+}
+
+
+//// helper functions ////
+// take a sample on every timer expiration until stopped
+void* _spiSamplerWorker(void *arg)
+{
+	uint64_t 	expirations, period;
+	struct pollfd 			fds[2];
+	struct spiSampler 		*sampler;
+
+	sampler 	= (struct spiSampler*)arg;
+	period 		= 0;
+
+	fds[0].fd 		= sampler->timerFd;
+	fds[0].events 	= POLLIN;
+	fds[1].fd 		= sampler->stopFd;
+	fds[1].events 	= POLLIN;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			break;
+		}
+		if (read(sampler->timerFd, &expirations, sizeof(expirations)) != sizeof(expirations) || expirations == 0) {
+			continue;
+		}
+
+		// more than one expiration: the periods before the last one were missed
+		period 	+= expirations;
+		if (expirations > 1) {
+			pthread_mutex_lock(&(sampler->lock));
+			sampler->stats.missed 	+= expirations - 1;
+			pthread_mutex_unlock(&(sampler->lock));
+		}
+
+		_spiSamplerTake(sampler, period, sampler->startNs + period * sampler->periodNs);
+	}
+
+	return NULL;
+}
+
+// run the transfer into the next slot of the ring
+void _spiSamplerTake(struct spiSampler *sampler, uint64_t period, uint64_t deadlineNs)
+{
+	int 		i, status;
+	uint64_t 	head, startNs, endNs;
+	uint8_t 	*slot;
+	struct spiSample 	*sample;
+
+	head 	= sampler->head;
+	slot 	= _spiSamplerSlot(sampler, head);
+	sample 	= (struct spiSample*)slot;
+
+	for (i = 0; i < sampler->numSegments; i++) {
+		if (sampler->captureOffsets[i] >= 0) {
+			sampler->segments[i].rxBuffer 	= slot + sizeof(struct spiSample) + sampler->captureOffsets[i];
+		}
+	}
+
+	startNs 	= spiTraceGetTimeNs();
+	status 		= spiTransferSegments(&(sampler->params), sampler->segments, sampler->numSegments);
+	endNs 		= spiTraceGetTimeNs();
+
+	sample->timestampNs 	= startNs;
+	sample->period 			= period;
+	sample->status 			= status;
+
+	__atomic_store_n(&(sampler->head), head + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&(sampler->lock));
+	sampler->stats.samples++;
+	if (status != EXIT_SUCCESS) {
+		sampler->stats.errors++;
+	}
+	spiStatsRecord(&(sampler->stats.jitter), (startNs > deadlineNs ? startNs - deadlineNs : 0));
+	spiStatsRecord(&(sampler->stats.duration), endNs - startNs);
+	pthread_mutex_unlock(&(sampler->lock));
+}
+
+uint8_t* _spiSamplerSlot(struct spiSampler *sampler, uint64_t index)
+{
+	return sampler->ring + (index % sampler->numSamples) * sampler->slotBytes;
+}
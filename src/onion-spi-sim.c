@@ -0,0 +1,201 @@
+#include <onion-spi-sim.h>
+#include <onion-spi-trace.h>
+
+// helper function prototypes
+int 	_spiSimOpen				(const struct spiBackend *backend, struct spiParams *params, int *handle);
+int 	_spiSimConfigure		(const struct spiBackend *backend, struct spiParams *params, int handle);
+int 	_spiSimTransfer			(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers);
+int 	_spiSimClose			(const struct spiBackend *backend, struct spiParams *params, int handle);
+
+uint8_t _spiSimByte				(struct spiSimDevice *device, uint8_t tx);
+void 	_spiSimWait				(uint64_t startNs, uint64_t durationNs);
+
+
+//// simulator functions
+int spiSimInit(struct spiBackend *backend, struct spiSimDevice *device, int numRegs)
+{
+	memset(device, 0, sizeof(struct spiSimDevice));
+
+	device->numRegs 		= numRegs;
+	device->addrShift 		= SPI_SIM_DEFAULT_ADDR_SHIFT;
+	device->readFlag 		= SPI_SIM_DEFAULT_READ_FLAG;
+	device->bAutoIncrement 	= 1;
+	device->bModelClock 	= 0;
+
+	if (numRegs > 0) {
+		device->registers 	= (uint8_t*)calloc(numRegs, sizeof(uint8_t));
+		if (device->registers == NULL) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate %d simulated SPI registers\n", numRegs);
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_mutex_init(&(device->lock), NULL);
+
+	memset(backend, 0, sizeof(struct spiBackend));
+	backend->name 		= SPI_SIM_BACKEND_NAME;
+	backend->open 		= _spiSimOpen;
+	backend->configure 	= _spiSimConfigure;
+	backend->transfer 	= _spiSimTransfer;
+	backend->close 		= _spiSimClose;
+	backend->context 	= device;
+
+	return EXIT_SUCCESS;
+}
+
+void spiSimRelease(struct spiSimDevice *device)
+{
+	free(device->registers);
+	device->registers 	= NULL;
+	device->numRegs 	= 0;
+
+	pthread_mutex_destroy(&(device->lock));
+}
+
+uint64_t spiSimMessageNs(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 		i, speed, lines;
+	uint64_t 	total;
+
+	total 	= 0;
+	for (i = 0; i < numXfers; i++) {
+		speed 	= (xfer[i].speed_hz > 0 ? xfer[i].speed_hz : params->speedInHz);
+
+		lines 	= (xfer[i].tx_nbits > xfer[i].rx_nbits ? xfer[i].tx_nbits : xfer[i].rx_nbits);
+		if (lines < 1) {
+			lines 	= 1;
+		}
+
+		if (speed > 0) {
+			total 	+= (uint64_t)xfer[i].len * 8 * 1000000000ULL / ((uint64_t)speed * lines);
+		}
+		total 	+= (uint64_t)xfer[i].delay_usecs * 1000;
+	}
+
+	return total;
+}
+
+
+//// backend functions ////
+int _spiSimOpen(const struct spiBackend *backend, struct spiParams *params, int *handle)
+{
+	// no file behind the device
+	*handle 	= 0;
+	return EXIT_SUCCESS;
+}
+
+// nothing to configure, speed, bits per word and delay come with every transfer
+int _spiSimConfigure(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	return EXIT_SUCCESS;
+}
+
+// run one message through the device, returns like the spidev ioctl
+//	a frame ends at a cs_change before the last transfer, or at the end of the message
+//	unless its last transfer has cs_change, then it goes on in the next message
+int _spiSimTransfer(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	int 		i, j, total;
+	uint8_t 	tx;
+	uint8_t 	*txBuffer, *rxBuffer;
+	uint64_t 	startNs, durationNs;
+	struct spiSimDevice 	*device 	= (struct spiSimDevice*)backend->context;
+
+	startNs 	= spiTraceGetTimeNs();
+	durationNs 	= spiSimMessageNs(params, xfer, numXfers);
+
+	pthread_mutex_lock(&(device->lock));
+
+	total 		= 0;
+	for (i = 0; i < numXfers; i++) {
+		txBuffer 	= (uint8_t*)(uintptr_t)xfer[i].tx_buf;
+		rxBuffer 	= (uint8_t*)(uintptr_t)xfer[i].rx_buf;
+
+		for (j = 0; j < (int)xfer[i].len; j++) {
+			tx 	= (txBuffer != NULL ? txBuffer[j] : 0);
+
+			if (device->numRegs > 0) {
+				tx 	= _spiSimByte(device, tx);
+			}
+			if (rxBuffer != NULL) {
+				rxBuffer[j] 	= tx;
+			}
+		}
+		total 	+= xfer[i].len;
+
+		// cs_change on the last transfer keeps the device selected
+		if ((xfer[i].cs_change != 0) != (i == numXfers - 1)) {
+			device->framePosition 	= 0;
+		}
+	}
+
+	device->messages++;
+	device->bytes 		+= total;
+	device->busTimeNs 	+= durationNs;
+
+	pthread_mutex_unlock(&(device->lock));
+
+	if (device->bModelClock) {
+		_spiSimWait(startNs, durationNs);
+	}
+
+	return total;
+}
+
+// closing the device deselects it
+int _spiSimClose(const struct spiBackend *backend, struct spiParams *params, int handle)
+{
+	struct spiSimDevice 	*device 	= (struct spiSimDevice*)backend->context;
+
+	pthread_mutex_lock(&(device->lock));
+	device->framePosition 	= 0;
+	pthread_mutex_unlock(&(device->lock));
+
+	return EXIT_SUCCESS;
+}
+
+
+//// helper functions ////
+// handle one byte of a register frame, returns the byte shifted out by the device
+uint8_t _spiSimByte(struct spiSimDevice *device, uint8_t tx)
+{
+	uint8_t 	rx 	= 0;
+
+	if (device->framePosition++ == 0) {
+		// address byte
+		device->bFrameRead 	= (tx & device->readFlag) != 0;
+		device->frameReg 	= (tx & ~(device->readFlag)) >> device->addrShift;
+		return rx;
+	}
+
+	if (device->bFrameRead) {
+		rx 	= device->registers[device->frameReg % device->numRegs];
+	}
+	else {
+		device->registers[device->frameReg % device->numRegs] 	= tx;
+	}
+
+	if (device->bAutoIncrement) {
+		device->frameReg++;
+	}
+
+	return rx;
+}
+
+// wait until durationNs after startNs, sleeping for most of it and spinning for the rest
+void _spiSimWait(uint64_t startNs, uint64_t durationNs)
+{
+	uint64_t 	deadline, now;
+	struct timespec 	wake;
+
+	deadline 	= startNs + durationNs;
+	now 		= spiTraceGetTimeNs();
+
+	if (deadline > now + SPI_SIM_SPIN_NS) {
+		wake.tv_sec 	= (deadline - SPI_SIM_SPIN_NS) / 1000000000ULL;
+		wake.tv_nsec 	= (deadline - SPI_SIM_SPIN_NS) % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+	}
+
+	while (spiTraceGetTimeNs() < deadline);
+}
@@ -0,0 +1,270 @@
+#include <onion-spi-stats.h>
+
+#include <stddef.h>
+
+// helper function prototypes
+struct spiStatsEntry;
+struct spiStatsEntry* 	_spiStatsFind	(int busNum, int devId, int bCreate);
+
+int 	_spiStatsBucket			(uint32_t value);
+uint32_t 	_spiStatsBucketLimit	(int bucket);
+
+
+// statistics of one device, updated under its own lock
+struct spiStatsEntry {
+	pthread_mutex_t 	lock;
+	struct spiStats 	stats;
+};
+
+// entries are only ever added, so lookups need no lock
+static struct spiStatsEntry 	_spiStatsTable[SPI_STATS_DEVICES];
+static int 						_spiStatsCount 		= 0;
+static pthread_mutex_t 			_spiStatsTableLock 	= PTHREAD_MUTEX_INITIALIZER;
+static int 						_spiStatsEnabled 	= 1;
+
+
+//// statistics functions
+void spiStatsEnable(int bEnable)
+{
+	__atomic_store_n(&_spiStatsEnabled, bEnable, __ATOMIC_RELAXED);
+}
+
+// count one ioctl message
+void spiStatsMessage(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers, uint64_t durationNs, int error)
+{
+	int 		i;
+	uint64_t 	txBytes, rxBytes;
+	struct spiStatsEntry 	*entry;
+
+	if (!__atomic_load_n(&_spiStatsEnabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	entry 	= _spiStatsFind(params->busNum, params->deviceId, 1);
+	if (entry == NULL) {
+		return;
+	}
+
+	txBytes 	= 0;
+	rxBytes 	= 0;
+	for (i = 0; i < numXfers; i++) {
+		if (xfer[i].tx_buf != 0) 	txBytes 	+= xfer[i].len;
+		if (xfer[i].rx_buf != 0) 	rxBytes 	+= xfer[i].len;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+
+	entry->stats.messages++;
+	if (error == 0) {
+		entry->stats.txBytes 	+= txBytes;
+		entry->stats.rxBytes 	+= rxBytes;
+	}
+	else {
+		entry->stats.errnoCounts[(error > 0 && error < SPI_STATS_ERRNO_MAX) ? error : SPI_STATS_ERRNO_MAX]++;
+	}
+	spiStatsRecord(&(entry->stats.ioctlLatency), durationNs);
+
+	pthread_mutex_unlock(&(entry->lock));
+}
+
+// count one call to a transfer function
+void spiStatsTransfer(struct spiParams *params, uint64_t durationNs, int status)
+{
+	struct spiStatsEntry 	*entry;
+
+	if (!__atomic_load_n(&_spiStatsEnabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	entry 	= _spiStatsFind(params->busNum, params->deviceId, 1);
+	if (entry == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+
+	entry->stats.transfers++;
+	if (status != EXIT_SUCCESS) {
+		entry->stats.errors++;
+	}
+	spiStatsRecord(&(entry->stats.callLatency), durationNs);
+
+	pthread_mutex_unlock(&(entry->lock));
+}
+
+int spiStatsGet(int busNum, int devId, struct spiStats *stats)
+{
+	struct spiStatsEntry 	*entry;
+
+	entry 	= _spiStatsFind(busNum, devId, 0);
+	if (entry == NULL) {
+		memset(stats, 0, sizeof(struct spiStats));
+		stats->busNum 		= busNum;
+		stats->deviceId 	= devId;
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_lock(&(entry->lock));
+	memcpy(stats, &(entry->stats), sizeof(struct spiStats));
+	pthread_mutex_unlock(&(entry->lock));
+
+	return EXIT_SUCCESS;
+}
+
+int spiStatsGetAll(struct spiStats *stats, int maxDevices)
+{
+	int 	i, count;
+
+	count 	= __atomic_load_n(&_spiStatsCount, __ATOMIC_ACQUIRE);
+	if (count > maxDevices) {
+		count 	= maxDevices;
+	}
+
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&(_spiStatsTable[i].lock));
+		memcpy(&stats[i], &(_spiStatsTable[i].stats), sizeof(struct spiStats));
+		pthread_mutex_unlock(&(_spiStatsTable[i].lock));
+	}
+
+	return count;
+}
+
+void spiStatsReset(int busNum, int devId)
+{
+	int 	i, count;
+	struct spiStatsEntry 	*entry;
+
+	count 	= __atomic_load_n(&_spiStatsCount, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		entry 	= &(_spiStatsTable[i]);
+		if (busNum >= 0 && (entry->stats.busNum != busNum || entry->stats.deviceId != devId)) {
+			continue;
+		}
+
+		// keep the bus and device, lookups read them without the lock
+		pthread_mutex_lock(&(entry->lock));
+		memset(&(entry->stats.transfers), 0, sizeof(struct spiStats) - offsetof(struct spiStats, transfers));
+		pthread_mutex_unlock(&(entry->lock));
+	}
+}
+
+uint32_t spiStatsPercentile(const struct spiStatsHistogram *histogram, double percentile)
+{
+	int 		i;
+	uint64_t 	target, seen;
+
+	if (histogram->count == 0) {
+		return 0;
+	}
+
+	target 	= (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+	if (target < 1) 				target 	= 1;
+	if (target > histogram->count) 	target 	= histogram->count;
+
+	seen 	= 0;
+	for (i = 0; i < SPI_STATS_HIST_BUCKETS; i++) {
+		seen 	+= histogram->buckets[i];
+		if (seen >= target) {
+			// the top of the bucket, but never above the largest sample
+			return (_spiStatsBucketLimit(i) < histogram->maxNs ? _spiStatsBucketLimit(i) : histogram->maxNs);
+		}
+	}
+
+	return histogram->maxNs;
+}
+
+// add a sample to a histogram, callers serialize access to it
+void spiStatsRecord(struct spiStatsHistogram *histogram, uint64_t durationNs)
+{
+	uint32_t 	value;
+
+	value 	= (durationNs > UINT32_MAX ? UINT32_MAX : (uint32_t)durationNs);
+
+	if (histogram->count == 0 || value < histogram->minNs) {
+		histogram->minNs 	= value;
+	}
+	if (value > histogram->maxNs) {
+		histogram->maxNs 	= value;
+	}
+
+	histogram->count++;
+	histogram->sumNs 	+= value;
+	histogram->buckets[_spiStatsBucket(value)]++;
+}
+
+
+//// helper functions ////
+// find the entry of a device, adding it if bCreate is set and there is room
+struct spiStatsEntry* _spiStatsFind(int busNum, int devId, int bCreate)
+{
+	int 	i, count;
+	struct spiStatsEntry 	*entry;
+
+	count 	= __atomic_load_n(&_spiStatsCount, __ATOMIC_ACQUIRE);
+	for (i = 0; i < count; i++) {
+		if (_spiStatsTable[i].stats.busNum == busNum && _spiStatsTable[i].stats.deviceId == devId) {
+			return &(_spiStatsTable[i]);
+		}
+	}
+
+	if (!bCreate) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&_spiStatsTableLock);
+
+	// another thread may have added it meanwhile
+	entry 	= NULL;
+	for (i = 0; i < _spiStatsCount; i++) {
+		if (_spiStatsTable[i].stats.busNum == busNum && _spiStatsTable[i].stats.deviceId == devId) {
+			entry 	= &(_spiStatsTable[i]);
+		}
+	}
+
+	if (entry == NULL && _spiStatsCount < SPI_STATS_DEVICES) {
+		entry 	= &(_spiStatsTable[_spiStatsCount]);
+		memset(entry, 0, sizeof(struct spiStatsEntry));
+		pthread_mutex_init(&(entry->lock), NULL);
+		entry->stats.busNum 	= busNum;
+		entry->stats.deviceId 	= devId;
+
+		// publish the entry once it is filled in
+		__atomic_store_n(&_spiStatsCount, _spiStatsCount + 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&_spiStatsTableLock);
+
+	return entry;
+}
+
+// values below 2^SUB_BITS have their own bucket,
+//	above that each power of two is split into 2^SUB_BITS buckets
+int _spiStatsBucket(uint32_t value)
+{
+	int 	exponent;
+
+	if (value < (1 << SPI_STATS_HIST_SUB_BITS)) {
+		return value;
+	}
+
+	exponent 	= 31 - __builtin_clz(value);
+
+	return ((exponent - SPI_STATS_HIST_SUB_BITS) << SPI_STATS_HIST_SUB_BITS) + (value >> (exponent - SPI_STATS_HIST_SUB_BITS));
+}
+
+// largest value that falls in a bucket
+uint32_t _spiStatsBucketLimit(int bucket)
+{
+	int 		exponent;
+	uint64_t 	mantissa;
+
+	if (bucket < (2 << SPI_STATS_HIST_SUB_BITS)) {
+		return bucket;
+	}
+
+	exponent 	= (bucket >> SPI_STATS_HIST_SUB_BITS) + SPI_STATS_HIST_SUB_BITS - 1;
+	mantissa 	= (bucket & ((1 << SPI_STATS_HIST_SUB_BITS) - 1)) | (1 << SPI_STATS_HIST_SUB_BITS);
+
+	return (uint32_t)(((mantissa + 1) << (exponent - SPI_STATS_HIST_SUB_BITS)) - 1);
+}
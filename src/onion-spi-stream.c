@@ -0,0 +1,333 @@
+#include <onion-spi-stream.h>
+#include <onion-spi-trace.h>
+
+// helper function prototypes
+struct spiStream;
+struct spiStreamSlot;
+
+void* 	_spiStreamReader		(void *arg);
+void* 	_spiStreamWriter		(void *arg);
+int 	_spiStreamSend			(struct spiParams *params, struct spiStream *stream, struct spiStreamStats *stats);
+
+int 	_spiStreamReadFull		(int fd, uint8_t *buffer, int bytes);
+int 	_spiStreamWriteFull		(int fd, uint8_t *buffer, int bytes);
+
+
+// states of a slot, in the order a chunk goes through them
+#define SPI_STREAM_SLOT_FREE		0
+#define SPI_STREAM_SLOT_FILLED		1		// read from the input, waiting for the bus
+#define SPI_STREAM_SLOT_SENT		2		// transferred, waiting to be written to the output
+
+// one chunk buffer, owned by the stage its state belongs to
+struct spiStreamSlot {
+	uint8_t 	*txBuffer;
+	uint8_t 	*rxBuffer;
+	int 		bytes;
+	int 		state;
+};
+
+// shared by the reader, the bus and the writer stages, the slots are used in turn by each stage
+struct spiStream {
+	int 		inFd;
+	int 		outFd;
+	int64_t 	remaining;		// bytes left to read, -1 until the end of inFd
+	int 		chunkBytes;
+
+	struct spiStreamSlot 	slots[SPI_STREAM_BUFFERS];
+
+	int 		bEnd;			// the reader filled its last slot
+	int 		bSent;			// the bus stage is done
+	int 		bError;			// a stage failed, all stop
+
+	pthread_mutex_t 	lock;
+	pthread_cond_t 		cond;
+};
+
+
+//// stream functions
+int spiStream(struct spiParams *params, int inFd, int outFd, int64_t bytes, struct spiStreamStats *stats)
+{
+	int 		status, i;
+	uint8_t 	*buffers;
+	uint64_t 	startNs;
+	pthread_t 	reader, writer;
+	struct spiStream 		stream;
+	struct spiStreamStats 	localStats;
+
+	if (inFd < 0 && bytes < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: an SPI stream without input needs a length\n");
+		return EXIT_FAILURE;
+	}
+	if (stats == NULL) {
+		stats 	= &localStats;
+	}
+	memset(stats, 0, sizeof(struct spiStreamStats));
+	startNs 	= spiTraceGetTimeNs();
+
+	// one ioctl call per chunk
+	memset(&stream, 0, sizeof(stream));
+	stream.inFd 		= inFd;
+	stream.outFd 		= outFd;
+	stream.remaining 	= bytes;
+	stream.chunkBytes 	= spiGetMaxTransferSize();
+
+	buffers 	= (uint8_t*)malloc(stream.chunkBytes * 2 * SPI_STREAM_BUFFERS);
+	if (buffers == NULL) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI stream buffers\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < SPI_STREAM_BUFFERS; i++) {
+		stream.slots[i].txBuffer 	= buffers + (2 * i) * stream.chunkBytes;
+		stream.slots[i].rxBuffer 	= buffers + (2 * i + 1) * stream.chunkBytes;
+	}
+
+	pthread_mutex_init(&(stream.lock), NULL);
+	pthread_cond_init(&(stream.cond), NULL);
+
+	// the file I/O runs beside the bus
+	status 	= EXIT_FAILURE;
+	if (pthread_create(&reader, NULL, _spiStreamReader, &stream) != 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not start SPI stream reader\n");
+	}
+	else {
+		if (outFd >= 0 && pthread_create(&writer, NULL, _spiStreamWriter, &stream) != 0) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not start SPI stream writer\n");
+			outFd 	= -1;
+			stream.bError 	= 1;
+		}
+		else {
+			status 	= _spiStreamSend(params, &stream, stats);
+		}
+
+		// stop the other stages
+		pthread_mutex_lock(&(stream.lock));
+		stream.bSent 	= 1;
+		pthread_cond_broadcast(&(stream.cond));
+		pthread_mutex_unlock(&(stream.lock));
+
+		pthread_join(reader, NULL);
+		if (outFd >= 0) {
+			pthread_join(writer, NULL);
+		}
+	}
+
+	if (stream.bError) {
+		status 	= EXIT_FAILURE;
+	}
+	stats->elapsedNs 	= spiTraceGetTimeNs() - startNs;
+
+	// clean-up
+	pthread_cond_destroy(&(stream.cond));
+	pthread_mutex_destroy(&(stream.lock));
+	free(buffers);
+
+	return status;
+}
+
+
+//// helper functions ////
+// bus stage: send the chunks in order, each in one ioctl call
+int _spiStreamSend(struct spiParams *params, struct spiStream *stream, struct spiStreamStats *stats)
+{
+	int 		status, i, bMore, bSelected;
+	uint64_t 	startNs, endNs;
+	struct spiSegment 		segment;
+	struct spiStreamSlot 	*slot, *next;
+
+	status 		= EXIT_SUCCESS;
+	bSelected 	= 0;
+
+	for (i = 0; status == EXIT_SUCCESS; i = (i + 1) % SPI_STREAM_BUFFERS) {
+		slot 	= &(stream->slots[i]);
+		next 	= &(stream->slots[(i + 1) % SPI_STREAM_BUFFERS]);
+
+		// wait for the chunk, and to know if another one follows it
+		startNs 	= spiTraceGetTimeNs();
+		pthread_mutex_lock(&(stream->lock));
+		while (	!stream->bError &&
+				!(stream->bEnd && slot->state != SPI_STREAM_SLOT_FILLED) &&
+				!(slot->state == SPI_STREAM_SLOT_FILLED && (stream->bEnd || next->state == SPI_STREAM_SLOT_FILLED))
+			)
+		{
+			pthread_cond_wait(&(stream->cond), &(stream->lock));
+		}
+		bMore 	= (next->state == SPI_STREAM_SLOT_FILLED);
+		if (stream->bError || slot->state != SPI_STREAM_SLOT_FILLED) {
+			pthread_mutex_unlock(&(stream->lock));
+			break;
+		}
+		pthread_mutex_unlock(&(stream->lock));
+
+		// cs_change on the last segment keeps the device selected for the next chunk
+		memset(&segment, 0, sizeof(segment));
+		segment.txBuffer 	= (stream->inFd >= 0 ? slot->txBuffer : NULL);
+		segment.rxBuffer 	= (stream->outFd >= 0 ? slot->rxBuffer : NULL);
+		segment.bytes 		= slot->bytes;
+		segment.csChange 	= bMore;
+
+		endNs 	= spiTraceGetTimeNs();
+		status 		= spiTransferSegments(params, &segment, 1);
+		bSelected 	= (status == EXIT_SUCCESS && bMore);
+
+		stats->stallNs 	+= endNs - startNs;
+		stats->busNs 	+= spiTraceGetTimeNs() - endNs;
+		stats->bytes 	+= slot->bytes;
+		stats->chunks++;
+
+		// hand the chunk to the writer
+		pthread_mutex_lock(&(stream->lock));
+		slot->state 	= (stream->outFd >= 0 ? SPI_STREAM_SLOT_SENT : SPI_STREAM_SLOT_FREE);
+		if (status != EXIT_SUCCESS) {
+			stream->bError 	= 1;
+		}
+		pthread_cond_broadcast(&(stream->cond));
+		pthread_mutex_unlock(&(stream->lock));
+	}
+
+	// another stage failed after a chunk that kept the device selected,
+	//	an empty segment deselects it and gives the bus back
+	if (bSelected) {
+		memset(&segment, 0, sizeof(segment));
+		spiTransferSegments(params, &segment, 1);
+	}
+
+	return status;
+}
+
+// reader stage: fill the free slots in order until the end of the input
+void* _spiStreamReader(void *arg)
+{
+	int 		i, bytes;
+	struct spiStream 		*stream;
+	struct spiStreamSlot 	*slot;
+
+	stream 	= (struct spiStream*)arg;
+
+	// the input is read once, front to back
+	if (stream->inFd >= 0) {
+		posix_fadvise(stream->inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	for (i = 0; ; i = (i + 1) % SPI_STREAM_BUFFERS) {
+		slot 	= &(stream->slots[i]);
+
+		pthread_mutex_lock(&(stream->lock));
+		while (!stream->bError && !stream->bSent && slot->state != SPI_STREAM_SLOT_FREE) {
+			pthread_cond_wait(&(stream->cond), &(stream->lock));
+		}
+		if (stream->bError || stream->bSent) {
+			pthread_mutex_unlock(&(stream->lock));
+			break;
+		}
+		pthread_mutex_unlock(&(stream->lock));
+
+		// a full chunk, unless the input ends
+		bytes 	= stream->chunkBytes;
+		if (stream->remaining >= 0 && stream->remaining < bytes) {
+			bytes 	= (int)stream->remaining;
+		}
+		if (stream->inFd >= 0 && bytes > 0) {
+			bytes 	= _spiStreamReadFull(stream->inFd, slot->txBuffer, bytes);
+		}
+
+		pthread_mutex_lock(&(stream->lock));
+		if (bytes < 0) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not read SPI stream input: %s\n", strerror(errno));
+			stream->bError 	= 1;
+		}
+		else {
+			if (stream->remaining >= 0) {
+				stream->remaining 	-= bytes;
+			}
+			if (bytes > 0) {
+				slot->bytes 	= bytes;
+				slot->state 	= SPI_STREAM_SLOT_FILLED;
+			}
+			stream->bEnd 	= (bytes < stream->chunkBytes || stream->remaining == 0);
+		}
+		pthread_cond_broadcast(&(stream->cond));
+		pthread_mutex_unlock(&(stream->lock));
+
+		if (bytes < 0 || stream->bEnd) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+// writer stage: write the received data of the sent slots in order
+void* _spiStreamWriter(void *arg)
+{
+	int 		i, status;
+	struct spiStream 		*stream;
+	struct spiStreamSlot 	*slot;
+
+	stream 	= (struct spiStream*)arg;
+
+	for (i = 0; ; i = (i + 1) % SPI_STREAM_BUFFERS) {
+		slot 	= &(stream->slots[i]);
+
+		// the bus stage is only done once its last slot is marked sent
+		pthread_mutex_lock(&(stream->lock));
+		while (!stream->bError && !stream->bSent && slot->state != SPI_STREAM_SLOT_SENT) {
+			pthread_cond_wait(&(stream->cond), &(stream->lock));
+		}
+		if (stream->bError || slot->state != SPI_STREAM_SLOT_SENT) {
+			pthread_mutex_unlock(&(stream->lock));
+			break;
+		}
+		pthread_mutex_unlock(&(stream->lock));
+
+		status 	= _spiStreamWriteFull(stream->outFd, slot->rxBuffer, slot->bytes);
+
+		pthread_mutex_lock(&(stream->lock));
+		if (status != EXIT_SUCCESS) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not write SPI stream output: %s\n", strerror(errno));
+			stream->bError 	= 1;
+		}
+		slot->state 	= SPI_STREAM_SLOT_FREE;
+		pthread_cond_broadcast(&(stream->cond));
+		pthread_mutex_unlock(&(stream->lock));
+	}
+
+	return NULL;
+}
+
+// read until the buffer is full or the input ends, returns the number of bytes read, -1 on error
+int _spiStreamReadFull(int fd, uint8_t *buffer, int bytes)
+{
+	int 	offset, res;
+
+	for (offset = 0; offset < bytes; offset += res) {
+		res 	= read(fd, buffer + offset, bytes - offset);
+		if (res < 0 && errno == EINTR) {
+			res 	= 0;
+		}
+		else if (res < 0) {
+			return -1;
+		}
+		else if (res == 0) {
+			break;
+		}
+	}
+
+	return offset;
+}
+
+int _spiStreamWriteFull(int fd, uint8_t *buffer, int bytes)
+{
+	int 	offset, res;
+
+	for (offset = 0; offset < bytes; offset += res) {
+		res 	= write(fd, buffer + offset, bytes - offset);
+		if (res < 0 && errno == EINTR) {
+			res 	= 0;
+		}
+		else if (res < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,225 @@
+#include <onion-spi-trace.h>
+
+// helper function prototypes
+int 	_spiTraceRead			(uint32_t index, struct spiTraceRecord *record);
+int 	_spiTraceWriteAll		(int fd, const void *buffer, size_t size);
+void 	_spiTraceSignalHandler	(int signum);
+
+
+// ring of the most recent messages
+//	writers claim a record with an atomic counter and publish it with its sequence number,
+//	readers copy a record and discard it if the sequence number changed meanwhile
+static struct spiTraceRecord 	_spiTraceRing[SPI_TRACE_RECORDS];
+static uint32_t 				_spiTraceHead 		= 0;
+static int 						_spiTraceEnabled 	= 1;
+
+// dump file used by the signal handler
+static char 					_spiTraceSignalPath[256];
+
+
+//// trace functions
+void spiTraceEnable(int bEnable)
+{
+	__atomic_store_n(&_spiTraceEnabled, bEnable, __ATOMIC_RELAXED);
+}
+
+uint64_t spiTraceGetTimeNs()
+{
+	struct timespec 	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// record one ioctl message, with the first SPI_TRACE_CAPTURE_BYTES of its data
+void spiTraceMessage(struct spiParams *params, struct spi_ioc_transfer *xfer, int numXfers, uint64_t startNs, uint64_t endNs, int status)
+{
+	int 		i, chunk;
+	uint32_t 	index, captured, bytes;
+	struct spiTraceRecord 	*record;
+
+	if (!__atomic_load_n(&_spiTraceEnabled, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	index 	= __atomic_fetch_add(&_spiTraceHead, 1, __ATOMIC_RELAXED);
+	record 	= &(_spiTraceRing[index & (SPI_TRACE_RECORDS - 1)]);
+
+	// mark the record as being written
+	__atomic_store_n(&(record->seq), index * 2 + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->index 		= index;
+	record->timestampNs = startNs;
+	record->durationNs 	= (uint32_t)(endNs - startNs);
+	record->status 		= status;
+	record->speedInHz 	= xfer[0].speed_hz;
+	record->busNum 		= (uint16_t)params->busNum;
+	record->deviceId 	= (uint16_t)params->deviceId;
+	record->numXfers 	= (uint16_t)numXfers;
+
+	// copy the start of the data, transfers without a buffer are recorded as zeroes
+	bytes 		= 0;
+	captured 	= 0;
+	for (i = 0; i < numXfers; i++) {
+		bytes 	+= xfer[i].len;
+
+		chunk 	= SPI_TRACE_CAPTURE_BYTES - captured;
+		if (chunk > (int)xfer[i].len) {
+			chunk 	= xfer[i].len;
+		}
+		if (chunk <= 0) {
+			continue;
+		}
+
+		if (xfer[i].tx_buf != 0) {
+			memcpy(&(record->tx[captured]), (void*)(uintptr_t)xfer[i].tx_buf, chunk);
+		}
+		else {
+			memset(&(record->tx[captured]), 0, chunk);
+		}
+
+		if (xfer[i].rx_buf != 0) {
+			memcpy(&(record->rx[captured]), (void*)(uintptr_t)xfer[i].rx_buf, chunk);
+		}
+		else {
+			memset(&(record->rx[captured]), 0, chunk);
+		}
+
+		captured 	+= chunk;
+	}
+	record->bytes 			= bytes;
+	record->capturedBytes 	= (uint16_t)captured;
+
+	// publish the record
+	__atomic_store_n(&(record->seq), index * 2 + 2, __ATOMIC_RELEASE);
+}
+
+// write the ring to a file, oldest record first
+//	only uses open, write, lseek and close, so it can run in a signal handler
+int spiTraceDump(const char *path)
+{
+	int 		fd, status, count;
+	uint32_t 	head, index;
+	struct spiTraceFileHeader 	header;
+	struct spiTraceRecord 		record;
+
+	fd 	= open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return EXIT_FAILURE;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SPI_TRACE_MAGIC, sizeof(header.magic));
+	header.version 		= SPI_TRACE_VERSION;
+	header.recordSize 	= sizeof(struct spiTraceRecord);
+	header.captureBytes = SPI_TRACE_CAPTURE_BYTES;
+
+	// the record count is filled in at the end
+	status 	= _spiTraceWriteAll(fd, &header, sizeof(header));
+
+	head 	= __atomic_load_n(&_spiTraceHead, __ATOMIC_ACQUIRE);
+	index 	= (head > SPI_TRACE_RECORDS ? head - SPI_TRACE_RECORDS : 0);
+	count 	= 0;
+
+	for ( ; index != head && status == EXIT_SUCCESS; index++) {
+		// records overwritten or still being written are skipped
+		if (_spiTraceRead(index, &record) == EXIT_SUCCESS) {
+			status 	= _spiTraceWriteAll(fd, &record, sizeof(record));
+			count++;
+		}
+	}
+
+	if (status == EXIT_SUCCESS) {
+		header.numRecords 	= count;
+		if (lseek(fd, 0, SEEK_SET) < 0) {
+			status 	= EXIT_FAILURE;
+		}
+		else {
+			status 	= _spiTraceWriteAll(fd, &header, sizeof(header));
+		}
+	}
+
+	close(fd);
+
+	return status;
+}
+
+// install a handler that dumps the ring when the signal is received
+int spiTraceDumpOnSignal(int signum, const char *path)
+{
+	struct sigaction 	action;
+
+	if (strlen(path) >= sizeof(_spiTraceSignalPath)) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI trace path is too long\n");
+		return EXIT_FAILURE;
+	}
+	strcpy(_spiTraceSignalPath, path);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler 	= _spiTraceSignalHandler;
+	action.sa_flags 	= SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	if (sigaction(signum, &action, NULL) < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not install SPI trace handler for signal %d\n", signum);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+
+//// helper functions ////
+// copy a record if it still holds message 'index' and is not being written
+int _spiTraceRead(uint32_t index, struct spiTraceRecord *record)
+{
+	uint32_t 	seq;
+	struct spiTraceRecord 	*source;
+
+	source 	= &(_spiTraceRing[index & (SPI_TRACE_RECORDS - 1)]);
+
+	seq 	= __atomic_load_n(&(source->seq), __ATOMIC_ACQUIRE);
+	if (seq != index * 2 + 2) {
+		return EXIT_FAILURE;
+	}
+
+	memcpy(record, source, sizeof(struct spiTraceRecord));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&(source->seq), __ATOMIC_RELAXED) != seq) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int _spiTraceWriteAll(int fd, const void *buffer, size_t size)
+{
+	ssize_t 	res;
+	const uint8_t 	*data 	= (const uint8_t*)buffer;
+
+	while (size > 0) {
+		res 	= write(fd, data, size);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res <= 0) {
+			return EXIT_FAILURE;
+		}
+		data 	+= res;
+		size 	-= res;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void _spiTraceSignalHandler(int signum)
+{
+	int 	savedErrno 	= errno;
+
+	spiTraceDump(_spiTraceSignalPath);
+
+	errno 	= savedErrno;
+}
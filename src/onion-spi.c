@@ -1,14 +1,90 @@
 #include <onion-spi.h>
+#include <onion-spi-trace.h>
+#include <onion-spi-stats.h>
+#include <onion-spi-arbiter.h>
 
 // helper function prototypes
 int 	_spiGetFd				(int busNum, int devId, int *devHandle, int printSeverity);
 int 	_spiReleaseFd			(int devHandle);
 
+int 	_spiAcquireFd			(struct spiParams *params, int *devHandle, int *bCached, int printSeverity);
+int 	_spiReturnFd			(struct spiParams *params, int devHandle, int bCached);
+
+int 	_spiSpidevOpen			(const struct spiBackend *backend, struct spiParams *params, int *handle);
+int 	_spiSpidevConfigure		(const struct spiBackend *backend, struct spiParams *params, int handle);
+int 	_spiSpidevTransfer		(const struct spiBackend *backend, struct spiParams *params, int handle, struct spi_ioc_transfer *xfer, int numXfers);
+int 	_spiSpidevClose			(const struct spiBackend *backend, struct spiParams *params, int handle);
+
+struct spiConfigCacheEntry;
+struct spiConfigCacheEntry* 	_spiGetConfig	(int busNum, int devId);
+
+int 	_spiFillTransfer		(struct spiParams *params, struct spiSegment *segment, struct spi_ioc_transfer *xfer);
+int 	_spiCheckNbits			(struct spiParams *params, int nbits, int dualBit, int quadBit, const char *direction);
+int 	_spiWordBytes			(int bitsPerWord);
+int 	_spiSubmitMessage		(struct spiParams *params, int fd, struct spi_ioc_transfer *xfer, int numXfers, int bMore);
+void 	_spiReadBufsiz			();
+
 int 	_spiRegisterDevice 		(int printSeverity, struct spiParams *params);
+int 	_spiModuleParams		(char *buffer, int size, struct spiParams *params);
+long 	_spiElapsedMs			(struct timespec *start);
 
 static void hex_dump(const void *src, size_t length, size_t line_size, char *prefix);
 
 
+// the Linux spidev driver, through /dev/spidevX.Y and ioctl
+const struct spiBackend spiSpidevBackend = {
+	"spidev",
+	_spiSpidevOpen,
+	_spiSpidevConfigure,
+	_spiSpidevTransfer,
+	_spiSpidevClose,
+	NULL
+};
+
+// used by params without a backend
+static const struct spiBackend 	*_spiDefaultBackend 	= &spiSpidevBackend;
+
+// device handles kept open between transfers, keyed by (backend, bus, device)
+struct spiFdCacheEntry {
+	const struct spiBackend 	*backend;
+	int 	busNum;
+	int 	deviceId;
+	int 	fd;
+};
+
+static struct spiFdCacheEntry	_spiFdCache[SPI_FD_CACHE_SIZE];
+static int 						_spiFdCacheCount	= 0;
+static pthread_mutex_t 			_spiFdCacheLock 	= PTHREAD_MUTEX_INITIALIZER;
+
+// loads the spi-gpio-custom module
+static spiModuleLoader 			_spiModuleLoader 	= spiLoadModule;
+
+// device configuration last applied by spiSetupDevice, keyed by (bus, device)
+//	the requested values are kept next to the values read back from the driver
+struct spiConfigCacheEntry {
+	int 	busNum;
+	int 	deviceId;
+	int 	bValid;
+
+	int 	reqModeBits;
+	int 	reqBitsPerWord;
+	int 	reqSpeedInHz;
+
+	int 	modeBits;
+	int 	bitsPerWord;
+	int 	speedInHz;
+};
+
+static struct spiConfigCacheEntry 	_spiConfigCache[SPI_FD_CACHE_SIZE];
+static int 							_spiConfigCacheCount 	= 0;
+static int 							_spiConfigCacheNext 	= 0;
+static pthread_mutex_t 				_spiConfigCacheLock 	= PTHREAD_MUTEX_INITIALIZER;
+
+// spidev buffer size: the most bytes in one SPI_IOC_MESSAGE
+static int 						_spiBufsiz 			= SPI_DEFAULT_BUFSIZ;
+static pthread_once_t 			_spiBufsizOnce 		= PTHREAD_ONCE_INIT;
+
+
 //// spi functions
 // initialize the parameter structure
 void spiParamInit(struct spiParams *params)
@@ -27,6 +103,13 @@ void spiParamInit(struct spiParams *params)
 	params->mosiGpio		= SPI_DEFAULT_GPIO_MOSI;
 	params->misoGpio		= SPI_DEFAULT_GPIO_MISO;
 	params->csGpio			= SPI_DEFAULT_GPIO_CS;
+
+	params->txNbits 		= 0;
+	params->rxNbits 		= 0;
+
+	params->fd 				= -1;
+	params->priority 		= SPI_PRIORITY_NORMAL;
+	params->backend 		= NULL;
 }
 
 // check if a device file handle is available
@@ -48,208 +131,534 @@ int spiCheckDevice(int busNum, int devId, int printSeverity)
 	return status;
 }
 
+// register several devices with a single module load
+int spiRegisterDevices (struct spiParams *params, int numDevices)
+{
+	int 	status, i, j, length, count, remaining;
+	int 	*bLoaded;
+	char 	moduleParams[SPI_MODULE_PARAMS_SIZE];
+	struct timespec 	start;
+
+	// devices registered by this module load
+	bLoaded 	= (int*)calloc(numDevices > 0 ? numDevices : 1, sizeof(int));
+	if (bLoaded == NULL) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not allocate SPI device list\n");
+		return EXIT_FAILURE;
+	}
+
+	length 	= 0;
+	count 	= 0;
+	moduleParams[0] 	= '\0';
+
+	for (i = 0; i < numDevices; i++) {
+		// skip devices that are already available
+		if (spiCheckDevice(params[i].busNum, params[i].deviceId, ONION_SEVERITY_DEBUG_EXTRA) == EXIT_SUCCESS) {
+			SPI_LOG(ONION_SEVERITY_INFO, "> SPI device on bus%d already available\n", params[i].busNum);
+			continue;
+		}
+
+		// the module takes one parameter per bus
+		for (j = 0; j < i; j++) {
+			if (params[j].busNum == params[i].busNum) {
+				SPI_LOG(ONION_SEVERITY_DEBUG, "ERROR: SPI bus%d listed more than once\n", params[i].busNum);
+				free(bLoaded);
+				return EXIT_FAILURE;
+			}
+		}
+
+		SPI_LOG(ONION_SEVERITY_INFO, "> Registering SPI device: bus%d, device id: %d\n", params[i].busNum, params[i].deviceId);
+
+		if (count > 0) {
+			moduleParams[length++] 	= ' ';
+		}
+		status 	= _spiModuleParams(&moduleParams[length], sizeof(moduleParams) - length, &params[i]);
+		if (status < 0) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: too many SPI devices for one module load\n");
+			free(bLoaded);
+			return EXIT_FAILURE;
+		}
+		length 	+= status;
+		count++;
+		bLoaded[i] 	= 1;
+	}
+
+	if (count == 0) {
+		free(bLoaded);
+		return EXIT_SUCCESS;
+	}
+
+	// load the module once for all buses
+	SPI_LOG(ONION_SEVERITY_DEBUG, ">> Module parameters:\n  %s\n", moduleParams);
+	if (_spiModuleLoader(SPI_MODULE_NAME, moduleParams) != EXIT_SUCCESS) {
+		free(bLoaded);
+		return EXIT_FAILURE;
+	}
+
+	// a new device starts from the driver defaults
+	for (i = 0; i < numDevices; i++) {
+		if (bLoaded[i]) {
+			spiInvalidateConfig(&params[i]);
+		}
+	}
+	free(bLoaded);
+
+	// wait for all device files, sharing one timeout
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	status 	= EXIT_SUCCESS;
+	for (i = 0; i < numDevices; i++) {
+		remaining 	= SPI_REGISTER_TIMEOUT_MS - (int)_spiElapsedMs(&start);
+		if (spiWaitForDevice(params[i].busNum, params[i].deviceId, (remaining > 0 ? remaining : 0)) != EXIT_SUCCESS) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI device on bus%d did not appear\n", params[i].busNum);
+			status 	= EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
+
+// select the module loader, for testing without root
+void spiSetModuleLoader (spiModuleLoader loader)
+{
+	_spiModuleLoader 	= (loader != NULL ? loader : spiLoadModule);
+}
+
+// load a kernel module without running insmod
+int spiLoadModule (const char *moduleName, const char *moduleParams)
+{
+	int 	status, fd;
+	char 	path[256];
+	struct utsname 	uts;
+
+	if (uname(&uts) < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not read the kernel release: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	snprintf(path, sizeof(path), SPI_MODULE_PATH_TEMPLATE, uts.release, moduleName);
+
+	fd 	= open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not open module '%s': %s\n", path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	status 	= syscall(SYS_finit_module, fd, moduleParams, 0);
+	close(fd);
+
+	if (status < 0) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not load module '%s': %s\n", moduleName, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// select the backend used by params without one, NULL restores the spidev backend
+void spiSetDefaultBackend (const struct spiBackend *backend)
+{
+	_spiDefaultBackend 	= (backend != NULL ? backend : &spiSpidevBackend);
+}
+
+// backend used for a device
+const struct spiBackend* spiGetBackend (struct spiParams *params)
+{
+	return (params->backend != NULL ? params->backend : _spiDefaultBackend);
+}
+
+// wait for the device file to appear
+//	watches the device directory with inotify and checks the device on every change,
+//	polls every SPI_REGISTER_POLL_MS if inotify is not available
+int spiWaitForDevice(int busNum, int devId, int timeoutMs)
+{
+	int 	status, inotifyFd, remaining;
+	char 	events[1024];
+	struct timespec 	start;
+	struct pollfd 		pfd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// watch before checking, so a device file created in between is not missed
+	inotifyFd 	= inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd >= 0 && inotify_add_watch(inotifyFd, SPI_DEV_DIR, IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0) {
+		close(inotifyFd);
+		inotifyFd 	= -1;
+	}
+	if (inotifyFd < 0) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "%s inotify not available, polling for the device\n", SPI_PRINT_BANNER);
+	}
+
+	while ( (status = spiCheckDevice(busNum, devId, ONION_SEVERITY_DEBUG_EXTRA)) == EXIT_FAILURE ) {
+		// find the time left
+		remaining 	= -1;
+		if (timeoutMs >= 0) {
+			remaining 	= timeoutMs - (int)_spiElapsedMs(&start);
+			if (remaining <= 0) {
+				break;
+			}
+		}
+
+		if (inotifyFd >= 0) {
+			pfd.fd 		= inotifyFd;
+			pfd.events 	= POLLIN;
+			if (poll(&pfd, 1, remaining) > 0) {
+				// drain the events, the device is checked again either way
+				while (read(inotifyFd, events, sizeof(events)) > 0) ;
+			}
+		}
+		else {
+			if (remaining < 0 || remaining > SPI_REGISTER_POLL_MS) {
+				remaining 	= SPI_REGISTER_POLL_MS;
+			}
+			usleep(remaining * 1000);
+		}
+	}
+
+	if (inotifyFd >= 0) {
+		close(inotifyFd);
+	}
+
+	if (status == EXIT_SUCCESS) {
+		SPI_LOG(ONION_SEVERITY_DEBUG, "%s device available after %ld ms\n", SPI_PRINT_BANNER, _spiElapsedMs(&start));
+	}
+
+	return status;
+}
+
 // check if a specific SPI device exists.
 //	if not, register it with sysfs
 // 	if it exists, do nothing
 int spiRegisterDevice (struct spiParams *params)
 {
-	int 	status;
+	return spiRegisterDeviceWait(params, SPI_REGISTER_TIMEOUT_MS, SPI_REGISTER_RETRIES);
+}
+
+int spiRegisterDeviceWait (struct spiParams *params, int timeoutMs, int retries)
+{
+	int 	status, attempt;
 
 	// check if device file is available
 	status	= spiCheckDevice(params->busNum, params->deviceId, ONION_SEVERITY_DEBUG_EXTRA);
 
-	if (status == EXIT_FAILURE) {
+	if (status == EXIT_SUCCESS) {
+		// device file exists - all good
+		SPI_LOG(ONION_SEVERITY_INFO, "> SPI device already available\n");
+		return EXIT_SUCCESS;
+	}
+
+	for (attempt = 0; attempt <= retries && status == EXIT_FAILURE; attempt++) {
 		// device file does not exist - register the spi device
-		status	= _spiRegisterDevice(ONION_SEVERITY_INFO, params);
+		status	= _spiRegisterDevice((attempt == 0 ? ONION_SEVERITY_INFO : ONION_SEVERITY_DEBUG), params);
+
+		// a new device starts from the driver defaults
+		spiInvalidateConfig(params);
 
 		// wait for device to be registered
-		usleep(500*1000);
+		if (status == EXIT_SUCCESS) {
+			status	= spiWaitForDevice(params->busNum, params->deviceId, timeoutMs);
+		}
 
-		// check that device file exists
-		status	= spiCheckDevice(params->busNum, params->deviceId, ONION_SEVERITY_DEBUG_EXTRA);
-	}
-	else if (status == EXIT_SUCCESS) {
-		// device file exists - all good
-		onionPrint(ONION_SEVERITY_INFO, "> SPI device already available\n");
+		if (status == EXIT_FAILURE) {
+			SPI_LOG(ONION_SEVERITY_DEBUG, "%s device not available after attempt %d\n", SPI_PRINT_BANNER, attempt+1);
+		}
 	}
 
 	return 	status;
 }
 
-// using ioctl, setup parameters of the SPI device interface
+// setup parameters of the SPI device interface through its backend
 int spiSetupDevice (struct spiParams *params)
 {
-	int 	status, ret, fd;
+	int 	status, fd, bCached;
 
 	// open the file handle
-	status 	= _spiGetFd(params->busNum, params->deviceId, &fd, ONION_SEVERITY_DEBUG_EXTRA);
+	status 	= _spiAcquireFd(params, &fd, &bCached, ONION_SEVERITY_DEBUG_EXTRA);
 
 	if (status == EXIT_SUCCESS) {
-		onionPrint(ONION_SEVERITY_INFO, "> Initializing SPI parameters...\n");
-		onionPrint(ONION_SEVERITY_INFO, "  > Set SPI mode:       0x%x\n", params->modeBits);
-		onionPrint(ONION_SEVERITY_INFO, "  > Set bits per word:  %d\n", params->bitsPerWord);
-		onionPrint(ONION_SEVERITY_INFO, "  > Set max speed:      %d Hz (%d KHz)\n", params->speedInHz, (params->speedInHz)/1000);
+		SPI_LOG(ONION_SEVERITY_INFO, "> Initializing SPI parameters...\n");
+		SPI_LOG(ONION_SEVERITY_INFO, "  > Set SPI mode:       0x%x\n", params->modeBits);
+		SPI_LOG(ONION_SEVERITY_INFO, "  > Set bits per word:  %d\n", params->bitsPerWord);
+		SPI_LOG(ONION_SEVERITY_INFO, "  > Set max speed:      %d Hz (%d KHz)\n", params->speedInHz, (params->speedInHz)/1000);
 
+		status 	= spiGetBackend(params)->configure(spiGetBackend(params), params, fd);
 
-		// set the SPI mode
-		ret = ioctl(fd, SPI_IOC_WR_MODE32, &(params->modeBits) );
-		if (ret == -1) {
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set SPI mode 0x%02x\n", params->modeBits);
-			return EXIT_FAILURE;
-		}
-		
-		ret = ioctl(fd, SPI_IOC_RD_MODE32, &(params->modeBits) );
-		if (ret == -1){
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set SPI mode 0x%02x\n", params->modeBits);
-			return EXIT_FAILURE;
-		}
+		// clean-up
+		status 	|= _spiReturnFd(params, fd, bCached);
+	}
 
-		// set the bits per word
-		ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &(params->bitsPerWord) );
-		if (ret == -1) {
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set %d bits per word\n", params->bitsPerWord);
-			return EXIT_FAILURE;
-		}
-		
-		ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &(params->bitsPerWord) );
-		if (ret == -1) {
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set %d bits per word\n", params->bitsPerWord);
-			return EXIT_FAILURE;
-		}
-		
-		// set max speed in Hz
-		ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &(params->speedInHz) );
-		if (ret == -1) {
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set max speed %d Hz\n", params->speedInHz);
-			return EXIT_FAILURE;
-		}
-		
-		ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &(params->speedInHz) );
-		if (ret == -1) {
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: Cannot set max speed %d Hz\n", params->speedInHz);
-			return EXIT_FAILURE;
-		}
+	return 	status;
+}
 
-		// clean-up
-		status 	|= _spiReleaseFd(fd);
+// forget the configuration recorded by spiSetupDevice,
+//	the next setup sends every value again
+void spiInvalidateConfig (struct spiParams *params)
+{
+	pthread_mutex_lock(&_spiConfigCacheLock);
+	_spiGetConfig(params->busNum, params->deviceId)->bValid 	= 0;
+	pthread_mutex_unlock(&_spiConfigCacheLock);
+}
+
+// open the device file handle and keep it in the params structure
+//	all transfers made with these params will use this handle
+int spiOpenDevice (struct spiParams *params)
+{
+	int 	status;
+
+	if (params->fd >= 0) {
+		// already open
+		return EXIT_SUCCESS;
+	}
+
+	status 	= spiGetBackend(params)->open(spiGetBackend(params), params, &(params->fd));
+	if (status != EXIT_SUCCESS) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: could not open %s device %d.%d\n", spiGetBackend(params)->name, params->busNum, params->deviceId);
+		params->fd 	= -1;
+	}
+
+	return 	status;
+}
+
+// close the device file handle opened with spiOpenDevice
+int spiCloseDevice (struct spiParams *params)
+{
+	int 	status;
+
+	if (params->fd < 0) {
+		// nothing to close
+		return EXIT_SUCCESS;
 	}
 
+	status 		= spiGetBackend(params)->close(spiGetBackend(params), params, params->fd);
+	params->fd 	= -1;
+
 	return 	status;
 }
 
+// close all file handles held in the cache
+//	must not be called while other threads are in the middle of a transfer
+void spiReleaseFdCache ()
+{
+	int 	i;
+	struct spiParams 	params;
+
+	pthread_mutex_lock(&_spiFdCacheLock);
+
+	for (i = 0; i < _spiFdCacheCount; i++) {
+		spiParamInit(&params);
+		params.busNum 		= _spiFdCache[i].busNum;
+		params.deviceId 	= _spiFdCache[i].deviceId;
+		params.backend 		= _spiFdCache[i].backend;
+
+		_spiFdCache[i].backend->close(_spiFdCache[i].backend, &params, _spiFdCache[i].fd);
+	}
+	_spiFdCacheCount 	= 0;
+
+	pthread_mutex_unlock(&_spiFdCacheLock);
+}
+
 // perform a transfer
 int spiTransfer(struct spiParams *params, uint8_t *txBuffer, uint8_t *rxBuffer, int bytes)
 {
-	int 	status;
-	int 	fd, res;
-	struct 	spi_ioc_transfer xfer;
+	int 				status;
+	struct spiSegment 	segment;
 
-	res 	= EXIT_FAILURE;
+	// a single segment that uses the transfer parameters from params
+	memset(&segment, 0, sizeof(segment));
+	segment.txBuffer 	= txBuffer;
+	segment.rxBuffer 	= rxBuffer;
+	segment.bytes 		= bytes;
 
-	// open the file handle
-	status 	= _spiGetFd(params->busNum, params->deviceId, &fd, ONION_SEVERITY_FATAL);
+	status 	= spiTransferSegments(params, &segment, 1);
+
+	if (status != EXIT_SUCCESS && rxBuffer != NULL) {
+		*rxBuffer 	= 0;
+	}
+
+	return status;
+}
+
+// perform a multi-segment transfer
+//	the device stays selected across all segments unless a segment sets csChange
+//	segments are packed into as few ioctl calls as the spidev buffer size allows,
+//	longer segments are split, and the device is kept selected between the calls
+//	the bus is held for the whole transfer, except after a csChange segment if a higher priority class is waiting,
+//	and after the transfer while a csChange on the last segment keeps the device selected
+int spiTransferSegments(struct spiParams *params, struct spiSegment *segments, int numSegments)
+{
+	int 	status, i;
+	int 	fd, bCached;
+	int 	numXfers, msgBytes, maxBytes, wordBytes, offset, chunk;
+	uint64_t 	startNs;
+	struct 	spi_ioc_transfer 	xfer[SPI_MESSAGE_MAX_XFERS];
+
+	startNs 	= spiTraceGetTimeNs();
+
+	if (numSegments < 1) {
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: invalid number of SPI segments: %d\n", numSegments);
+		return EXIT_FAILURE;
+	}
+
+	maxBytes 	= spiGetMaxTransferSize();
+
+	// get the file handle
+	status 	= _spiAcquireFd(params, &fd, &bCached, ONION_SEVERITY_FATAL);
 
 	// attempt the SPI transfter
 	if (status == EXIT_SUCCESS) {
-		
-		memset(&xfer, 0, sizeof(xfer));
-		xfer.tx_buf 			= (unsigned long)txBuffer;
-		xfer.rx_buf 			= (unsigned long)rxBuffer;
-		xfer.len 			= bytes;
-		xfer.speed_hz 		= params->speedInHz;
-        xfer.delay_usecs 	= params->delayInUs;
-        xfer.bits_per_word 	= params->bitsPerWord;
-        xfer.cs_change 		= 0;
-
-		/*if (params->mode & SPI_TX_QUAD)
-			xfer.tx_nbits = 4;
-		else if (params->mode & SPI_TX_DUAL)
-			xfer.tx_nbits = 2;
-		if (params->mode & SPI_RX_QUAD)
-			xfer.rx_nbits = 4;
-		else if (params->mode & SPI_RX_DUAL)
-			xfer.rx_nbits = 2;
-		if (!(params->mode & SPI_LOOP)) {
-			if (params->mode & (SPI_TX_QUAD | SPI_TX_DUAL))
-				xfer.rx_buf = 0;
-			else if (params->mode & (SPI_RX_QUAD | SPI_RX_DUAL))
-				xfer.tx_buf = 0;
-		}*/
-
-		onionPrint(ONION_SEVERITY_DEBUG, "%s Trasferring 0x%02x, %d byte%s\n", SPI_PRINT_BANNER, *txBuffer, bytes, (bytes > 1 ? "s" : "") );
-
-		// make the transfer
-		res = ioctl(fd, SPI_IOC_MESSAGE(1), &xfer);
-
-		// check the return
-		if (res < 1) {
-			// send failed
-			onionPrint(ONION_SEVERITY_FATAL, "ERROR: SPI transfer failed\n");
-			*rxBuffer 	= 0;
-			status	= EXIT_FAILURE;
+		numXfers 	= 0;
+		msgBytes 	= 0;
+
+		spiArbiterAcquire(params);
+
+		for (i = 0; i < numSegments && status == EXIT_SUCCESS; i++) {
+			// the device was deselected after the previous segment, a higher priority class can go first
+			//	bulk transfers end their message here, so the wait is at most one segment
+			if (i > 0 && segments[i-1].csChange) {
+				if (numXfers > 0 && (params->priority == SPI_PRIORITY_BULK || spiArbiterShouldYield(params)) ) {
+					status 		= _spiSubmitMessage(params, fd, xfer, numXfers, 1);
+					numXfers 	= 0;
+					msgBytes 	= 0;
+
+					if (status != EXIT_SUCCESS) {
+						break;
+					}
+				}
+				if (numXfers == 0 && spiArbiterShouldYield(params)) {
+					spiArbiterYield(params);
+				}
+			}
+
+			SPI_LOG(ONION_SEVERITY_DEBUG, "%s Trasferring 0x%02x, %d byte%s\n", SPI_PRINT_BANNER, (segments[i].txBuffer != NULL ? *(segments[i].txBuffer) : 0), segments[i].bytes, (segments[i].bytes > 1 ? "s" : "") );
+
+			wordBytes 	= _spiWordBytes(segments[i].bitsPerWord > 0 ? segments[i].bitsPerWord : params->bitsPerWord);
+			offset 		= 0;
+
+			do {
+				// send the message once it is full, more will follow
+				if (	numXfers == SPI_MESSAGE_MAX_XFERS ||
+						(segments[i].bytes > offset && maxBytes - msgBytes < wordBytes)
+					)
+				{
+					status 		= _spiSubmitMessage(params, fd, xfer, numXfers, 1);
+					numXfers 	= 0;
+					msgBytes 	= 0;
+
+					if (status != EXIT_SUCCESS) {
+						break;
+					}
+				}
+
+				// add as much of the segment as fits, in whole words
+				chunk 	= segments[i].bytes - offset;
+				if (chunk > maxBytes - msgBytes) {
+					chunk 	= ((maxBytes - msgBytes) / wordBytes) * wordBytes;
+				}
+
+				memset(&xfer[numXfers], 0, sizeof(struct spi_ioc_transfer));
+				status 	= _spiFillTransfer(params, &segments[i], &xfer[numXfers]);
+				if (status != EXIT_SUCCESS) {
+					break;
+				}
+
+				if (segments[i].txBuffer != NULL) 	xfer[numXfers].tx_buf 	+= offset;
+				if (segments[i].rxBuffer != NULL) 	xfer[numXfers].rx_buf 	+= offset;
+				xfer[numXfers].len 	= chunk;
+
+				offset 		+= chunk;
+				msgBytes 	+= chunk;
+
+				// the delay and chip select change only apply after the end of the segment
+				if (offset < segments[i].bytes) {
+					xfer[numXfers].delay_usecs 	= 0;
+					xfer[numXfers].cs_change 	= 0;
+				}
+				numXfers++;
+			} while (offset < segments[i].bytes);
 		}
 
-		onionPrint(ONION_SEVERITY_DEBUG, "   Received: 0x%02x, ioctl status: %d\n", *rxBuffer, res);
+		// send the rest
+		if (status == EXIT_SUCCESS && numXfers > 0) {
+			status 	= _spiSubmitMessage(params, fd, xfer, numXfers, 0);
+		}
 
-		if (status == EXIT_SUCCESS && onionGetVerbosity() > ONION_SEVERITY_DEBUG ) {
-			hex_dump(txBuffer, bytes, 32, "TX");
-			hex_dump(rxBuffer, bytes, 32, "RX");
+		// a device left selected keeps the bus until the call that deselects it
+		spiArbiterRelease(params, (status == EXIT_SUCCESS && segments[numSegments-1].csChange));
+
+		if (status == EXIT_SUCCESS && SPI_LOG_ENABLED(ONION_SEVERITY_DEBUG_EXTRA) ) {
+			for (i = 0; i < numSegments; i++) {
+				if (segments[i].txBuffer != NULL) {
+					hex_dump(segments[i].txBuffer, segments[i].bytes, 32, "TX");
+				}
+				if (segments[i].rxBuffer != NULL) {
+					hex_dump(segments[i].rxBuffer, segments[i].bytes, 32, "RX");
+				}
+			}
 		}
 
 		// clean-up
-		status 	|= _spiReleaseFd(fd);
+		status 	|= _spiReturnFd(params, fd, bCached);
 	}
 
+	spiStatsTransfer(params, spiTraceGetTimeNs() - startNs, status);
+
 	return status;
 }
 
-int spiWrite(struct spiParams *params, int addr, uint8_t *wrBuffer, int bytes)
+// find the largest number of bytes spidev accepts in one ioctl call
+//	read once from the spidev module parameters
+int spiGetMaxTransferSize()
 {
-	int 		status, i;
-	uint8_t 	*txBuffer;
-	uint8_t 	*rxBuffer;
+	pthread_once(&_spiBufsizOnce, _spiReadBufsiz);
 
-	// generate the transmission buffer
-	txBuffer	= (uint8_t*)malloc(sizeof(uint8_t) * (1+bytes) );
-	rxBuffer 	= (uint8_t*)malloc(sizeof(uint8_t) * (1+bytes) );
+	return _spiBufsiz;
+}
 
-	// load the address
-	txBuffer[0] = (uint8_t)addr;
+// write data to a register: the address and the data are sent as two segments
+int spiWrite(struct spiParams *params, int addr, uint8_t *wrBuffer, int bytes)
+{
+	uint8_t 			addrByte;
+	struct spiSegment 	segments[2];
 
-	// load the data to write
-	for (i = 0; i < bytes; i++) {
-		txBuffer[i+1] 	= wrBuffer[i];
-	}
+	addrByte 	= (uint8_t)addr;
 
-	// call the transfer
-	status 	= spiTransfer(params, txBuffer, rxBuffer, bytes+1);
+	memset(segments, 0, sizeof(segments));
 
-	// clean-up
-	free(txBuffer);
-	free(rxBuffer);
+	// address phase, always on a single wire
+	segments[0].txBuffer 	= &addrByte;
+	segments[0].bytes 		= 1;
+	segments[0].txNbits 	= 1;
+	segments[0].rxNbits 	= 1;
+	// the delay comes once, after the data
+	segments[0].delayInUs 	= (bytes > 0 ? SPI_SEGMENT_NO_DELAY : 0);
 
-	return 	status;
+	// data phase, sent straight from the caller's buffer
+	segments[1].txBuffer 	= wrBuffer;
+	segments[1].bytes 		= bytes;
+
+	return 	spiTransferSegments(params, segments, (bytes > 0 ? 2 : 1));
 }
 
+// read data from a register: the address is sent, then the data is received into rdBuffer
 int spiRead(struct spiParams *params, int addr, uint8_t *rdBuffer, int bytes)
 {
-	int 		status, i;
-	uint8_t 	*txBuffer;
-	uint8_t 	*rxBuffer;
+	uint8_t 			addrByte;
+	struct spiSegment 	segments[2];
 
-	// generate the transmission buffer
-	txBuffer	= (uint8_t*)malloc(sizeof(uint8_t) * 1 );
+	addrByte 	= (uint8_t)addr;
 
-	// load the address
-	*txBuffer 	= (uint8_t)addr;
+	memset(segments, 0, sizeof(segments));
 
-	// call the transfer
-	status 	= spiTransfer(params, txBuffer, rdBuffer, bytes);
+	// address phase, always on a single wire
+	segments[0].txBuffer 	= &addrByte;
+	segments[0].bytes 		= 1;
+	segments[0].txNbits 	= 1;
+	segments[0].rxNbits 	= 1;
+	// the delay comes once, after the data
+	segments[0].delayInUs 	= (bytes > 0 ? SPI_SEGMENT_NO_DELAY : 0);
 
-	// clean-up
-	free(txBuffer);
+	// data phase, received straight into the caller's buffer
+	segments[1].rxBuffer 	= rdBuffer;
+	segments[1].bytes 		= bytes;
 
-	return 	status;
+	return 	spiTransferSegments(params, segments, (bytes > 0 ? 2 : 1));
 }
 
 
@@ -271,7 +680,7 @@ int _spiGetFd(int busNum, int devId, int *devHandle, int printSeverity)
 
 	// create a file descriptor for the I2C bus
 	if ( (*devHandle = open(pathname, O_RDWR)) < 0) {
-		onionPrint(printSeverity, "ERROR: could not open sysfs device '%s'\n", pathname);
+		SPI_LOG(printSeverity, "ERROR: could not open sysfs device '%s'\n", pathname);
 		return 	EXIT_FAILURE;
 	}
 
@@ -288,65 +697,417 @@ int _spiReleaseFd(int devHandle)
 	return EXIT_SUCCESS;
 }
 
-// register an SPI device
-int _spiRegisterDevice (int printSeverity, struct spiParams *params)
+// find the configuration entry of a device, reusing the oldest entry when full
+//	must be called with _spiConfigCacheLock held
+struct spiConfigCacheEntry* _spiGetConfig(int busNum, int devId)
 {
-	int 	status;
-	char 	cmd[256];
-
-	onionPrint(printSeverity, "> Registering SPI device:\n");
-	onionPrint(printSeverity, "  > bus%d, device id: %d\n", params->busNum, params->deviceId);
-	onionPrint(printSeverity, "   > SCK:  GPIO%d\n", params->sckGpio);
-	onionPrint(printSeverity, "   > MOSI: GPIO%d\n", params->mosiGpio);
-	onionPrint(printSeverity, "   > MISO: GPIO%d\n", params->misoGpio);
-	onionPrint(printSeverity, "   > CS:   GPIO%d\n", params->csGpio);
-	onionPrint(printSeverity, "  > SPI Mode:      %d\n", params->mode);
-	onionPrint(printSeverity, "  > Max Frequency: %d Hz (%d kHz)\n", params->speedInHz, (params->speedInHz)/1000);
-
-	// generate the insmod command
-	sprintf(cmd, SPI_DEV_INSMOD_TEMPLATE, 	params->busNum, params->deviceId,
-											params->sckGpio,
-											params->mosiGpio,
-											params->misoGpio,
-											params->mode,
-											params->speedInHz,
-											params->csGpio
-			);
-	onionPrint(printSeverity+1, ">> Command:\n  %s\n", cmd);  
-
-	// call the insmod command to register an SPI device
-	status 	= system(cmd);
-	if (status < 0) {
+	int 	i;
+	struct spiConfigCacheEntry 	*entry;
+
+	for (i = 0; i < _spiConfigCacheCount; i++) {
+		if (_spiConfigCache[i].busNum == busNum && _spiConfigCache[i].deviceId == devId) {
+			return &(_spiConfigCache[i]);
+		}
+	}
+
+	if (_spiConfigCacheCount < SPI_FD_CACHE_SIZE) {
+		entry 	= &(_spiConfigCache[_spiConfigCacheCount++]);
+	}
+	else {
+		entry 	= &(_spiConfigCache[_spiConfigCacheNext]);
+		_spiConfigCacheNext 	= (_spiConfigCacheNext + 1) % SPI_FD_CACHE_SIZE;
+	}
+
+	memset(entry, 0, sizeof(struct spiConfigCacheEntry));
+	entry->busNum 		= busNum;
+	entry->deviceId 	= devId;
+
+	return entry;
+}
+
+// get a file handle for a transfer:
+//	the handle from spiOpenDevice if there is one,
+//	otherwise a handle from the cache, opening and caching it on first use
+//	if the cache is full, a new handle is opened and *bCached is set to 0
+int _spiAcquireFd(struct spiParams *params, int *devHandle, int *bCached, int printSeverity)
+{
+	int 	status, i;
+	const struct spiBackend 	*backend;
+
+	// handle opened by the caller
+	if (params->fd >= 0) {
+		*devHandle 	= params->fd;
+		*bCached 	= 1;
+		return EXIT_SUCCESS;
+	}
+
+	backend 	= spiGetBackend(params);
+
+	pthread_mutex_lock(&_spiFdCacheLock);
 
+	// look for a cached handle
+	for (i = 0; i < _spiFdCacheCount; i++) {
+		if (	_spiFdCache[i].backend == backend &&
+				_spiFdCache[i].busNum == params->busNum && _spiFdCache[i].deviceId == params->deviceId
+			)
+		{
+			*devHandle 	= _spiFdCache[i].fd;
+			*bCached 	= 1;
+			pthread_mutex_unlock(&_spiFdCacheLock);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	// open a new handle
+	status 		= backend->open(backend, params, devHandle);
+	*bCached 	= 0;
+
+	if (status != EXIT_SUCCESS) {
+		SPI_LOG(printSeverity, "ERROR: could not open %s device %d.%d\n", backend->name, params->busNum, params->deviceId);
+	}
+	else if (_spiFdCacheCount < SPI_FD_CACHE_SIZE) {
+		_spiFdCache[_spiFdCacheCount].backend 	= backend;
+		_spiFdCache[_spiFdCacheCount].busNum 	= params->busNum;
+		_spiFdCache[_spiFdCacheCount].deviceId 	= params->deviceId;
+		_spiFdCache[_spiFdCacheCount].fd 		= *devHandle;
+		_spiFdCacheCount++;
+		*bCached 	= 1;
+	}
+
+	pthread_mutex_unlock(&_spiFdCacheLock);
+
+	return status;
+}
+
+// return a handle obtained from _spiAcquireFd
+int _spiReturnFd(struct spiParams *params, int devHandle, int bCached)
+{
+	if (bCached) {
+		// stays open for the next transfer
+		return EXIT_SUCCESS;
+	}
+
+	return spiGetBackend(params)->close(spiGetBackend(params), params, devHandle);
+}
+
+//// spidev backend ////
+int _spiSpidevOpen(const struct spiBackend *backend, struct spiParams *params, int *handle)
+{
+	return _spiGetFd(params->busNum, params->deviceId, handle, ONION_SEVERITY_DEBUG);
+}
+
+// using ioctl, setup parameters of the SPI device interface
+//	only values that differ from the last setup are sent to the device
+int _spiSpidevConfigure(const struct spiBackend *backend, struct spiParams *params, int fd)
+{
+	int 	status, ret;
+	struct spiConfigCacheEntry 	*config;
+
+	status 	= EXIT_SUCCESS;
+
+	pthread_mutex_lock(&_spiConfigCacheLock);
+	config 	= _spiGetConfig(params->busNum, params->deviceId);
+
+	// set the SPI mode
+	if (config->bValid && config->reqModeBits == params->modeBits) {
+		params->modeBits 	= config->modeBits;
+	}
+	else {
+		config->reqModeBits = params->modeBits;
+
+		ret = ioctl(fd, SPI_IOC_WR_MODE32, &(params->modeBits) );
+		if (ret != -1) {
+			ret = ioctl(fd, SPI_IOC_RD_MODE32, &(params->modeBits) );
+		}
+		if (ret == -1) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: Cannot set SPI mode 0x%02x\n", params->modeBits);
+			status 	= EXIT_FAILURE;
+		}
+		config->modeBits 	= params->modeBits;
+	}
+
+	// set the bits per word
+	if (status == EXIT_SUCCESS && config->bValid && config->reqBitsPerWord == params->bitsPerWord) {
+		params->bitsPerWord 	= config->bitsPerWord;
+	}
+	else if (status == EXIT_SUCCESS) {
+		config->reqBitsPerWord 	= params->bitsPerWord;
+
+		ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &(params->bitsPerWord) );
+		if (ret != -1) {
+			ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &(params->bitsPerWord) );
+		}
+		if (ret == -1) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: Cannot set %d bits per word\n", params->bitsPerWord);
+			status 	= EXIT_FAILURE;
+		}
+		config->bitsPerWord 	= params->bitsPerWord;
+	}
+
+	// set max speed in Hz
+	if (status == EXIT_SUCCESS && config->bValid && config->reqSpeedInHz == params->speedInHz) {
+		params->speedInHz 	= config->speedInHz;
+	}
+	else if (status == EXIT_SUCCESS) {
+		config->reqSpeedInHz 	= params->speedInHz;
+
+		ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &(params->speedInHz) );
+		if (ret != -1) {
+			ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &(params->speedInHz) );
+		}
+		if (ret == -1) {
+			SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: Cannot set max speed %d Hz\n", params->speedInHz);
+			status 	= EXIT_FAILURE;
+		}
+		config->speedInHz 		= params->speedInHz;
+	}
+
+	// the entry is only trusted once every value has been applied
+	config->bValid 	= (status == EXIT_SUCCESS);
+	pthread_mutex_unlock(&_spiConfigCacheLock);
+
+	return status;
+}
+
+int _spiSpidevTransfer(const struct spiBackend *backend, struct spiParams *params, int fd, struct spi_ioc_transfer *xfer, int numXfers)
+{
+	return ioctl(fd, SPI_IOC_MESSAGE(numXfers), xfer);
+}
+
+int _spiSpidevClose(const struct spiBackend *backend, struct spiParams *params, int fd)
+{
+	return _spiReleaseFd(fd);
+}
+
+// populate the kernel transfer structure for a segment
+//	speed, delay, bits per word and bus widths fall back to the params values when not set in the segment
+int _spiFillTransfer(struct spiParams *params, struct spiSegment *segment, struct spi_ioc_transfer *xfer)
+{
+	int 	txNbits, rxNbits;
+
+	xfer->tx_buf 			= (unsigned long)segment->txBuffer;
+	xfer->rx_buf 			= (unsigned long)segment->rxBuffer;
+	xfer->len 				= segment->bytes;
+	xfer->speed_hz 			= (segment->speedInHz > 0 	? segment->speedInHz 	: params->speedInHz);
+	xfer->delay_usecs 		= (segment->delayInUs > 0 	? segment->delayInUs 	: params->delayInUs);
+	xfer->bits_per_word 	= (segment->bitsPerWord > 0 	? segment->bitsPerWord 	: params->bitsPerWord);
+	xfer->cs_change 		= (segment->csChange ? 1 : 0);
+
+	if (segment->delayInUs == SPI_SEGMENT_NO_DELAY) {
+		xfer->delay_usecs 	= 0;
+	}
+
+	// bus width of each direction
+	txNbits 	= (segment->txNbits > 0 	? segment->txNbits 	: params->txNbits);
+	rxNbits 	= (segment->rxNbits > 0 	? segment->rxNbits 	: params->rxNbits);
+
+	if (	_spiCheckNbits(params, txNbits, SPI_TX_DUAL, SPI_TX_QUAD, "transmit") != EXIT_SUCCESS ||
+			_spiCheckNbits(params, rxNbits, SPI_RX_DUAL, SPI_RX_QUAD, "receive") != EXIT_SUCCESS
+		)
+	{
+		return EXIT_FAILURE;
+	}
+
+	// dual and quad phases are half-duplex, the data lines only go one way
+	if (	(txNbits > 1 || rxNbits > 1) &&
+			segment->txBuffer != NULL && segment->rxBuffer != NULL &&
+			!(params->modeBits & SPI_LOOP)
+		)
+	{
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: dual/quad SPI segments cannot both transmit and receive\n");
+		return EXIT_FAILURE;
+	}
+
+	xfer->tx_nbits 		= (txNbits > 1 ? txNbits : 0);
+	xfer->rx_nbits 		= (rxNbits > 1 ? rxNbits : 0);
+
+	return EXIT_SUCCESS;
+}
+
+// check that a bus width is valid and enabled in the mode bits
+int _spiCheckNbits(struct spiParams *params, int nbits, int dualBit, int quadBit, const char *direction)
+{
+	if (nbits == 0 || nbits == 1) {
+		return EXIT_SUCCESS;
+	}
+
+	if (	(nbits == 2 && (params->modeBits & (dualBit | quadBit)) ) ||
+			(nbits == 4 && (params->modeBits & quadBit) )
+		)
+	{
+		return EXIT_SUCCESS;
+	}
+
+	SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: cannot %s on %d wires with SPI mode 0x%x\n", direction, nbits, params->modeBits);
+	return EXIT_FAILURE;
+}
+
+// number of bytes used by each word
+int _spiWordBytes(int bitsPerWord)
+{
+	if (bitsPerWord > 16) {
+		return 4;
+	}
+	if (bitsPerWord > 8) {
+		return 2;
+	}
+	return 1;
+}
+
+// send one SPI_IOC_MESSAGE
+//	bMore: another message of the same transaction follows
+//	cs_change on the last transfer of a message means the opposite of cs_change on any other transfer:
+//	it keeps the device selected once the message is done, so it is flipped when more will follow
+int _spiSubmitMessage(struct spiParams *params, int fd, struct spi_ioc_transfer *xfer, int numXfers, int bMore)
+{
+	int 		res, error;
+	uint64_t 	startNs, endNs;
+
+	if (bMore) {
+		xfer[numXfers-1].cs_change 	= !xfer[numXfers-1].cs_change;
+	}
+
+	// make the transfer
+	startNs = spiTraceGetTimeNs();
+	res = spiGetBackend(params)->transfer(spiGetBackend(params), params, fd, xfer, numXfers);
+	error 	= (res < 0 ? errno : 0);
+	endNs 	= spiTraceGetTimeNs();
+
+	spiTraceMessage(params, xfer, numXfers, startNs, endNs, (res < 0 ? -error : res));
+	spiStatsMessage(params, xfer, numXfers, endNs - startNs, error);
+
+	SPI_LOG(ONION_SEVERITY_DEBUG, "   %d transfer%s, ioctl status: %d\n", numXfers, (numXfers > 1 ? "s" : ""), res);
+
+	// check the return
+	if (res < 0) {
+		// send failed
+		SPI_LOG(ONION_SEVERITY_FATAL, "ERROR: SPI transfer failed\n");
 		return EXIT_FAILURE;
 	}
 
-	return 	EXIT_SUCCESS;
+	return EXIT_SUCCESS;
+}
+
+// read the spidev buffer size module parameter
+void _spiReadBufsiz()
+{
+	FILE 	*fp;
+	int 	value;
+
+	fp 	= fopen(SPI_BUFSIZ_PATH, "r");
+	if (fp == NULL) {
+		return;
+	}
+
+	if (fscanf(fp, "%d", &value) == 1 && value > 0) {
+		_spiBufsiz 	= value;
+	}
+
+	fclose(fp);
+}
+
+// register an SPI device
+int _spiRegisterDevice (int printSeverity, struct spiParams *params)
+{
+	char 	moduleParams[SPI_MODULE_PARAMS_SIZE];
+
+	SPI_LOG(printSeverity, "> Registering SPI device:\n");
+	SPI_LOG(printSeverity, "  > bus%d, device id: %d\n", params->busNum, params->deviceId);
+	SPI_LOG(printSeverity, "   > SCK:  GPIO%d\n", params->sckGpio);
+	SPI_LOG(printSeverity, "   > MOSI: GPIO%d\n", params->mosiGpio);
+	SPI_LOG(printSeverity, "   > MISO: GPIO%d\n", params->misoGpio);
+	SPI_LOG(printSeverity, "   > CS:   GPIO%d\n", params->csGpio);
+	SPI_LOG(printSeverity, "  > SPI Mode:      %d\n", params->mode);
+	SPI_LOG(printSeverity, "  > Max Frequency: %d Hz (%d kHz)\n", params->speedInHz, (params->speedInHz)/1000);
+
+	// generate the module parameters
+	_spiModuleParams(moduleParams, sizeof(moduleParams), params);
+	SPI_LOG(printSeverity+1, ">> Module parameters:\n  %s\n", moduleParams);
+
+	// load the module to register an SPI device
+	return 	_spiModuleLoader(SPI_MODULE_NAME, moduleParams);
 }
 
+// write the module parameter for one bus, returns its length or -1 if it does not fit
+int _spiModuleParams (char *buffer, int size, struct spiParams *params)
+{
+	int 	length;
+
+	length 	= snprintf(buffer, size, SPI_MODULE_PARAM_TEMPLATE, 	params->busNum, params->deviceId,
+																	params->sckGpio,
+																	params->mosiGpio,
+																	params->misoGpio,
+																	params->mode,
+																	params->speedInHz,
+																	params->csGpio
+				);
+
+	return (length < 0 || length >= size) ? -1 : length;
+}
+
+// milliseconds since start, on the monotonic clock
+long _spiElapsedMs(struct timespec *start)
+{
+	struct timespec 	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// format the dump into one buffer and write it with a single call
 static void hex_dump(const void *src, size_t length, size_t line_size, char *prefix)
 {
-        int i = 0;
-        const unsigned char *address = src;
-        const unsigned char *line = address;
-        unsigned char c;
-
-        printf("%s | ", prefix);
-        while (length-- > 0) {
-                printf("%02X ", *address++);
-                if (!(++i % line_size) || (length == 0 && i % line_size)) {
-                        if (length == 0) {
-                                while (i++ % line_size)
-                                        printf("__ ");
-                        }
-                        printf(" | ");  /* right close */
-                        while (line < address) {
-                                c = *line++;
-                                printf("%c", (c < 33 || c == 255) ? 0x2E : c);
-                        }
-                        printf("\n");
-                        if (length > 0)
-                                printf("%s | ", prefix);
-                }
-        }
+	static const char 	hexDigits[] = "0123456789ABCDEF";
+
+	size_t 		i, j, lines, prefixLength;
+	char 		*buffer, *out;
+	unsigned char 	c;
+	const unsigned char 	*address = src;
+
+	if (length == 0 || line_size == 0) {
+		return;
+	}
+
+	// each line: "<prefix> | " + "XX " per byte + " | " + one char per byte + "\n"
+	prefixLength 	= strlen(prefix);
+	lines 			= (length + line_size - 1) / line_size;
+	buffer 			= (char*)malloc(lines * (prefixLength + 3 + line_size * 4 + 4));
+	if (buffer == NULL) {
+		return;
+	}
+
+	out 	= buffer;
+	for (i = 0; i < length; i += line_size) {
+		memcpy(out, prefix, prefixLength);
+		out 	+= prefixLength;
+		memcpy(out, " | ", 3);
+		out 	+= 3;
+
+		// hex bytes, the last line is padded
+		for (j = 0; j < line_size; j++) {
+			if (i + j < length) {
+				*out++ 	= hexDigits[address[i + j] >> 4];
+				*out++ 	= hexDigits[address[i + j] & 0x0f];
+			}
+			else {
+				*out++ 	= '_';
+				*out++ 	= '_';
+			}
+			*out++ 	= ' ';
+		}
+
+		memcpy(out, " | ", 3);	/* right close */
+		out 	+= 3;
+
+		// printable characters
+		for (j = 0; j < line_size && i + j < length; j++) {
+			c 		= address[i + j];
+			*out++ 	= (c < 33 || c == 255) ? 0x2E : c;
+		}
+		*out++ 	= '\n';
+	}
+
+	fwrite(buffer, 1, out - buffer, stdout);
+	free(buffer);
 }
@@ -1,5 +1,10 @@
 #include <Python.h>
 #include <onion-spi.h>
+#include <onion-spi-trace.h>
+#include <onion-spi-stats.h>
+#include <onion-spi-sim.h>
+#include <onion-spi-sampler.h>
+#include <onion-spi-arbiter.h>
 
 #if PY_MAJOR_VERSION < 3
 #define PyLong_AS_LONG(val) PyInt_AS_LONG(val)
@@ -31,8 +36,21 @@ typedef struct {
 	PyObject_HEAD
 
 	struct spiParams	params;
+
+	struct spiSampler	*sampler;		// NULL if not sampling
+	uint8_t 			*sampleTx;		// data sent by the sampler
+	int 				bSampling;		// the sampler thread is running
 } OnionSpiObject;
 
+static void 	onionSpi_releaseSampler		(OnionSpiObject *self);
+
+// transfers running without the GIL and running samplers, all using the default backend,
+//	which setSimulated must not replace under them; only changed with the GIL held
+static int 		onionSpi_busyCount 		= 0;
+
+#define ONIONSPI_BEGIN_TRANSFER		onionSpi_busyCount++; Py_BEGIN_ALLOW_THREADS
+#define ONIONSPI_END_TRANSFER		Py_END_ALLOW_THREADS onionSpi_busyCount--;
+
 // required class functions
 static PyObject *
 onionSpi_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
@@ -74,6 +92,10 @@ onionSpi_init(OnionSpiObject *self, PyObject *args, PyObject *kwds)
 static PyObject *
 onionSpi_close(OnionSpiObject *self)
 {
+	// stop sampling and release the device file handle
+	onionSpi_releaseSampler(self);
+	spiCloseDevice(&(self->params));
+
 	// reset the params
 	spiParamInit(&(self->params));
 
@@ -97,7 +119,10 @@ onionSpi_dealloc(OnionSpiObject *self)
 
 static char *wrmsg_list0 	= "Empty argument list.";
 static char *wrmsg_spi 		= "SPI transaction failed.";
-static char *wrmsg_val 		= "Non-Int/Long value in arguments: %x.";
+static char *wrmsg_val 		= "Non-Int/Long value in arguments.";
+static char *wrmsg_type 	= "Values must be a list of integers or support the buffer protocol.";
+static char *wrmsg_len 		= "Number of bytes must be at least 1.";
+static char *wrmsg_rxlen 	= "Receive buffer is smaller than the data to send.";
 
 PyDoc_STRVAR(onionSpi_setVerbosity_doc,
 	"setVerbosity(level) -> None\n\n"
@@ -123,17 +148,92 @@ onionSpi_setVerbosity(OnionSpiObject *self, PyObject *args)
 }
 
 
+// get a read-only view of the data to transmit
+//	objects supporting the buffer protocol are used in place,
+//	a list or tuple of integers is converted into a temporary bytearray
+//	returns -1 with an exception set on failure
+static int
+onionSpi_getTxBuffer(PyObject *obj, Py_buffer *view)
+{
+	int 		status;
+	Py_ssize_t	bytes, i;
+	char 		*data;
+	PyObject	*seq;
+	PyObject	*tmp;
+
+#if PY_MAJOR_VERSION < 3
+	if (PyObject_CheckReadBuffer(obj)) {
+		// also covers old-style buffers, like array
+		status 	= (PyArg_Parse(obj, "s*", view) ? 0 : -1);
+	} else
+#endif
+	if (PyObject_CheckBuffer(obj)) {
+		status 	= PyObject_GetBuffer(obj, view, PyBUF_SIMPLE);
+	}
+	else if (PyList_Check(obj) || PyTuple_Check(obj)) {
+		seq 	= PySequence_Fast(obj, wrmsg_val);
+		if (seq == NULL) {
+			return -1;
+		}
+
+		bytes 	= PySequence_Fast_GET_SIZE(seq);
+		tmp 	= PyByteArray_FromStringAndSize(NULL, bytes);
+		if (tmp == NULL) {
+			Py_DECREF(seq);
+			return -1;
+		}
+		data 	= PyByteArray_AS_STRING(tmp);
+
+		// populate the values (by iterating through the list)
+		for (i = 0; i < bytes; i++) {
+			PyObject *val = PySequence_Fast_GET_ITEM(seq, i);
+#if PY_MAJOR_VERSION < 3
+			if (PyInt_Check(val)) {
+				data[i] = (char)PyInt_AS_LONG(val);
+			} else
+#endif
+			{
+				if (PyLong_Check(val)) {
+					data[i] = (char)PyLong_AsLong(val);
+				} else {
+					PyErr_SetString(PyExc_TypeError, wrmsg_val);
+					Py_DECREF(seq);
+					Py_DECREF(tmp);
+					return -1;
+				}
+			}
+		}
+		Py_DECREF(seq);
+
+		// the view keeps the temporary object alive until it is released
+		status 	= PyObject_GetBuffer(tmp, view, PyBUF_SIMPLE);
+		Py_DECREF(tmp);
+	}
+	else {
+		PyErr_SetString(PyExc_TypeError, wrmsg_type);
+		return -1;
+	}
+
+	if (status == 0 && view->len < 1) {
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		PyBuffer_Release(view);
+		return -1;
+	}
+
+	return status;
+}
+
 PyDoc_STRVAR(onionSpi_readBytes_doc,
-	"readBytes(addr, numBytes) -> [values]\n\n"
+	"readBytes(addr, numBytes) -> bytes\n\n"
 	"Read 'numBytes' bytes from address 'addr' on an SPI device.\n");
 
 static PyObject *
 onionSpi_readBytes(OnionSpiObject *self, PyObject *args)
 {
-	int 		status, addr, bytes, i;
-	uint8_t 	*txBuffer;
+	int 		status, addr, bytes;
 	uint8_t 	*rxBuffer;
-	PyObject	*list;
+	PyObject	*result;
+	struct spiParams	params;
 
 
 	// parse the arguments
@@ -141,174 +241,233 @@ onionSpi_readBytes(OnionSpiObject *self, PyObject *args)
 		return NULL;
 	}
 
-	// allocate the buffers based on the number of bytes
-	txBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
-	rxBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
+	if (bytes < 1) {
+		PyErr_SetString(PyExc_ValueError, wrmsg_len);
+		return NULL;
+	}
 
-	// populate the address
-	*txBuffer 	= (uint8_t)addr;
+	// receive directly into the bytes object to be returned
+	result 	= PyBytes_FromStringAndSize(NULL, bytes);
+	if (result == NULL) {
+		return NULL;
+	}
 
-	// perform the transfer
-	status 	= spiTransfer(&(self->params), txBuffer, rxBuffer, bytes);
+	// perform the transfer without holding the GIL
+	params 	= self->params;
+	rxBuffer 	= (uint8_t*)PyBytes_AS_STRING(result);
+	ONIONSPI_BEGIN_TRANSFER
+	status 	= spiRead(&params, addr, rxBuffer, bytes);
+	ONIONSPI_END_TRANSFER
 
 	if (status != EXIT_SUCCESS) {
+		Py_DECREF(result);
 		PyErr_SetString(PyExc_IOError, wrmsg_spi);
 		return NULL;
 	}
 
-	// build the python object to be returned from the rxBuffer
-	list = PyList_New(bytes);
+	return result;
+}
+
+
+PyDoc_STRVAR(onionSpi_readinto_doc,
+	"readinto(addr, buffer) -> numBytes\n\n"
+	"Read len(buffer) bytes from address 'addr' on an SPI device\n"
+	"into a writable buffer (bytearray, memoryview, array, ...).\n");
 
-	for (i = 0; i < bytes; i++) {
-		PyObject *val = Py_BuildValue("l", (long)rxBuffer[i]);
-		PyList_SET_ITEM(list, i, val);
+static PyObject *
+onionSpi_readinto(OnionSpiObject *self, PyObject *args)
+{
+	int 		status, addr;
+	Py_ssize_t 	bytes;
+	Py_buffer	rxView;
+	struct spiParams	params;
+
+
+	// parse the arguments
+	if (!PyArg_ParseTuple(args, "iw*", &addr, &rxView) ) {
+		return NULL;
 	}
 
-	// clean-up
-	free(txBuffer);
-	free(rxBuffer);
+	if (rxView.len < 1) {
+		PyBuffer_Release(&rxView);
+		PyErr_SetString(PyExc_ValueError, wrmsg_len);
+		return NULL;
+	}
+
+	// perform the transfer without holding the GIL, the buffer stays pinned by the view
+	params 	= self->params;
+	ONIONSPI_BEGIN_TRANSFER
+	status 	= spiRead(&params, addr, (uint8_t*)rxView.buf, (int)rxView.len);
+	ONIONSPI_END_TRANSFER
+
+	bytes 	= rxView.len;
+	PyBuffer_Release(&rxView);
 
+	if (status != EXIT_SUCCESS) {
+		PyErr_SetString(PyExc_IOError, wrmsg_spi);
+		return NULL;
+	}
 
-	return list;
+	return Py_BuildValue("n", bytes);
 }
 
 
 PyDoc_STRVAR(onionSpi_writeBytes_doc,
-	"writeBytes(addr, [values]) -> None\n\n"
-	"Write bytes from 'value' list to address 'addr' on an SPI device.\n");
+	"writeBytes(addr, values) -> None\n\n"
+	"Write bytes from 'values' to address 'addr' on an SPI device.\n"
+	"'values' can be bytes, bytearray, memoryview, array or a list of integers.\n");
 
 static PyObject *
 onionSpi_writeBytes(OnionSpiObject *self, PyObject *args)
 {
-	int 		status, addr, bytes, i;
-	uint8_t 	*txBuffer;
-	uint8_t 	*rxBuffer;
-	PyObject	*list;
-	char		wrmsg_text[4096];
+	int 		status, addr;
+	PyObject	*values;
+	Py_buffer	txView;
+	struct spiParams	params;
 
 
 	// parse the arguments
-	if (!PyArg_ParseTuple(args, "iO", &addr, &list) ) {
+	if (!PyArg_ParseTuple(args, "iO", &addr, &values) ) {
 		return NULL;
 	}
 
-	if (!PyList_Size(list) > 0) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+	if (onionSpi_getTxBuffer(values, &txView) < 0) {
 		return NULL;
 	}
 
-	// find size of list
-	bytes 	= PyList_GET_SIZE(list);
-	bytes++;	// add one for the address
+	// perform the transfer without holding the GIL, the buffer stays pinned by the view
+	params 	= self->params;
+	ONIONSPI_BEGIN_TRANSFER
+	status 	= spiWrite(&params, addr, (uint8_t*)txView.buf, (int)txView.len);
+	ONIONSPI_END_TRANSFER
 
-	// allocate the buffers based on the number of bytes
-	txBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
-	rxBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
+	PyBuffer_Release(&txView);
 
-	// populate the address
-	txBuffer[0] 	= (uint8_t)addr;
+	if (status != EXIT_SUCCESS) {
+		PyErr_SetString(PyExc_IOError, wrmsg_spi);
+		return NULL;
+	}
 
-	// populate the values (by iterating through the list)
-	for (i = 0; i < (bytes-1); i++) {
-		PyObject *val = PyList_GET_ITEM(list, i);
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			txBuffer[i+1] = (uint8_t)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				txBuffer[i+1] = (uint8_t)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				return NULL;
-			}
-		}
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+PyDoc_STRVAR(onionSpi_write_doc,
+	"write(values) -> None\n\n"
+	"Write bytes from 'values' to an SPI device.\n"
+	"'values' can be bytes, bytearray, memoryview, array or a list of integers.\n");
+
+static PyObject *
+onionSpi_write(OnionSpiObject *self, PyObject *args)
+{
+	int 		status;
+	PyObject	*values;
+	Py_buffer	txView;
+	struct spiParams	params;
+
+
+	// parse the arguments
+	if (!PyArg_ParseTuple(args, "O", &values) ) {
+		return NULL;
 	}
 
-	// perform the transfer
-	status 	= spiTransfer(&(self->params), txBuffer, rxBuffer, bytes);
+	if (onionSpi_getTxBuffer(values, &txView) < 0) {
+		return NULL;
+	}
+
+	// perform the transfer without holding the GIL, the buffer stays pinned by the view
+	params 	= self->params;
+	ONIONSPI_BEGIN_TRANSFER
+	status 	= spiTransfer(&params, (uint8_t*)txView.buf, NULL, (int)txView.len);
+	ONIONSPI_END_TRANSFER
+
+	PyBuffer_Release(&txView);
 
 	if (status != EXIT_SUCCESS) {
 		PyErr_SetString(PyExc_IOError, wrmsg_spi);
 		return NULL;
 	}
 
-	// clean-up
-	free(txBuffer);
-	free(rxBuffer);
-
-
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
-PyDoc_STRVAR(onionSpi_write_doc,
-	"write([values]) -> None\n\n"
-	"Write bytes from 'value' list to address 'addr' on an SPI device.\n");
+PyDoc_STRVAR(onionSpi_transfer_doc,
+	"transfer(txValues[, rxBuffer]) -> bytes|None\n\n"
+	"Full-duplex transfer: send 'txValues' while receiving the same number of bytes.\n"
+	"The received bytes are placed in the writable 'rxBuffer' if one is given,\n"
+	"otherwise they are returned as a bytes object.\n");
 
 static PyObject *
-onionSpi_write(OnionSpiObject *self, PyObject *args)
+onionSpi_transfer(OnionSpiObject *self, PyObject *args)
 {
-	int 		status, bytes, i;
-	uint8_t 	*txBuffer;
+	int 		status;
+	PyObject	*values;
+	PyObject	*rxObj;
+	PyObject	*result;
+	Py_buffer	txView;
+	Py_buffer	rxView;
 	uint8_t 	*rxBuffer;
-	PyObject	*list;
-	char		wrmsg_text[4096];
+	struct spiParams	params;
 
 
 	// parse the arguments
-	if (!PyArg_ParseTuple(args, "O", &list) ) {
+	rxObj 	= NULL;
+	if (!PyArg_ParseTuple(args, "O|O", &values, &rxObj) ) {
 		return NULL;
 	}
 
-	if (!PyList_Size(list) > 0) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+	if (onionSpi_getTxBuffer(values, &txView) < 0) {
 		return NULL;
 	}
 
-	// find size of list
-	bytes 	= PyList_GET_SIZE(list);
-
-	// allocate the buffers based on the number of bytes
-	txBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
-	rxBuffer  	= (uint8_t*)malloc(sizeof(uint8_t) * bytes);
-
-	// populate the values (by iterating through the list)
-	for (i = 0; i < bytes; i++) {
-		PyObject *val = PyList_GET_ITEM(list, i);
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			txBuffer[i] = (uint8_t)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				txBuffer[i] = (uint8_t)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				return NULL;
-			}
+	// find the receive buffer
+	result 	= NULL;
+	if (rxObj == NULL || rxObj == Py_None) {
+		result 	= PyBytes_FromStringAndSize(NULL, txView.len);
+		if (result == NULL) {
+			PyBuffer_Release(&txView);
+			return NULL;
 		}
+		rxBuffer 	= (uint8_t*)PyBytes_AS_STRING(result);
+	}
+	else {
+		if (PyObject_GetBuffer(rxObj, &rxView, PyBUF_WRITABLE) < 0) {
+			PyBuffer_Release(&txView);
+			return NULL;
+		}
+		if (rxView.len < txView.len) {
+			PyBuffer_Release(&rxView);
+			PyBuffer_Release(&txView);
+			PyErr_SetString(PyExc_ValueError, wrmsg_rxlen);
+			return NULL;
+		}
+		rxBuffer 	= (uint8_t*)rxView.buf;
 	}
 
-	// perform the transfer
-	status 	= spiTransfer(&(self->params), txBuffer, rxBuffer, bytes);
+	// perform the transfer without holding the GIL, the buffers stay pinned by their views
+	params 	= self->params;
+	ONIONSPI_BEGIN_TRANSFER
+	status 	= spiTransfer(&params, (uint8_t*)txView.buf, rxBuffer, (int)txView.len);
+	ONIONSPI_END_TRANSFER
+
+	PyBuffer_Release(&txView);
+	if (result == NULL) {
+		PyBuffer_Release(&rxView);
+	}
 
 	if (status != EXIT_SUCCESS) {
+		Py_XDECREF(result);
 		PyErr_SetString(PyExc_IOError, wrmsg_spi);
 		return NULL;
 	}
 
-	// clean-up
-	free(txBuffer);
-	free(rxBuffer);
-
+	if (result == NULL) {
+		Py_INCREF(Py_None);
+		result 	= Py_None;
+	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	return result;
 }
 
 PyDoc_STRVAR(onionSpi_checkDevice_doc,
@@ -322,9 +481,13 @@ onionSpi_checkDevice(OnionSpiObject *self, PyObject *args)
 {
 	int 		bNoDevice;
 	PyObject 	*result;
+	struct spiParams	params;
 
 	// check the device
-	bNoDevice 	= spiCheckDevice(self->params.busNum, self->params.deviceId, ONION_SEVERITY_DEBUG_EXTRA);
+	params 		= self->params;
+	Py_BEGIN_ALLOW_THREADS
+	bNoDevice 	= spiCheckDevice(params.busNum, params.deviceId, ONION_SEVERITY_DEBUG_EXTRA);
+	Py_END_ALLOW_THREADS
 
 	// create the python value
 	result 		= Py_BuildValue("i", bNoDevice);
@@ -344,9 +507,13 @@ onionSpi_registerDevice(OnionSpiObject *self, PyObject *args)
 {
 	int 		status;
 	PyObject 	*result;
+	struct spiParams	params;
 
-	// check the device
-	status 		= spiRegisterDevice(&(self->params));
+	// register the device, waiting for it without holding the GIL
+	params 		= self->params;
+	Py_BEGIN_ALLOW_THREADS
+	status 		= spiRegisterDevice(&params);
+	Py_END_ALLOW_THREADS
 
 	// create the python value
 	result 		= Py_BuildValue("i", status);
@@ -365,9 +532,18 @@ onionSpi_setupDevice(OnionSpiObject *self, PyObject *args)
 {
 	int 		status;
 	PyObject 	*result;
+	struct spiParams	params;
 
-	// check the device
-	status 		= spiSetupDevice(&(self->params));
+	// setup the device without holding the GIL
+	params 		= self->params;
+	ONIONSPI_BEGIN_TRANSFER
+	status 		= spiSetupDevice(&params);
+	ONIONSPI_END_TRANSFER
+
+	// keep the values read back from the device
+	self->params.modeBits 		= params.modeBits;
+	self->params.bitsPerWord 	= params.bitsPerWord;
+	self->params.speedInHz 		= params.speedInHz;
 
 	// create the python value
 	result 		= Py_BuildValue("i", status);
@@ -376,6 +552,409 @@ onionSpi_setupDevice(OnionSpiObject *self, PyObject *args)
 	return result;
 }
 
+PyDoc_STRVAR(onionSpi_traceDump_doc,
+	"traceDump(path) -> None\n\n"
+	"Write the most recent SPI transfers of this process to a trace file.\n"
+	"Convert it with tools/spi-trace-convert.py.\n");
+
+static PyObject *
+onionSpi_traceDump(OnionSpiObject *self, PyObject *args)
+{
+	int 		status;
+	const char 	*path;
+
+	// parse the arguments
+	if (!PyArg_ParseTuple(args, "s", &path) ) {
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	status 	= spiTraceDump(path);
+	Py_END_ALLOW_THREADS
+
+	if (status != EXIT_SUCCESS) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+
+// latency histogram as a dictionary of microsecond values
+static PyObject *
+onionSpi_latencyDict(struct spiStatsHistogram *histogram)
+{
+	return Py_BuildValue("{s:K,s:d,s:d,s:d,s:d,s:d,s:d}",
+			"count", 	(unsigned PY_LONG_LONG)histogram->count,
+			"min", 		histogram->minNs / 1000.0,
+			"mean", 	(histogram->count > 0 ? histogram->sumNs / 1000.0 / histogram->count : 0.0),
+			"p50", 		spiStatsPercentile(histogram, 50) / 1000.0,
+			"p90", 		spiStatsPercentile(histogram, 90) / 1000.0,
+			"p99", 		spiStatsPercentile(histogram, 99) / 1000.0,
+			"max", 		histogram->maxNs / 1000.0
+		);
+}
+
+PyDoc_STRVAR(onionSpi_getStats_doc,
+	"getStats() -> dict\n\n"
+	"Return the transfer statistics of this bus and device:\n"
+	" transfers, errors, messages, txBytes, rxBytes,\n"
+	" errnos (errno -> count), and ioctlLatency and callLatency\n"
+	" (count, min, mean, p50, p90, p99, max in microseconds).\n");
+
+static PyObject *
+onionSpi_getStats(OnionSpiObject *self, PyObject *args)
+{
+	int 		err;
+	PyObject 	*result, *errnos, *ioctlLatency, *callLatency, *key, *count;
+	struct spiStats 	*stats;
+
+	stats 	= (struct spiStats*)PyMem_Malloc(sizeof(struct spiStats));
+	if (stats == NULL) {
+		return PyErr_NoMemory();
+	}
+	spiStatsGet(self->params.busNum, self->params.deviceId, stats);
+
+	errnos 	= PyDict_New();
+	for (err = 0; errnos != NULL && err <= SPI_STATS_ERRNO_MAX; err++) {
+		if (stats->errnoCounts[err] > 0) {
+			key 	= PyLong_FromLong(err);
+			count 	= PyLong_FromUnsignedLongLong(stats->errnoCounts[err]);
+			if (key == NULL || count == NULL || PyDict_SetItem(errnos, key, count) < 0) {
+				Py_CLEAR(errnos);
+			}
+			Py_XDECREF(key);
+			Py_XDECREF(count);
+		}
+	}
+
+	ioctlLatency 	= onionSpi_latencyDict(&(stats->ioctlLatency));
+	callLatency 	= onionSpi_latencyDict(&(stats->callLatency));
+
+	result 	= NULL;
+	if (errnos != NULL && ioctlLatency != NULL && callLatency != NULL) {
+		result 	= Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:O,s:O,s:O}",
+				"transfers", 	(unsigned PY_LONG_LONG)stats->transfers,
+				"errors", 		(unsigned PY_LONG_LONG)stats->errors,
+				"messages", 	(unsigned PY_LONG_LONG)stats->messages,
+				"txBytes", 		(unsigned PY_LONG_LONG)stats->txBytes,
+				"rxBytes", 		(unsigned PY_LONG_LONG)stats->rxBytes,
+				"errnos", 		errnos,
+				"ioctlLatency", ioctlLatency,
+				"callLatency", 	callLatency
+			);
+	}
+
+	Py_XDECREF(errnos);
+	Py_XDECREF(ioctlLatency);
+	Py_XDECREF(callLatency);
+	PyMem_Free(stats);
+
+	return result;
+}
+
+PyDoc_STRVAR(onionSpi_getArbiterStats_doc,
+	"getArbiterStats() -> dict\n\n"
+	"Return the bus arbitration statistics of this bus, by class\n"
+	"('realtime', 'normal', 'bulk'): grants, yields, and waitLatency\n"
+	"and holdTime (count, min, mean, p50, p90, p99, max in microseconds).\n");
+
+static PyObject *
+onionSpi_getArbiterStats(OnionSpiObject *self, PyObject *args)
+{
+	int 		i;
+	PyObject 	*result, *item, *wait, *hold;
+	struct spiArbiterStats 	*stats;
+	static const char 		*names[SPI_PRIORITY_CLASSES] 	= { "normal", "realtime", "bulk" };
+
+	stats 	= (struct spiArbiterStats*)PyMem_Malloc(sizeof(struct spiArbiterStats));
+	if (stats == NULL) {
+		return PyErr_NoMemory();
+	}
+	spiArbiterGetStats(&(self->params), stats);
+
+	result 	= PyDict_New();
+	for (i = 0; result != NULL && i < SPI_PRIORITY_CLASSES; i++) {
+		wait 	= onionSpi_latencyDict(&(stats->classes[i].waitLatency));
+		hold 	= onionSpi_latencyDict(&(stats->classes[i].holdTime));
+
+		item 	= NULL;
+		if (wait != NULL && hold != NULL) {
+			item 	= Py_BuildValue("{s:K,s:K,s:O,s:O}",
+					"grants", 		(unsigned PY_LONG_LONG)stats->classes[i].grants,
+					"yields", 		(unsigned PY_LONG_LONG)stats->classes[i].yields,
+					"waitLatency", 	wait,
+					"holdTime", 	hold
+				);
+		}
+		if (item == NULL || PyDict_SetItemString(result, names[i], item) < 0) {
+			Py_CLEAR(result);
+		}
+
+		Py_XDECREF(item);
+		Py_XDECREF(wait);
+		Py_XDECREF(hold);
+	}
+
+	PyMem_Free(stats);
+
+	return result;
+}
+
+PyDoc_STRVAR(onionSpi_resetStats_doc,
+	"resetStats() -> None\n\n"
+	"Clear the transfer statistics of this bus and device.\n");
+
+static PyObject *
+onionSpi_resetStats(OnionSpiObject *self, PyObject *args)
+{
+	spiStatsReset(self->params.busNum, self->params.deviceId);
+
+	Py_RETURN_NONE;
+}
+
+
+// stop the sampler thread and free the sampler
+static void
+onionSpi_releaseSampler(OnionSpiObject *self)
+{
+	struct spiSampler 	*sampler;
+
+	sampler 		= self->sampler;
+	self->sampler 	= NULL;
+	if (sampler == NULL) {
+		return;
+	}
+
+	// the thread may be in a transfer
+	Py_BEGIN_ALLOW_THREADS
+	spiSamplerRelease(sampler);
+	Py_END_ALLOW_THREADS
+
+	if (self->bSampling) {
+		self->bSampling 	= 0;
+		onionSpi_busyCount--;
+	}
+
+	PyMem_Free(sampler);
+	PyMem_Free(self->sampleTx);
+	self->sampleTx 	= NULL;
+}
+
+PyDoc_STRVAR(onionSpi_startSampling_doc,
+	"startSampling(periodUs, values[, numSamples[, priority]]) -> None\n\n"
+	"Send the values every periodUs microseconds from a timer-driven thread,\n"
+	"keeping the bytes received by the last numSamples transfers (default 1024).\n"
+	"A priority of 1 to 99 runs the thread with SCHED_FIFO, if permitted.\n"
+	"Replaces the samples of an earlier startSampling.\n");
+
+static PyObject *
+onionSpi_startSampling(OnionSpiObject *self, PyObject *args)
+{
+	int 		status, periodUs, numSamples, priority;
+	PyObject	*values;
+	Py_buffer	txView;
+	struct spiSegment 	segment;
+
+
+	// parse the arguments
+	numSamples 	= 0;
+	priority 	= 0;
+	if (!PyArg_ParseTuple(args, "iO|ii", &periodUs, &values, &numSamples, &priority) ) {
+		return NULL;
+	}
+	if (periodUs <= 0) {
+		PyErr_SetString(PyExc_ValueError, "Period must be at least 1 us.");
+		return NULL;
+	}
+
+	if (onionSpi_getTxBuffer(values, &txView) < 0) {
+		return NULL;
+	}
+	if (txView.len < 1) {
+		PyBuffer_Release(&txView);
+		PyErr_SetString(PyExc_ValueError, wrmsg_len);
+		return NULL;
+	}
+
+	onionSpi_releaseSampler(self);
+
+	// the sampler keeps using the data to send
+	self->sampler 	= (struct spiSampler*)PyMem_Malloc(sizeof(struct spiSampler));
+	self->sampleTx 	= (uint8_t*)PyMem_Malloc(txView.len);
+	if (self->sampler == NULL || self->sampleTx == NULL) {
+		PyMem_Free(self->sampler);
+		PyMem_Free(self->sampleTx);
+		self->sampler 	= NULL;
+		self->sampleTx 	= NULL;
+		PyBuffer_Release(&txView);
+		return PyErr_NoMemory();
+	}
+	memcpy(self->sampleTx, txView.buf, txView.len);
+
+	// one full duplex transfer
+	memset(&segment, 0, sizeof(segment));
+	segment.txBuffer 	= self->sampleTx;
+	segment.rxBuffer 	= self->sampleTx;
+	segment.bytes 		= (int)txView.len;
+	PyBuffer_Release(&txView);
+
+	status 	= spiSamplerInit(self->sampler, &(self->params), &segment, 1, numSamples);
+	if (status == EXIT_SUCCESS) {
+		self->sampler->priority 	= priority;
+		status 	= spiSamplerStart(self->sampler, periodUs);
+	}
+
+	if (status != EXIT_SUCCESS) {
+		onionSpi_releaseSampler(self);
+		PyErr_SetString(PyExc_IOError, "Could not start sampling.");
+		return NULL;
+	}
+	self->bSampling 	= 1;
+	onionSpi_busyCount++;
+
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(onionSpi_stopSampling_doc,
+	"stopSampling() -> None\n\n"
+	"Stop the sampling thread, the samples not read yet can still be read.\n");
+
+static PyObject *
+onionSpi_stopSampling(OnionSpiObject *self, PyObject *args)
+{
+	struct spiSampler 	*sampler;
+
+	sampler 	= self->sampler;
+	if (sampler != NULL) {
+		Py_BEGIN_ALLOW_THREADS
+		spiSamplerStop(sampler);
+		Py_END_ALLOW_THREADS
+	}
+
+	if (self->bSampling) {
+		self->bSampling 	= 0;
+		onionSpi_busyCount--;
+	}
+
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(onionSpi_readSamples_doc,
+	"readSamples([maxSamples]) -> list\n\n"
+	"Return the samples taken since the last call, oldest first, without waiting,\n"
+	"as (timestampNs, period, bytes) tuples. The timestamp is CLOCK_MONOTONIC,\n"
+	"gaps in the period numbers are missed deadlines, bytes is None if the\n"
+	"transfer failed.\n");
+
+static PyObject *
+onionSpi_readSamples(OnionSpiObject *self, PyObject *args)
+{
+	int 		i, count, maxSamples;
+	uint8_t 	*data;
+	PyObject 	*result, *item;
+	struct spiSample 	*samples;
+
+	if (self->sampler == NULL) {
+		return PyList_New(0);
+	}
+
+	// parse the arguments
+	maxSamples 	= self->sampler->numSamples;
+	if (!PyArg_ParseTuple(args, "|i", &maxSamples) ) {
+		return NULL;
+	}
+	if (maxSamples < 1 || maxSamples > self->sampler->numSamples) {
+		maxSamples 	= self->sampler->numSamples;
+	}
+
+	samples 	= (struct spiSample*)PyMem_Malloc(sizeof(struct spiSample) * maxSamples);
+	data 		= (uint8_t*)PyMem_Malloc(self->sampler->sampleBytes * maxSamples);
+	if (samples == NULL || data == NULL) {
+		PyMem_Free(samples);
+		PyMem_Free(data);
+		return PyErr_NoMemory();
+	}
+
+	count 	= spiSamplerRead(self->sampler, samples, data, maxSamples);
+
+	result 	= PyList_New(count);
+	for (i = 0; result != NULL && i < count; i++) {
+		if (samples[i].status == EXIT_SUCCESS) {
+			item 	= Py_BuildValue("(KKN)",
+					(unsigned PY_LONG_LONG)samples[i].timestampNs,
+					(unsigned PY_LONG_LONG)samples[i].period,
+					PyBytes_FromStringAndSize((char*)data + i * self->sampler->sampleBytes, self->sampler->sampleBytes)
+				);
+		}
+		else {
+			item 	= Py_BuildValue("(KKO)",
+					(unsigned PY_LONG_LONG)samples[i].timestampNs,
+					(unsigned PY_LONG_LONG)samples[i].period,
+					Py_None
+				);
+		}
+
+		if (item == NULL) {
+			Py_CLEAR(result);
+		}
+		else {
+			PyList_SET_ITEM(result, i, item);
+		}
+	}
+
+	PyMem_Free(samples);
+	PyMem_Free(data);
+
+	return result;
+}
+
+PyDoc_STRVAR(onionSpi_getSamplingStats_doc,
+	"getSamplingStats() -> dict\n\n"
+	"Return the counters of the sampler: samples, missed (deadlines),\n"
+	"errors, overruns (samples overwritten before they were read), and\n"
+	"jitter and duration (count, min, mean, p50, p90, p99, max in microseconds).\n");
+
+static PyObject *
+onionSpi_getSamplingStats(OnionSpiObject *self, PyObject *args)
+{
+	PyObject 	*result, *jitter, *duration;
+	struct spiSamplerStats 	*stats;
+
+	if (self->sampler == NULL) {
+		PyErr_SetString(PyExc_ValueError, "Not sampling.");
+		return NULL;
+	}
+
+	stats 	= (struct spiSamplerStats*)PyMem_Malloc(sizeof(struct spiSamplerStats));
+	if (stats == NULL) {
+		return PyErr_NoMemory();
+	}
+	spiSamplerGetStats(self->sampler, stats);
+
+	jitter 		= onionSpi_latencyDict(&(stats->jitter));
+	duration 	= onionSpi_latencyDict(&(stats->duration));
+
+	result 	= NULL;
+	if (jitter != NULL && duration != NULL) {
+		result 	= Py_BuildValue("{s:K,s:K,s:K,s:K,s:O,s:O}",
+				"samples", 		(unsigned PY_LONG_LONG)stats->samples,
+				"missed", 		(unsigned PY_LONG_LONG)stats->missed,
+				"errors", 		(unsigned PY_LONG_LONG)stats->errors,
+				"overruns", 	(unsigned PY_LONG_LONG)stats->overruns,
+				"jitter", 		jitter,
+				"duration", 	duration
+			);
+	}
+
+	Py_XDECREF(jitter);
+	Py_XDECREF(duration);
+	PyMem_Free(stats);
+
+	return result;
+}
+
 
 /*
  * 	Define the get and set functions for the parameters
@@ -734,6 +1313,108 @@ onionSpi_set_modeBits_csHigh(OnionSpiObject *self, PyObject *val, void *closure)
 }
 
 
+// txNbits
+static PyObject *
+onionSpi_get_txNbits(OnionSpiObject *self, void *closure)
+{
+	// create a python value from the integer
+	PyObject *result = Py_BuildValue("i", self->params.txNbits);
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+onionSpi_set_txNbits(OnionSpiObject *self, PyObject *val, void *closure)
+{
+	uint32_t value;
+
+	// convert the python value
+	value 	= onionSpi_convertPyValToInt(val);
+
+	if (value == 0 || value == 1 || value == 2 || value == 4) {
+		self->params.txNbits = value;
+		if (value == 2)
+			self->params.modeBits |= SPI_TX_DUAL;
+		if (value == 4)
+			self->params.modeBits |= SPI_TX_QUAD;
+		return 0;
+	}
+
+	if (value != -1) {
+		PyErr_SetString(PyExc_ValueError,
+			"The number of data lines must be 1, 2 or 4");
+	}
+	
+	return -1;
+}
+
+// rxNbits
+static PyObject *
+onionSpi_get_rxNbits(OnionSpiObject *self, void *closure)
+{
+	// create a python value from the integer
+	PyObject *result = Py_BuildValue("i", self->params.rxNbits);
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+onionSpi_set_rxNbits(OnionSpiObject *self, PyObject *val, void *closure)
+{
+	uint32_t value;
+
+	// convert the python value
+	value 	= onionSpi_convertPyValToInt(val);
+
+	if (value == 0 || value == 1 || value == 2 || value == 4) {
+		self->params.rxNbits = value;
+		if (value == 2)
+			self->params.modeBits |= SPI_RX_DUAL;
+		if (value == 4)
+			self->params.modeBits |= SPI_RX_QUAD;
+		return 0;
+	}
+
+	if (value != -1) {
+		PyErr_SetString(PyExc_ValueError,
+			"The number of data lines must be 1, 2 or 4");
+	}
+	
+	return -1;
+}
+
+// arbitration class
+static PyObject *
+onionSpi_get_priority(OnionSpiObject *self, void *closure)
+{
+	// create a python value from the integer
+	PyObject *result = Py_BuildValue("i", self->params.priority);
+	Py_INCREF(result);
+	return result;
+}
+
+static int
+onionSpi_set_priority(OnionSpiObject *self, PyObject *val, void *closure)
+{
+	uint32_t value;
+
+	// convert the python value
+	value 	= onionSpi_convertPyValToInt(val);
+
+	if (value < SPI_PRIORITY_CLASSES) {
+		self->params.priority = value;
+		return 0;
+	}
+
+	if (value != -1) {
+		PyErr_SetString(PyExc_ValueError,
+			"The priority must be PRIORITY_NORMAL, PRIORITY_REALTIME or PRIORITY_BULK");
+	}
+
+	return -1;
+}
+
+
 // sckGpio
 static PyObject *
 onionSpi_get_sckGpio(OnionSpiObject *self, void *closure)
@@ -874,6 +1555,18 @@ static PyGetSetDef onionSpi_getset[] = {
 			"CS is active-high\n"},
 
 
+	{"txNbits", (getter)onionSpi_get_txNbits, (setter)onionSpi_set_txNbits,
+			"Data lines used to transmit: 1, 2 (dual) or 4 (quad)\n"
+			"the address phase of readBytes/writeBytes always uses 1\n"},
+	{"rxNbits", (getter)onionSpi_get_rxNbits, (setter)onionSpi_set_rxNbits,
+			"Data lines used to receive: 1, 2 (dual) or 4 (quad)\n"
+			"the address phase of readBytes/writeBytes always uses 1\n"},
+
+	{"priority", (getter)onionSpi_get_priority, (setter)onionSpi_set_priority,
+			"Arbitration class on a shared bus:\n"
+			"PRIORITY_REALTIME, PRIORITY_NORMAL (default) or PRIORITY_BULK\n"},
+
+
 	{"sck", (getter)onionSpi_get_sckGpio, (setter)onionSpi_set_sckGpio,
 			"GPIO for SCK signal\n"},
 	{"mosi", (getter)onionSpi_get_mosiGpio, (setter)onionSpi_set_mosiGpio,
@@ -904,9 +1597,21 @@ static PyMethodDef onionSpi_methods[] = {
 	{"setupDevice", 	(PyCFunction)onionSpi_setupDevice, 		METH_VARARGS, 		onionSpi_setupDevice_doc},
 
 	{"readBytes", 		(PyCFunction)onionSpi_readBytes, 		METH_VARARGS, 		onionSpi_readBytes_doc},
+	{"readinto", 		(PyCFunction)onionSpi_readinto, 		METH_VARARGS, 		onionSpi_readinto_doc},
 	{"writeBytes", 		(PyCFunction)onionSpi_writeBytes, 		METH_VARARGS, 		onionSpi_writeBytes_doc},
 
 	{"write", 			(PyCFunction)onionSpi_write, 			METH_VARARGS, 		onionSpi_write_doc},
+	{"transfer", 		(PyCFunction)onionSpi_transfer, 		METH_VARARGS, 		onionSpi_transfer_doc},
+
+	{"traceDump", 		(PyCFunction)onionSpi_traceDump, 		METH_VARARGS, 		onionSpi_traceDump_doc},
+	{"getStats", 		(PyCFunction)onionSpi_getStats, 		METH_VARARGS, 		onionSpi_getStats_doc},
+	{"resetStats", 		(PyCFunction)onionSpi_resetStats, 		METH_VARARGS, 		onionSpi_resetStats_doc},
+	{"getArbiterStats", (PyCFunction)onionSpi_getArbiterStats, 	METH_VARARGS, 		onionSpi_getArbiterStats_doc},
+
+	{"startSampling", 	(PyCFunction)onionSpi_startSampling, 	METH_VARARGS, 		onionSpi_startSampling_doc},
+	{"stopSampling", 	(PyCFunction)onionSpi_stopSampling, 	METH_VARARGS, 		onionSpi_stopSampling_doc},
+	{"readSamples", 	(PyCFunction)onionSpi_readSamples, 		METH_VARARGS, 		onionSpi_readSamples_doc},
+	{"getSamplingStats", (PyCFunction)onionSpi_getSamplingStats, METH_VARARGS, 		onionSpi_getSamplingStats_doc},
 
 	{NULL, NULL}	/* Sentinel */
 };
@@ -961,7 +1666,60 @@ static PyTypeObject OnionSpiObjectType = {
 	onionSpi_new,			/* tp_new */
 };
 
+PyDoc_STRVAR(onionSpi_setSimulated_doc,
+	"setSimulated(enable[, numRegs[, modelClock]]) -> None\n\n"
+	"Send all transfers to a simulated device instead of /dev/spidev.\n"
+	"With numRegs registers, each transfer starts with an address byte\n"
+	"(0x80 set to read) followed by register data, without registers\n"
+	"every byte sent is received back. Used to run without SPI hardware.\n"
+	"Raises RuntimeError while a transfer is running or an object is sampling.\n");
+
+// simulated device shared by all objects
+static struct spiBackend 	onionSpi_simBackend;
+static struct spiSimDevice 	onionSpi_simDevice;
+static int 					onionSpi_bSimInitialized 	= 0;
+
+static PyObject *
+onionSpi_setSimulated(PyObject *module, PyObject *args)
+{
+	int 	bEnable;
+	int 	numRegs 	= 0;
+	int 	bModelClock = 0;
+
+	// parse the arguments
+	if (!PyArg_ParseTuple(args, "i|ii", &bEnable, &numRegs, &bModelClock) ) {
+		return NULL;
+	}
+
+	// the file handle cache and the device must not go away under a transfer
+	if (onionSpi_busyCount > 0) {
+		PyErr_SetString(PyExc_RuntimeError, "Cannot change the backend while transfers are running or sampling.");
+		return NULL;
+	}
+
+	spiSetDefaultBackend(NULL);
+	spiReleaseFdCache();
+	if (onionSpi_bSimInitialized) {
+		spiSimRelease(&onionSpi_simDevice);
+		onionSpi_bSimInitialized 	= 0;
+	}
+
+	if (bEnable) {
+		if (spiSimInit(&onionSpi_simBackend, &onionSpi_simDevice, numRegs) != EXIT_SUCCESS) {
+			return PyErr_NoMemory();
+		}
+		onionSpi_simDevice.bModelClock 	= bModelClock;
+		onionSpi_bSimInitialized 		= 1;
+
+		spiSetDefaultBackend(&onionSpi_simBackend);
+	}
+
+	Py_RETURN_NONE;
+}
+
 static PyMethodDef onionSpi_module_methods[] = {
+	{"setSimulated", 	(PyCFunction)onionSpi_setSimulated, 	METH_VARARGS, 		onionSpi_setSimulated_doc},
+
 	{NULL}	/* Sentinel */
 };
 
@@ -1006,7 +1764,7 @@ void initonionSpi(void)
 #if PY_MAJOR_VERSION >= 3
 	m = PyModule_Create(&moduledef);
 #else
-	m = Py_InitModule3("onionSpi", onionSpi_methods, onionSpi_module_doc);
+	m = Py_InitModule3("onionSpi", onionSpi_module_methods, onionSpi_module_doc);
 #endif
     if (m == NULL)
 #if PY_MAJOR_VERSION >= 3
@@ -1023,6 +1781,10 @@ void initonionSpi(void)
     Py_INCREF(PyOnionSpiError);
     PyModule_AddObject(m, "error", PyOnionSpiError);
 
+	PyModule_AddIntConstant(m, "PRIORITY_NORMAL", SPI_PRIORITY_NORMAL);
+	PyModule_AddIntConstant(m, "PRIORITY_REALTIME", SPI_PRIORITY_REALTIME);
+	PyModule_AddIntConstant(m, "PRIORITY_BULK", SPI_PRIORITY_BULK);
+
 #if PY_MAJOR_VERSION >= 3
 	return m;
 #endif
@@ -0,0 +1,30 @@
+#!/bin/sh
+## run bin/spi-check on a gpio-sim chip, to check the GPIO character device backend
+## needs root and a kernel with gpio-sim, skipped otherwise
+
+configfs="/sys/kernel/config/gpio-sim"
+sim="$configfs/onion-spi-check"
+
+if [ ! -d "$configfs" ]; then
+	modprobe gpio-sim 2>/dev/null
+fi
+if [ ! -d "$configfs" ] || [ "$(id -u)" != "0" ]; then
+	echo "> gpio     skipped, gpio-sim not available"
+	exit 0
+fi
+
+## one chip with SCK, MOSI, MISO and CS on lines 0 to 3
+mkdir "$sim" "$sim/bank0" || exit 1
+echo 4 > "$sim/bank0/num_lines"
+echo 1 > "$sim/live"
+
+chip=$(cat "$sim/bank0/chip_name")
+echo pull-up > "/sys/devices/platform/$(cat "$sim/dev_name")/$chip/sim_gpio2/pull"
+
+LD_LIBRARY_PATH=lib:$LD_LIBRARY_PATH bin/spi-check --gpiochip "/dev/$chip"
+status=$?
+
+echo 0 > "$sim/live"
+rmdir "$sim/bank0" "$sim"
+
+exit $status
@@ -0,0 +1,110 @@
+#!/usr/bin/env python
+#
+# Measure the transfer path through the onionSpi Python module
+#  uses the simulated loopback device if the SPI device does not exist
+#  prints the same CSV/JSON columns as spi-bench
+#
+# Usage: spi-bench.py [-b bus] [-d device] [-n iterations] [--sizes 1,16,256] [--sim] [--format csv|json]
+
+from __future__ import print_function
+
+import argparse
+import json
+import sys
+import time
+
+import onionSpi
+
+
+COLUMNS 	= ['api', 'backend', 'bytes', 'segments', 'speed_hz', 'iterations', 'failures', 'seconds',
+				'transfers_per_sec', 'bytes_per_sec', 'p50_us', 'p90_us', 'p99_us', 'max_us']
+
+# monotonic clock where available
+clock 	= getattr(time, 'perf_counter', time.time)
+
+
+def runBench(spi, api, size, iterations):
+	tx 			= bytearray(i & 0xff for i in range(size))
+	rx 			= bytearray(size)
+	calls 		= {
+		'python-transfer': 		lambda: spi.transfer(tx, rx),
+		'python-writeBytes': 	lambda: spi.writeBytes(0x00, tx),
+		'python-readinto': 		lambda: spi.readinto(0x80, rx),
+		'python-readBytes': 	lambda: spi.readBytes(0x80, size),
+	}
+	call 		= calls[api]
+	failures 	= 0
+	latencies 	= []
+
+	# warm up the file handle and caches
+	call()
+
+	start 	= clock()
+	for i in range(iterations):
+		callStart 	= clock()
+		try:
+			call()
+		except IOError:
+			failures 	+= 1
+		latencies.append((clock() - callStart) * 1e6)
+	seconds 	= clock() - start
+
+	latencies.sort()
+	return {
+		'api': 					api,
+		'bytes': 				size,
+		'segments': 			1,
+		'speed_hz': 			spi.speed,
+		'iterations': 			iterations,
+		'failures': 			failures,
+		'seconds': 				seconds,
+		'transfers_per_sec': 	iterations / seconds if seconds > 0 else 0,
+		'bytes_per_sec': 		iterations * size / seconds if seconds > 0 else 0,
+		'p50_us': 				latencies[(iterations - 1) * 50 // 100],
+		'p90_us': 				latencies[(iterations - 1) * 90 // 100],
+		'p99_us': 				latencies[(iterations - 1) * 99 // 100],
+		'max_us': 				latencies[-1],
+	}
+
+
+def main():
+	parser 	= argparse.ArgumentParser(description='Measure the SPI transfer path through the Python module')
+	parser.add_argument('-b', '--bus', type=int, default=0)
+	parser.add_argument('-d', '--device', type=int, default=1)
+	parser.add_argument('-n', '--iterations', type=int, default=1000)
+	parser.add_argument('--sizes', default='1,4,16,64,256,1024,4096')
+	parser.add_argument('--speeds', default='1000000')
+	parser.add_argument('--apis', default='python-transfer,python-writeBytes,python-readinto,python-readBytes')
+	parser.add_argument('--sim', action='store_true', help='use the simulated device even if the SPI device exists')
+	parser.add_argument('--format', choices=['csv', 'json'], default='csv')
+	args 	= parser.parse_args()
+
+	spi 	= onionSpi.OnionSpi(args.bus, args.device)
+	spi.setVerbosity(-1)
+
+	# fall back to the simulated device
+	sim 	= args.sim or spi.checkDevice() != 0
+	if sim:
+		onionSpi.setSimulated(1)
+
+	results 	= []
+	for api in args.apis.split(','):
+		for speed in args.speeds.split(','):
+			spi.speed 	= int(speed, 0)
+			for size in args.sizes.split(','):
+				result 	= runBench(spi, api, int(size, 0), args.iterations)
+				result['backend'] 	= 'sim' if sim else 'spidev'
+				results.append(result)
+
+	if args.format == 'json':
+		print(json.dumps({'results': results}, indent=2))
+	else:
+		print(','.join(COLUMNS))
+		for r in results:
+			print(','.join(('%.6f' % r[c]) if isinstance(r[c], float) else str(r[c]) for c in COLUMNS))
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main())
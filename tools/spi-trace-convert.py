@@ -0,0 +1,131 @@
+#!/usr/bin/env python
+#
+# Convert an onion-spi trace file (spiTraceDump, spi-tool --trace, OnionSpi.traceDump)
+#  vcd:  Value Change Dump with SCK, MOSI, MISO and CS, opens in sigrok/PulseView
+#        (File > Import > Value Change Dump), then add an SPI decoder
+#  pcap: one packet per message with LINKTYPE_USER0, the payload is the trace record
+#  text: one line per message
+#
+# The waveforms are rebuilt from the recorded bytes and speed, assuming SPI mode 0, MSB first
+#  and 8 bits per word. Only the captured bytes of each message are drawn.
+#
+# Usage: spi-trace-convert.py <vcd|pcap|text> <trace file> <output file>
+
+from __future__ import print_function
+
+import struct
+import sys
+
+
+TRACE_MAGIC 		= b'SPITRACE'
+HEADER_FORMAT 		= '<8sIIII'
+RECORD_FORMAT 		= '<QIIIiIIHHHH'		# followed by the tx and rx captures
+
+LINKTYPE_USER0 		= 147
+
+
+def readTrace(path):
+	with open(path, 'rb') as f:
+		data 	= f.read()
+
+	headerSize 	= struct.calcsize(HEADER_FORMAT)
+	magic, version, recordSize, captureBytes, numRecords 	= struct.unpack_from(HEADER_FORMAT, data, 0)
+	if magic != TRACE_MAGIC:
+		raise ValueError('%s is not an SPI trace file' % path)
+	if version != 1:
+		raise ValueError('unsupported trace version %d' % version)
+
+	fields 		= struct.calcsize(RECORD_FORMAT)
+	records 	= []
+	for i in range(numRecords):
+		offset 	= headerSize + i * recordSize
+		raw 	= data[offset:offset + recordSize]
+		(timestampNs, seq, index, durationNs, status, speedInHz, length,
+			busNum, deviceId, numXfers, captured) 	= struct.unpack_from(RECORD_FORMAT, raw, 0)
+		records.append({
+			'raw': 			raw,
+			'timestampNs': 	timestampNs,
+			'index': 		index,
+			'durationNs': 	durationNs,
+			'status': 		status,
+			'speedInHz': 	speedInHz,
+			'bytes': 		length,
+			'bus': 			busNum,
+			'device': 		deviceId,
+			'xfers': 		numXfers,
+			'tx': 			bytearray(raw[fields:fields + captured]),
+			'rx': 			bytearray(raw[fields + captureBytes:fields + captureBytes + captured]),
+		})
+
+	return records
+
+
+def writeText(records, out):
+	with open(out, 'w') as f:
+		for r in records:
+			f.write('%d.%09d #%d bus%d.%d %d xfer %d bytes %d Hz %d ns status %d tx %s rx %s\n' % (
+				r['timestampNs'] // 1000000000, r['timestampNs'] % 1000000000, r['index'],
+				r['bus'], r['device'], r['xfers'], r['bytes'], r['speedInHz'], r['durationNs'], r['status'],
+				''.join('%02x' % b for b in r['tx']), ''.join('%02x' % b for b in r['rx'])))
+
+
+def writePcap(records, out):
+	with open(out, 'wb') as f:
+		# global header: magic, version 2.4, timezone, accuracy, snaplen, link type
+		f.write(struct.pack('<IHHiIII', 0xa1b23c4d, 2, 4, 0, 0, 65535, LINKTYPE_USER0))
+		for r in records:
+			# nanosecond resolution timestamps
+			f.write(struct.pack('<IIII', r['timestampNs'] // 1000000000, r['timestampNs'] % 1000000000, len(r['raw']), len(r['raw'])))
+			f.write(r['raw'])
+
+
+def writeVcd(records, out):
+	with open(out, 'w') as f:
+		f.write('$timescale 1 ns $end\n')
+		f.write('$scope module spi $end\n')
+		f.write('$var wire 1 c SCK $end\n')
+		f.write('$var wire 1 o MOSI $end\n')
+		f.write('$var wire 1 i MISO $end\n')
+		f.write('$var wire 1 s CS $end\n')
+		f.write('$upscope $end\n')
+		f.write('$enddefinitions $end\n')
+
+		if not records:
+			return
+
+		base 	= records[0]['timestampNs']
+		now 	= 0
+		f.write('#0\n0c\n0o\n0i\n1s\n')
+
+		for r in records:
+			half 	= max(1, 500000000 // max(1, r['speedInHz']))
+			# messages are drawn in order, even if a capture overlaps the next timestamp
+			now 	= max(now + half, r['timestampNs'] - base)
+
+			f.write('#%d\n0s\n' % now)
+			for tx, rx in zip(r['tx'], r['rx']):
+				for bit in range(7, -1, -1):
+					# data changes while the clock is low, sampled on the rising edge
+					f.write('#%d\n0c\n%do\n%di\n' % (now, (tx >> bit) & 1, (rx >> bit) & 1))
+					now 	+= half
+					f.write('#%d\n1c\n' % now)
+					now 	+= half
+			f.write('#%d\n0c\n' % now)
+			now 	+= half
+			f.write('#%d\n1s\n' % now)
+
+
+def main(argv):
+	if len(argv) != 4 or argv[1] not in ('vcd', 'pcap', 'text'):
+		print('Usage: %s <vcd|pcap|text> <trace file> <output file>' % argv[0])
+		return 1
+
+	records 	= readTrace(argv[2])
+	{'vcd': writeVcd, 'pcap': writePcap, 'text': writeText}[argv[1]](records, argv[3])
+	print('Converted %d records' % len(records))
+
+	return 0
+
+
+if __name__ == '__main__':
+	sys.exit(main(sys.argv))